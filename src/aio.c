@@ -0,0 +1,714 @@
+/*
+
+  aio.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "rotter.h"
+#include "config.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+
+/*
+  Asynchronous output (-A) keeps the writer threads from waiting on the
+  disk. Encoded audio is collected into large, aligned buffers, which
+  are queued to be written at a known offset in the file. Syncs and
+  closes are queued behind the writes, so the caller never blocks.
+
+  The requests go to an io_uring submission ring where the kernel
+  supports it, and otherwise to a small pool of I/O threads.
+
+  At most AIO_MAX_PENDING requests may be outstanding at once, so that
+  a stalled disk can't use up all of the memory; once that many are
+  queued, the writer waits for the disk after all. The io_uring
+  completion ring is made big enough for all of them, so that the
+  kernel never has to refuse a submission for want of room.
+*/
+
+
+// ------- Globals -------
+int async_output = 0;        // Write archive files asynchronously
+
+
+typedef enum {
+  ROTTER_AIO_WRITE=0,
+  ROTTER_AIO_SYNC,
+  ROTTER_AIO_CALLBACK
+} RotterAioOp;
+
+typedef struct rotter_aio_req_s
+{
+  struct rotter_aio_file_s *file;
+  int op;                          // RotterAioOp
+  unsigned char *buf;              // Data to write (freed once written)
+  size_t len;
+  size_t done;                     // Amount written so far (before finishing a short write)
+  off_t offset;                    // Where in the file to write it
+  int ordered;                     // Only start once the requests before it have finished
+  void (*callback)(void *arg);     // Function to call, once everything before it is done
+  void *arg;
+  struct rotter_aio_req_s *next;   // Next request in the thread pool queue
+} rotter_aio_req_t;
+
+struct rotter_aio_file_s
+{
+  int fd;
+  char *filepath;                  // For error messages
+  unsigned char *buf;              // Buffer being filled by the caller
+  size_t buf_used;
+  off_t offset;                    // Offset that the buffer will be written at
+  int pending;                     // Requests that haven't finished yet
+  int writing;                     // Writes being carried out by the thread pool
+  int closing;                     // Close the file once nothing is pending
+};
+
+
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t aio_threads[AIO_POOL_THREADS];
+static int aio_thread_count = 0;
+static int aio_pending = 0;
+static int aio_executing = 0;      // Requests taken off the queue by the thread pool
+static int aio_draining = 0;       // Don't take any more until they have finished
+static int aio_stopping = 0;
+static rotter_aio_req_t *aio_queue_head = NULL;
+static rotter_aio_req_t *aio_queue_tail = NULL;
+
+#ifdef HAVE_LIBURING
+static struct io_uring aio_ring;
+static int aio_use_uring = 0;
+static char aio_ignored;           // Data of submission entries that are to be ignored
+#endif
+
+
+// Close a file once it has been closed by the caller and nothing is left to do
+// (called with aio_lock held)
+static void rotter_aio_finish_file( rotter_aio_file_t *file )
+{
+  if (!file->closing || file->pending > 0)
+    return;
+
+  if (close( file->fd )) {
+    rotter_error( "Failed to close output file %s: %s", file->filepath, strerror(errno) );
+  }
+
+  free( file->filepath );
+  free( file );
+}
+
+
+#ifdef HAVE_LIBURING
+// Get an entry in the submission ring, making room if it is full (called with aio_lock held)
+static struct io_uring_sqe* rotter_aio_uring_sqe( int *result )
+{
+  struct io_uring_sqe *sqe = io_uring_get_sqe( &aio_ring );
+
+  *result = 0;
+  if (sqe == NULL) {
+    *result = io_uring_submit( &aio_ring );
+    if (*result < 0)
+      return NULL;
+    sqe = io_uring_get_sqe( &aio_ring );
+    if (sqe == NULL)
+      *result = -EBUSY;
+  }
+
+  return sqe;
+}
+
+
+/*
+  Queue up a request on the io_uring submission ring (called with aio_lock held).
+  Result: 0 on success, or a negative errno if the request wasn't submitted
+*/
+static int rotter_aio_uring_prep( rotter_aio_req_t *req )
+{
+  struct io_uring_sqe *sqe;
+  int result;
+
+  sqe = rotter_aio_uring_sqe( &result );
+  if (sqe == NULL)
+    return result;
+
+  if (req->op == ROTTER_AIO_WRITE) {
+    io_uring_prep_write( sqe, req->file->fd, req->buf, req->len, req->offset );
+    if (req->ordered)
+      sqe->flags |= IOSQE_IO_DRAIN;
+  } else if (req->op == ROTTER_AIO_CALLBACK) {
+    // Completes once everything submitted before it has completed
+    io_uring_prep_nop( sqe );
+    sqe->flags |= IOSQE_IO_DRAIN;
+  } else {
+    // Only sync once the writes before it have finished
+    io_uring_prep_fsync( sqe, req->file->fd, IORING_FSYNC_DATASYNC );
+    sqe->flags |= IOSQE_IO_DRAIN;
+  }
+  io_uring_sqe_set_data( sqe, req );
+
+  result = io_uring_submit( &aio_ring );
+  if (result < 0) {
+    // The entry stays in the submission ring and would go with the next
+    // submit, after the request has been given up on: make it harmless
+    io_uring_prep_nop( sqe );
+    io_uring_sqe_set_data( sqe, &aio_ignored );
+    return result;
+  }
+
+  return 0;
+}
+#endif
+
+
+// Carry out a request in the calling thread, carrying on from what has been written already
+static int rotter_aio_execute( rotter_aio_req_t *req )
+{
+  size_t done = req->done;
+
+  if (req->op == ROTTER_AIO_SYNC)
+    return fdatasync( req->file->fd ) ? -errno : 0;
+  if (req->op == ROTTER_AIO_CALLBACK)
+    return 0;
+
+  while (done < req->len) {
+    ssize_t written = pwrite( req->file->fd, req->buf + done, req->len - done, req->offset + done );
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    } else if (written == 0) {
+      break;
+    }
+    done += written;
+  }
+
+  return done;
+}
+
+
+// Tidy up after a request has been carried out
+static void rotter_aio_done( rotter_aio_req_t *req, int result )
+{
+  rotter_aio_file_t *file = req->file;
+
+  if (req->op == ROTTER_AIO_CALLBACK) {
+    req->callback( req->arg );
+
+    pthread_mutex_lock( &aio_lock );
+    aio_pending--;
+    pthread_cond_broadcast( &aio_cond );
+    pthread_mutex_unlock( &aio_lock );
+
+    free( req );
+    return;
+  }
+
+#ifdef HAVE_LIBURING
+  /*
+    Only part of it was written. The syncs and callbacks queued behind it
+    only waited for that part, so the rest must not be queued behind them:
+    it is written here, before this completion thread sees to anything
+    after it. A sync behind it may have run already, so sync again.
+  */
+  if (aio_use_uring && req->op == ROTTER_AIO_WRITE && result > 0 && (size_t)result < req->len) {
+    req->done = result;
+    result = rotter_aio_execute( req );
+    if ((size_t)result == req->len && fdatasync( file->fd )) {
+      rotter_error( "Failed to sync output file %s: %s", file->filepath, strerror(errno) );
+    }
+  }
+#endif
+
+  if (result < 0) {
+    rotter_error( "Failed to %s output file %s: %s",
+                  req->op == ROTTER_AIO_SYNC ? "sync" : "write to",
+                  file->filepath, strerror(-result) );
+  } else if (req->op == ROTTER_AIO_WRITE && result != req->len) {
+    rotter_error( "Failed to write encoded audio to %s: short write.", file->filepath );
+  }
+
+  if (req->buf)
+    free( req->buf );
+
+  pthread_mutex_lock( &aio_lock );
+  file->pending--;
+  aio_pending--;
+  rotter_aio_finish_file( file );
+  pthread_cond_broadcast( &aio_cond );
+  pthread_mutex_unlock( &aio_lock );
+
+  free( req );
+}
+
+
+// Queue up a request for a file
+static void rotter_aio_submit( rotter_aio_req_t *req )
+{
+  pthread_mutex_lock( &aio_lock );
+
+  // Wait for the disk, if too much is waiting to be written already
+  while (aio_pending >= AIO_MAX_PENDING)
+    pthread_cond_wait( &aio_cond, &aio_lock );
+
+  if (req->file)
+    req->file->pending++;
+  aio_pending++;
+
+#ifdef HAVE_LIBURING
+  if (aio_use_uring) {
+    int result = rotter_aio_uring_prep( req );
+    pthread_mutex_unlock( &aio_lock );
+
+    // Give up on it, rather than waiting for a ring that can't take it
+    if (result < 0)
+      rotter_aio_done( req, result );
+    return;
+  }
+#endif
+
+  req->next = NULL;
+  if (aio_queue_tail) {
+    aio_queue_tail->next = req;
+  } else {
+    aio_queue_head = req;
+  }
+  aio_queue_tail = req;
+  pthread_cond_broadcast( &aio_cond );
+  pthread_mutex_unlock( &aio_lock );
+}
+
+
+#ifdef HAVE_LIBURING
+static void* rotter_aio_uring_thread( void *arg )
+{
+  while (1) {
+    struct io_uring_cqe *cqe;
+    rotter_aio_req_t *req;
+    int result;
+
+    result = io_uring_wait_cqe( &aio_ring, &cqe );
+    if (result == -EINTR) {
+      continue;
+    } else if (result < 0) {
+      rotter_error( "Failed to wait for asynchronous output: %s", strerror(-result) );
+      break;
+    }
+
+    req = io_uring_cqe_get_data( cqe );
+    result = cqe->res;
+    io_uring_cqe_seen( &aio_ring, cqe );
+
+    // A request without any data means that it is time to stop
+    if (req == NULL)
+      break;
+
+    if (req != (void*)&aio_ignored)
+      rotter_aio_done( req, result );
+
+    // Pass on anything that a failed submit left in the submission ring
+    pthread_mutex_lock( &aio_lock );
+    if (io_uring_sq_ready( &aio_ring ) > 0)
+      io_uring_submit( &aio_ring );
+    pthread_mutex_unlock( &aio_lock );
+  }
+
+  return NULL;
+}
+#endif
+
+
+static void* rotter_aio_pool_thread( void *arg )
+{
+  while (1) {
+    rotter_aio_req_t *req;
+    int result;
+
+    pthread_mutex_lock( &aio_lock );
+    while ((aio_queue_head == NULL || aio_draining) && !aio_stopping)
+      pthread_cond_wait( &aio_cond, &aio_lock );
+
+    req = aio_queue_head;
+    if (req == NULL) {
+      pthread_mutex_unlock( &aio_lock );
+      break;
+    }
+
+    aio_queue_head = req->next;
+    if (aio_queue_head == NULL)
+      aio_queue_tail = NULL;
+
+    if (req->op == ROTTER_AIO_CALLBACK) {
+      // Everything before it has been taken off the queue; wait for it to be done
+      aio_draining = 1;
+      while (aio_executing > 0)
+        pthread_cond_wait( &aio_cond, &aio_lock );
+      aio_draining = 0;
+      pthread_cond_broadcast( &aio_cond );
+    } else if (req->op == ROTTER_AIO_SYNC || req->ordered) {
+      // The writes before it were taken off the queue first,
+      // but other threads may still be carrying them out
+      while (req->file->writing > 0)
+        pthread_cond_wait( &aio_cond, &aio_lock );
+    }
+    if (req->op == ROTTER_AIO_WRITE)
+      req->file->writing++;
+    aio_executing++;
+    pthread_mutex_unlock( &aio_lock );
+
+    result = rotter_aio_execute( req );
+
+    if (req->op == ROTTER_AIO_WRITE) {
+      pthread_mutex_lock( &aio_lock );
+      req->file->writing--;
+      pthread_mutex_unlock( &aio_lock );
+    }
+
+    rotter_aio_done( req, result );
+
+    pthread_mutex_lock( &aio_lock );
+    aio_executing--;
+    pthread_cond_broadcast( &aio_cond );
+    pthread_mutex_unlock( &aio_lock );
+  }
+
+  return NULL;
+}
+
+
+// Queue up the audio that has been collected so far
+int rotter_aio_flush( rotter_aio_file_t *file )
+{
+  rotter_aio_req_t *req;
+
+  if (file->buf_used == 0)
+    return 0;
+
+  req = calloc( 1, sizeof(rotter_aio_req_t) );
+  if (req == NULL) {
+    rotter_error( "Failed to allocate memory for asynchronous write." );
+    return -1;
+  }
+
+  req->file = file;
+  req->op = ROTTER_AIO_WRITE;
+  req->buf = file->buf;
+  req->len = file->buf_used;
+  req->offset = file->offset;
+
+  file->offset += file->buf_used;
+  file->buf = NULL;
+  file->buf_used = 0;
+
+  rotter_aio_submit( req );
+
+  return 0;
+}
+
+
+/*
+  Take over a file that is already open, for writers that need to set
+  it up first. Writing carries on from its current offset. If it fails,
+  the descriptor is still the caller's to close.
+*/
+rotter_aio_file_t* rotter_aio_fdopen( int fd, const char *filepath )
+{
+  rotter_aio_file_t *file = calloc( 1, sizeof(rotter_aio_file_t) );
+  if (file == NULL) {
+    rotter_error( "Failed to allocate memory for output file." );
+    return NULL;
+  }
+
+  file->offset = lseek( fd, 0, SEEK_CUR );
+  if (file->offset < 0) {
+    rotter_error( "Failed to get position in output file: %s", strerror(errno) );
+    free( file );
+    return NULL;
+  }
+
+  file->fd = fd;
+  file->filepath = strdup( filepath );
+
+  return file;
+}
+
+
+rotter_aio_file_t* rotter_aio_open( const char *filepath )
+{
+  rotter_aio_file_t *file;
+  int fd;
+
+  fd = open( filepath, O_WRONLY | O_CREAT, 0666 );
+  if (fd < 0) {
+    rotter_error( "Failed to open output file: %s", strerror(errno) );
+    return NULL;
+  }
+
+  // Carry on from the end of an existing file
+  if (lseek( fd, 0, SEEK_END ) < 0) {
+    rotter_error( "Failed to seek to end of output file: %s", strerror(errno) );
+    close( fd );
+    return NULL;
+  }
+
+  file = rotter_aio_fdopen( fd, filepath );
+  if (file == NULL)
+    close( fd );
+
+  return file;
+}
+
+
+int rotter_aio_write( rotter_aio_file_t *file, const void *data, size_t len )
+{
+  const unsigned char *bytes = data;
+
+  while (len > 0) {
+    size_t chunk = AIO_BUFFER_SIZE - file->buf_used;
+
+    if (file->buf == NULL) {
+      void *buf = NULL;
+      if (posix_memalign( &buf, AIO_BUFFER_ALIGN, AIO_BUFFER_SIZE )) {
+        rotter_error( "Failed to allocate memory for asynchronous write." );
+        return -1;
+      }
+      file->buf = buf;
+    }
+
+    if (chunk > len)
+      chunk = len;
+
+    memcpy( file->buf + file->buf_used, bytes, chunk );
+    file->buf_used += chunk;
+    bytes += chunk;
+    len -= chunk;
+
+    if (file->buf_used == AIO_BUFFER_SIZE && rotter_aio_flush( file ))
+      return -1;
+  }
+
+  return 0;
+}
+
+
+int rotter_aio_sync( rotter_aio_file_t *file )
+{
+  rotter_aio_req_t *req;
+
+  if (rotter_aio_flush( file ))
+    return -1;
+
+  req = calloc( 1, sizeof(rotter_aio_req_t) );
+  if (req == NULL) {
+    rotter_error( "Failed to allocate memory for asynchronous sync." );
+    return -1;
+  }
+
+  req->file = file;
+  req->op = ROTTER_AIO_SYNC;
+  rotter_aio_submit( req );
+
+  return 0;
+}
+
+
+/*
+  Overwrite part of the file that has already been written (such as a
+  header that is only known at the end). It is only written once
+  everything queued before it has reached the file.
+*/
+int rotter_aio_write_at( rotter_aio_file_t *file, const void *data, size_t len, off_t offset )
+{
+  rotter_aio_req_t *req;
+
+  if (rotter_aio_flush( file ))
+    return -1;
+
+  req = calloc( 1, sizeof(rotter_aio_req_t) );
+  if (req == NULL || (req->buf = malloc( len )) == NULL) {
+    rotter_error( "Failed to allocate memory for asynchronous write." );
+    free( req );
+    return -1;
+  }
+
+  memcpy( req->buf, data, len );
+  req->file = file;
+  req->op = ROTTER_AIO_WRITE;
+  req->len = len;
+  req->offset = offset;
+  req->ordered = 1;
+  rotter_aio_submit( req );
+
+  return 0;
+}
+
+
+// Offset in the file that the next byte written will end up at
+off_t rotter_aio_tell( rotter_aio_file_t *file )
+{
+  return file->offset + file->buf_used;
+}
+
+
+int rotter_aio_fd( rotter_aio_file_t *file )
+{
+  return file->fd;
+}
+
+
+// The file is closed once everything queued for it has been written
+int rotter_aio_close( rotter_aio_file_t *file )
+{
+  int result = rotter_aio_flush( file );
+
+  if (file->buf) {
+    free( file->buf );
+    file->buf = NULL;
+  }
+
+  pthread_mutex_lock( &aio_lock );
+  file->closing = 1;
+  rotter_aio_finish_file( file );
+  pthread_mutex_unlock( &aio_lock );
+
+  return result;
+}
+
+
+/*
+  Call a function once everything queued so far has been written, and
+  the files that were closed have really been closed. It is called from
+  one of the asynchronous output threads.
+*/
+int rotter_aio_after( void (*callback)(void *arg), void *arg )
+{
+  rotter_aio_req_t *req = calloc( 1, sizeof(rotter_aio_req_t) );
+  if (req == NULL) {
+    rotter_error( "Failed to allocate memory for asynchronous request." );
+    return -1;
+  }
+
+  req->op = ROTTER_AIO_CALLBACK;
+  req->callback = callback;
+  req->arg = arg;
+  rotter_aio_submit( req );
+
+  return 0;
+}
+
+
+// Start the threads that carry out asynchronous output
+int rotter_aio_start()
+{
+  int i;
+
+  aio_stopping = 0;
+
+#ifdef HAVE_LIBURING
+  {
+    // Room for a completion for every request that may be pending,
+    // and for the entries of failed submits that are ignored
+    struct io_uring_params params;
+    memset( &params, 0, sizeof(params) );
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = AIO_MAX_PENDING * 2;
+    i = io_uring_queue_init_params( AIO_QUEUE_DEPTH, &aio_ring, &params );
+  }
+  if (i == 0) {
+    aio_use_uring = 1;
+    if (pthread_create( &aio_threads[0], NULL, rotter_aio_uring_thread, NULL )) {
+      rotter_fatal( "Failed to start asynchronous output thread." );
+      return -1;
+    }
+    aio_thread_count = 1;
+    rotter_debug( "Writing archive files asynchronously using io_uring." );
+    return 0;
+  }
+
+  rotter_info( "io_uring is not available (%s); using I/O threads instead.", strerror(-i) );
+#endif
+
+  for (i=0; i<AIO_POOL_THREADS; i++) {
+    if (pthread_create( &aio_threads[i], NULL, rotter_aio_pool_thread, NULL )) {
+      rotter_fatal( "Failed to start asynchronous output thread." );
+      return -1;
+    }
+    aio_thread_count++;
+  }
+
+  rotter_debug( "Writing archive files asynchronously using %d I/O threads.", aio_thread_count );
+  return 0;
+}
+
+
+// Wait for everything queued to be written, then stop the threads
+void rotter_aio_stop()
+{
+  int i;
+
+  if (aio_thread_count == 0)
+    return;
+
+  pthread_mutex_lock( &aio_lock );
+  while (aio_pending > 0)
+    pthread_cond_wait( &aio_cond, &aio_lock );
+  aio_stopping = 1;
+  pthread_cond_broadcast( &aio_cond );
+
+#ifdef HAVE_LIBURING
+  if (aio_use_uring) {
+    int result;
+    struct io_uring_sqe *sqe = rotter_aio_uring_sqe( &result );
+    if (sqe) {
+      io_uring_prep_nop( sqe );
+      io_uring_sqe_set_data( sqe, NULL );
+      result = io_uring_submit( &aio_ring );
+    }
+    if (result < 0) {
+      // Leave the thread waiting, rather than hanging here
+      rotter_error( "Failed to stop asynchronous output thread: %s", strerror(-result) );
+      pthread_mutex_unlock( &aio_lock );
+      aio_thread_count = 0;
+      return;
+    }
+  }
+#endif
+  pthread_mutex_unlock( &aio_lock );
+
+  for (i=0; i<aio_thread_count; i++) {
+    pthread_join( aio_threads[i], NULL );
+  }
+  aio_thread_count = 0;
+
+#ifdef HAVE_LIBURING
+  if (aio_use_uring) {
+    io_uring_queue_exit( &aio_ring );
+    aio_use_uring = 0;
+  }
+#endif
+}
@@ -0,0 +1,269 @@
+/*
+
+  archive.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rotter.h"
+#include "config.h"
+
+
+/*
+  Knowledge of the archive that is shared between rotter and
+  rotter-extract: where the file for a period goes in each of the
+  file layouts, following the frames of MPEG Audio files, and the
+  entries of the seek index files.
+*/
+
+
+static int time_to_filepath_flat( const char *root_directory, const char *archive_name, struct tm *tm, const char* suffix, char* filepath )
+{
+  int n;
+
+  if (archive_name) {
+    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%s-%4.4d-%2.2d-%2.2d-%2.2d.%s",
+                  root_directory, archive_name, tm->tm_year+1900, tm->tm_mon+1,
+                  tm->tm_mday, tm->tm_hour, suffix );
+  } else {
+    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d-%2.2d-%2.2d-%2.2d.%s",
+                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_hour, suffix );
+  }
+
+  // Was a non-zero length string printed?
+  return n <= 0;
+}
+
+
+static int time_to_filepath_hierarchy( const char *root_directory, const char *archive_name, struct tm *tm, const char* suffix, char* filepath )
+{
+  int n;
+
+  if (archive_name) {
+    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d/%2.2d/%2.2d/%2.2d/%s.%s",
+                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_hour, archive_name, suffix );
+  } else {
+    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d/%2.2d/%2.2d/%2.2d/%s.%s",
+                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_hour, DEFAULT_ARCHIVE_NAME, suffix );
+  }
+
+  // Was a non-zero length string printed?
+  return n <= 0;
+}
+
+
+static int time_to_filepath_combo( const char *root_directory, const char *archive_name, struct tm *tm, const char* suffix, char* filepath )
+{
+  int n;
+
+  if (archive_name) {
+    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d/%2.2d/%2.2d/%2.2d/%s-%4.4d-%2.2d-%2.2d-%2.2d.%s",
+                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_hour, archive_name, tm->tm_year+1900, tm->tm_mon+1,
+                  tm->tm_mday, tm->tm_hour, suffix );
+  } else {
+    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d/%2.2d/%2.2d/%2.2d/%4.4d-%2.2d-%2.2d-%2.2d.%s",
+                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_hour, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_hour, suffix );
+  }
+
+  // Was a non-zero length string printed?
+  return n <= 0;
+}
+
+
+static int time_to_filepath_dailydir( const char *root_directory, const char *archive_name, struct tm *tm, const char* suffix, char* filepath )
+{
+  int n;
+
+  if (archive_name) {
+    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d-%2.2d-%2.2d/%s-%4.4d-%2.2d-%2.2d-%2.2d.%s",
+                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  archive_name, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_hour, suffix );
+  } else {
+    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d-%2.2d-%2.2d/%4.4d-%2.2d-%2.2d-%2.2d.%s",
+                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                  tm->tm_hour, suffix );
+  }
+
+  // Was a non-zero length string printed?
+  return n <= 0;
+}
+
+
+static int time_to_filepath_accurate( const char *root_directory, struct tm *tm, unsigned int usec, const char* suffix, char* filepath )
+{
+  int n;
+
+  // Create the full file path
+  n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d-%2.2d-%2.2d/%4.4d-%2.2d-%2.2d-%2.2d-%2.2d-%2.2d-%2.2d.%s",
+                root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
+                tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour,
+                tm->tm_min, tm->tm_sec, (int)(usec / 10000), suffix );
+
+  // Was a non-zero length string printed?
+  return n <= 0;
+}
+
+
+static int time_to_filepath_custom( const char *root_directory, struct tm *tm, const char * file_layout, char* filepath )
+{
+  size_t len;
+
+  // Copy root directory path and separator into new filepath
+  if (snprintf( filepath, MAX_FILEPATH_LEN, "%s/", root_directory ) <= 0)
+    return 1;
+
+  // Get the length of the root directory
+  len = strlen(filepath);
+
+  // Append custom filepath to end of the root directory path
+  // Ensure custom filepath is constructed OK by checking number of characters appended
+  // This also catches the possible error that an empty format string has been supplied
+  if(strftime( filepath + len, MAX_FILEPATH_LEN - len, file_layout, tm ) <= 0)
+    return 1;
+
+  // Success
+  return 0;
+}
+
+
+// Is this one of the built-in file layouts, whose paths end in the encoder's suffix?
+int rotter_is_named_layout( const char *file_layout )
+{
+  return !strcasecmp(file_layout, "hierarchy") || !strcasecmp(file_layout, "flat") ||
+         !strcasecmp(file_layout, "combo") || !strcasecmp(file_layout, "dailydir") ||
+         !strcasecmp(file_layout, "accurate");
+}
+
+
+// Build the path of the archive file that starts at a time
+// Result: 0=success
+int rotter_time_to_filepath( const char *root_directory, const char *archive_name, const char *file_layout,
+                             struct tm *tm, unsigned int usec, const char *suffix, char *filepath )
+{
+  if (!strcasecmp(file_layout, "hierarchy")) {
+    return time_to_filepath_hierarchy( root_directory, archive_name, tm, suffix, filepath );
+  } else if (!strcasecmp(file_layout, "flat")) {
+    return time_to_filepath_flat( root_directory, archive_name, tm, suffix, filepath );
+  } else if (!strcasecmp(file_layout, "combo")) {
+    return time_to_filepath_combo( root_directory, archive_name, tm, suffix, filepath );
+  } else if (!strcasecmp(file_layout, "dailydir")) {
+    return time_to_filepath_dailydir( root_directory, archive_name, tm, suffix, filepath );
+  } else if (!strcasecmp(file_layout, "accurate")) {
+    return time_to_filepath_accurate( root_directory, tm, usec, suffix, filepath );
+  } else {
+    return time_to_filepath_custom( root_directory, tm, file_layout, filepath );
+  }
+}
+
+
+static const int mpeg_bitrates[2][3][16] = {
+  {  // MPEG-1
+    { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0 },
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0 },
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 }
+  },
+  {  // MPEG-2 and MPEG-2.5
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 }
+  }
+};
+
+static const int mpeg_samplerates[3] = { 44100, 48000, 32000 };
+
+
+// Work out the length and duration of an MPEG Audio frame from its header
+// Result: 0=success
+int rotter_parse_mpeg_header(const unsigned char *header, int *frame_len, int *samples, int *samplerate)
+{
+  int version = (header[1] >> 3) & 0x03;    // 3=MPEG-1, 2=MPEG-2, 0=MPEG-2.5
+  int layer = 4 - ((header[1] >> 1) & 0x03);
+  int bitrate_index = header[2] >> 4;
+  int samplerate_index = (header[2] >> 2) & 0x03;
+  int padding = (header[2] >> 1) & 0x01;
+  int lsf = (version != 3);
+  int bitrate;
+
+  // Free format frames can't be followed without searching for the next header
+  if (header[0] != 0xFF || (header[1] & 0xE0) != 0xE0 || version == 1 || layer == 4 ||
+      bitrate_index == 0 || bitrate_index == 15 || samplerate_index == 3)
+    return -1;
+
+  bitrate = mpeg_bitrates[lsf][layer-1][bitrate_index] * 1000;
+  *samplerate = mpeg_samplerates[samplerate_index];
+  if (version == 2) *samplerate /= 2;
+  else if (version == 0) *samplerate /= 4;
+
+  if (layer == 1) {
+    *samples = 384;
+    *frame_len = (12 * bitrate / *samplerate + padding) * 4;
+  } else if (layer == 2 || !lsf) {
+    *samples = 1152;
+    *frame_len = 144 * bitrate / *samplerate + padding;
+  } else {
+    *samples = 576;
+    *frame_len = 72 * bitrate / *samplerate + padding;
+  }
+
+  return 0;
+}
+
+
+// Pack an entry of a seek index (see mpegaudiofile.c)
+void rotter_put_seek_entry( unsigned char *entry, time_t when, off_t offset )
+{
+  int64_t values[2];
+  int i, v;
+
+  values[0] = when;
+  values[1] = offset;
+  for (v=0; v<2; v++) {
+    for (i=0; i<8; i++)
+      *entry++ = (uint64_t)values[v] >> (i * 8);
+  }
+}
+
+
+// Unpack an entry of a seek index
+void rotter_get_seek_entry( const unsigned char *entry, time_t *when, off_t *offset )
+{
+  uint64_t values[2] = { 0, 0 };
+  int i, v;
+
+  for (v=0; v<2; v++) {
+    for (i=0; i<8; i++)
+      values[v] |= (uint64_t)*entry++ << (i * 8);
+  }
+
+  *when = (int64_t)values[0];
+  *offset = (int64_t)values[1];
+}
@@ -0,0 +1,88 @@
+/*
+
+  bench.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "bench.h"
+#include "config.h"
+
+
+/*
+  Shared by the benchmark programs, which are built with 'make check'.
+
+  Each benchmark links the parts of rotter that it times, and this file
+  stands in for the rest: log messages from those parts go to stderr,
+  apart from debug and info messages, which would disturb the timings.
+*/
+
+
+void rotter_log( RotterLogLevel level, const char* fmt, ... )
+{
+  va_list args;
+
+  if (level == ROTTER_DEBUG || level == ROTTER_INFO)
+    return;
+
+  va_start( args, fmt );
+  vfprintf( stderr, fmt, args );
+  va_end( args );
+  fprintf( stderr, "\n" );
+
+  if (level == ROTTER_FATAL)
+    exit( -1 );
+}
+
+
+// Seconds on the monotonic clock
+double bench_now()
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// Fill a buffer with noise between -1.0 and 1.0, which is the same for the same seed
+void bench_fill( jack_default_audio_sample_t *buf, size_t count, uint32_t seed )
+{
+  uint32_t x = seed ? seed : 1;
+  size_t i;
+
+  for (i=0; i<count; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf[i] = (int32_t)x / 2147483648.0f;
+  }
+}
+
+
+// Print how long something took, and how many times faster than real time that is
+void bench_report( const char *name, size_t frames, double seconds )
+{
+  printf( "  %-32s %8.3f s  %8.1f x realtime\n", name, seconds,
+          frames / (double)BENCH_SAMPLERATE / seconds );
+}
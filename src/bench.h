@@ -0,0 +1,46 @@
+/*
+
+  bench.h
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+
+#include "rotter.h"
+
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+
+// ------- Constants -------
+#define BENCH_SAMPLERATE      (48000)
+#define BENCH_DEFAULT_SECS    (600)
+#define BENCH_JACK_PERIOD     (256)
+
+
+// ------- Prototypes -------
+
+// In bench.c
+double bench_now();
+void bench_fill( jack_default_audio_sample_t *buf, size_t count, uint32_t seed );
+void bench_report( const char *name, size_t frames, double seconds );
+
+
+#endif
@@ -0,0 +1,219 @@
+/*
+
+  benchbatch.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "config.h"
+
+
+/*
+  Times encoding the same audio to a file with several batch sizes (-B),
+  using rotter's own encoders, to show what passing the encoders more
+  than one frame at a time saves.
+
+  The benchmark runs without a JACK server, so it supplies the few
+  globals that the encoders expect from rotter.c and jack.c, and
+  answers their question about the sample rate itself.
+*/
+
+
+// ------- Globals -------
+jack_client_t *client = NULL;
+char *originator = "bench-batch";
+double vbr_quality = -1;
+
+
+static output_format_t bench_formats[] =
+{
+#ifdef HAVE_TWOLAME
+  { "mp2",  "MPEG Audio Layer 2", TWOLAME_SAMPLES_PER_FRAME, 0, init_twolame },
+#endif
+
+#ifdef HAVE_LAME
+  { "mp3",  "MPEG Audio Layer 3", LAME_SAMPLES_PER_FRAME, 0, init_lame },
+#endif
+
+#ifdef HAVE_OPUSENC
+  { "opus", "Ogg Opus", OPUS_SAMPLES_PER_FRAME, 0, init_opus },
+#endif
+
+#ifdef HAVE_FLAC
+  { "flac", "FLAC 16 bit", FLAC_SAMPLES_PER_FRAME, 16, init_flac },
+#endif
+
+  { "wav",  "WAV (Microsoft 16 bit PCM)",
+    PCMFILE_SAMPLES_PER_FRAME, ROTTER_PCM_WAV16, init_pcmfile },
+
+  // End of list
+  { NULL,   NULL,               0 },
+};
+
+
+jack_nframes_t jack_get_sample_rate( jack_client_t *jack_client )
+{
+  return BENCH_SAMPLERATE;
+}
+
+
+// Encode 'total' frames of 'audio' to a file, 'batch' frames at a time
+static double bench_encode( encoder_funcs_t *encoder, const char *filepath,
+                            const jack_default_audio_sample_t *audio,
+                            size_t batch, size_t total )
+{
+  struct timeval file_start;
+  double start, seconds;
+  size_t done;
+  void *fh;
+
+  gettimeofday( &file_start, NULL );
+
+  start = bench_now();
+  fh = encoder->open( encoder, filepath, &file_start );
+  if (fh == NULL) {
+    fprintf( stderr, "Failed to open %s.\n", filepath );
+    exit( -1 );
+  }
+
+  for (done=0; done<total; done+=batch) {
+    size_t frames = total - done < batch ? total - done : batch;
+    if (encoder->write( encoder, fh, frames, audio )) {
+      fprintf( stderr, "Failed to encode audio.\n" );
+      exit( -1 );
+    }
+  }
+
+  encoder->close( encoder, fh, &file_start );
+  seconds = bench_now() - start;
+
+  if (encoder->reset && encoder->reset( encoder )) {
+    fprintf( stderr, "Failed to reset encoder.\n" );
+    exit( -1 );
+  }
+
+  return seconds;
+}
+
+
+static void usage()
+{
+  printf("Usage: bench-batch [options]\n");
+  printf("   -f <format>   Format to encode (default all of them)\n");
+  printf("   -B <list>     Batch sizes to try, in encoder frames (default 1,2,4,8,16)\n");
+  printf("   -c <channels> Number of channels (default %d)\n", DEFAULT_CHANNELS);
+  printf("   -b <bitrate>  Bitrate (in kbps, default %d)\n", DEFAULT_BITRATE);
+  printf("   -s <secs>     Seconds of audio to encode (default 60)\n");
+  printf("   -d <dir>      Directory to write the files in (default /tmp)\n");
+  exit(1);
+}
+
+
+int main( int argc, char *argv[] )
+{
+  const char *format_name = NULL;
+  char default_batches[] = "1,2,4,8,16";
+  char *batch_list = default_batches;
+  const char *dir = "/tmp";
+  int channels = DEFAULT_CHANNELS;
+  int bitrate = DEFAULT_BITRATE;
+  size_t total = 60 * BENCH_SAMPLERATE;
+  size_t batches[32];
+  int batch_count = 0;
+  size_t max_batch = 0;
+  char *token, *saveptr = NULL;
+  int opt, i, b;
+
+  while ((opt = getopt(argc, argv, "f:B:c:b:s:d:h")) != -1) {
+    switch (opt) {
+      case 'f': format_name = optarg; break;
+      case 'B': batch_list = optarg; break;
+      case 'c': channels = atoi(optarg); break;
+      case 'b': bitrate = atoi(optarg); break;
+      case 's': total = atol(optarg) * BENCH_SAMPLERATE; break;
+      case 'd': dir = optarg; break;
+      default: usage(); break;
+    }
+  }
+
+  for (token = strtok_r( batch_list, ",", &saveptr ); token && batch_count < 32;
+       token = strtok_r( NULL, ",", &saveptr )) {
+    batches[batch_count] = atol( token );
+    if (batches[batch_count] < 1)
+      usage();
+    if (batches[batch_count] > max_batch)
+      max_batch = batches[batch_count];
+    batch_count++;
+  }
+
+  if (channels < 1 || batch_count == 0 || total == 0)
+    usage();
+
+  rotter_convert_init();
+
+  for (i=0; bench_formats[i].name; i++) {
+    output_format_t *format = &bench_formats[i];
+    size_t max_frames = max_batch * format->samples_per_frame;
+    jack_default_audio_sample_t *audio;
+    encoder_funcs_t *encoder;
+    char filepath[MAX_FILEPATH_LEN];
+    size_t j;
+
+    if (format_name && strcmp( format_name, format->name ))
+      continue;
+
+    encoder = format->initfunc( format, channels, bitrate );
+    if (encoder == NULL) {
+      fprintf( stderr, "Failed to initialise %s encoder.\n", format->name );
+      return 1;
+    }
+    encoder->period_seconds = total / BENCH_SAMPLERATE;
+
+    // Quiet noise, which is hard work for the encoders without clipping
+    audio = calloc( max_frames * channels, sizeof(jack_default_audio_sample_t) );
+    bench_fill( audio, max_frames * channels, i + 1 );
+    for (j=0; j<max_frames * channels; j++)
+      audio[j] *= 0.25f;
+
+    snprintf( filepath, sizeof(filepath), "%s/bench-batch-%d.%s", dir, (int)getpid(), encoder->file_suffix );
+
+    printf( "%s, %d channels, %zu seconds of audio:\n",
+            format->desc, channels, total / BENCH_SAMPLERATE );
+
+    for (b=0; b<batch_count; b++) {
+      char name[32];
+      double seconds = bench_encode( encoder, filepath, audio,
+                                     batches[b] * format->samples_per_frame, total );
+      snprintf( name, sizeof(name), "-B %zu", batches[b] );
+      bench_report( name, total, seconds );
+    }
+
+    unlink( filepath );
+    encoder->deinit( encoder );
+    free( audio );
+  }
+
+  return 0;
+}
@@ -0,0 +1,276 @@
+/*
+
+  benchconvert.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "config.h"
+
+// The kernels are private to convert.c, so it is built into this program
+#include "convert.c"
+
+
+/*
+  Times each of the float to 16-bit conversion kernels that this CPU
+  can run, with and without dither, on batches the size that the
+  encoders convert at a time.
+
+  Then times rotter_interleave() a JACK period at a time, as the JACK
+  callback uses it: for mono, for stereo with each of the stereo
+  kernels, and for more channels with each of the four channel kernels.
+
+  Without dither, every kernel must give exactly the same samples as
+  the scalar one.
+*/
+
+
+typedef struct bench_convert_s
+{
+  const char *name;
+  convert_func_t func;
+  int supported;
+} bench_convert_t;
+
+
+typedef struct bench_interleave_s
+{
+  const char *name;
+  interleave_func_t stereo;
+  interleave_quad_func_t quad;
+  int supported;
+} bench_interleave_t;
+
+
+static size_t batch_frames = 1152;
+static int channels = DEFAULT_CHANNELS;
+static size_t jack_period = BENCH_JACK_PERIOD;
+
+
+static double bench_convert( convert_func_t func, const jack_default_audio_sample_t *in,
+                             int16_t *out, size_t total, rotter_dither_t *dither )
+{
+  const size_t count = batch_frames * channels;
+  double start = bench_now();
+  size_t done;
+
+  for (done=0; done<total; done+=batch_frames)
+    func( in, out, count, dither );
+
+  return bench_now() - start;
+}
+
+
+// Interleave 'total' frames a JACK period at a time, and check them against 'expected'
+static int bench_interleave( const char *name, int interleave_channels, size_t total,
+                             jack_default_audio_sample_t **src,
+                             const jack_default_audio_sample_t *expected )
+{
+  jack_default_audio_sample_t *dest = calloc( jack_period * interleave_channels,
+                                              sizeof(jack_default_audio_sample_t) );
+  double start = bench_now();
+  size_t done;
+  int result = 0;
+
+  for (done=0; done<total; done+=jack_period)
+    rotter_interleave( dest, src, 0, jack_period, interleave_channels );
+
+  bench_report( name, total, bench_now() - start );
+
+  if (memcmp( dest, expected, jack_period * interleave_channels * sizeof(jack_default_audio_sample_t) )) {
+    fprintf( stderr, "Interleaving with the %s kernels differs from the scalar ones.\n", name );
+    result = 1;
+  }
+
+  free( dest );
+  return result;
+}
+
+
+// Time the interleaving of 'interleave_channels' channels with each set of kernels
+static int bench_interleave_channels( bench_interleave_t *kernels, int interleave_channels, size_t total )
+{
+  jack_default_audio_sample_t **src = calloc( interleave_channels, sizeof(jack_default_audio_sample_t*) );
+  jack_default_audio_sample_t *expected = calloc( jack_period * interleave_channels,
+                                                  sizeof(jack_default_audio_sample_t) );
+  int result = 0;
+  int c, k;
+
+  for (c=0; c<interleave_channels; c++) {
+    src[c] = calloc( jack_period, sizeof(jack_default_audio_sample_t) );
+    bench_fill( src[c], jack_period, c + 1 );
+  }
+
+  printf( "Interleaving %d channels, %zu frame JACK periods, %zu seconds of audio:\n",
+          interleave_channels, jack_period, total / BENCH_SAMPLERATE );
+
+  interleave_stereo_func = interleave_stereo_scalar;
+  interleave_quad_func = interleave_quad_scalar;
+  rotter_interleave( expected, src, 0, jack_period, interleave_channels );
+
+  for (k=0; kernels[k].name; k++) {
+    // Mono is a plain copy, whatever the kernels
+    if (interleave_channels == 1 && k > 0)
+      break;
+
+    // Only time the kernels that this channel count uses
+    if (interleave_channels == 2 && !kernels[k].stereo)
+      continue;
+    if (interleave_channels > 2 && !kernels[k].quad)
+      continue;
+
+    if (!kernels[k].supported) {
+      printf( "  %-32s not supported by this CPU\n", kernels[k].name );
+      continue;
+    }
+
+    if (kernels[k].stereo)
+      interleave_stereo_func = kernels[k].stereo;
+    if (kernels[k].quad)
+      interleave_quad_func = kernels[k].quad;
+
+    if (bench_interleave( interleave_channels == 1 ? "memcpy" : kernels[k].name,
+                          interleave_channels, total, src, expected ))
+      result = 1;
+  }
+
+  for (c=0; c<interleave_channels; c++)
+    free( src[c] );
+  free( src );
+  free( expected );
+
+  return result;
+}
+
+
+static void usage()
+{
+  printf("Usage: bench-convert [options]\n");
+  printf("   -c <channels> Number of channels (default %d)\n", DEFAULT_CHANNELS);
+  printf("   -b <frames>   Frames converted at a time (default 1152)\n");
+  printf("   -s <secs>     Seconds of audio to convert (default %d)\n", BENCH_DEFAULT_SECS);
+  printf("   -N <channels> Number of channels for the multichannel interleave (default 6)\n");
+  printf("   -n <frames>   Frames in each JACK period, for interleaving (default %d)\n", BENCH_JACK_PERIOD);
+  exit(1);
+}
+
+
+int main( int argc, char *argv[] )
+{
+  bench_convert_t kernels[] = {
+    { "scalar", convert_scalar, 1 },
+#ifdef ROTTER_CONVERT_X86
+    { "SSE2", convert_sse2, __builtin_cpu_supports( "sse2" ) },
+    { "AVX2", convert_avx2, __builtin_cpu_supports( "avx2" ) },
+#endif
+#ifdef ROTTER_CONVERT_NEON
+    { "NEON", convert_neon, 1 },
+#endif
+    { NULL, NULL, 0 }
+  };
+  bench_interleave_t interleavers[] = {
+    { "scalar", interleave_stereo_scalar, interleave_quad_scalar, 1 },
+#ifdef ROTTER_CONVERT_X86
+    { "SSE2", interleave_stereo_sse2, interleave_quad_sse2, __builtin_cpu_supports( "sse2" ) },
+    { "AVX", interleave_stereo_avx, NULL, __builtin_cpu_supports( "avx" ) },
+#endif
+#ifdef ROTTER_CONVERT_NEON
+    { "NEON", interleave_stereo_neon, interleave_quad_neon, 1 },
+#endif
+    { NULL, NULL, NULL, 0 }
+  };
+  int multichannel = 6;
+  size_t total = BENCH_DEFAULT_SECS * BENCH_SAMPLERATE;
+  jack_default_audio_sample_t *in;
+  int16_t *expected, *out;
+  rotter_dither_t dither;
+  int result = 0;
+  int opt, k;
+  size_t i;
+
+  while ((opt = getopt(argc, argv, "c:b:s:N:n:h")) != -1) {
+    switch (opt) {
+      case 'c': channels = atoi(optarg); break;
+      case 'b': batch_frames = atol(optarg); break;
+      case 's': total = atol(optarg) * BENCH_SAMPLERATE; break;
+      case 'N': multichannel = atoi(optarg); break;
+      case 'n': jack_period = atol(optarg); break;
+      default: usage(); break;
+    }
+  }
+
+  if (channels < 1 || batch_frames < 1 || multichannel < 3 || jack_period < 1)
+    usage();
+
+#ifdef ROTTER_CONVERT_X86
+  __builtin_cpu_init();
+#endif
+
+  // A little louder than full scale, so that clipping is timed too
+  in = calloc( batch_frames * channels, sizeof(jack_default_audio_sample_t) );
+  bench_fill( in, batch_frames * channels, 1 );
+  for (i=0; i<batch_frames * channels; i++)
+    in[i] *= 1.1f;
+
+  expected = calloc( batch_frames * channels, sizeof(int16_t) );
+  out = calloc( batch_frames * channels, sizeof(int16_t) );
+  convert_scalar( in, expected, batch_frames * channels, NULL );
+
+  printf( "Converting %d channels, %zu frame batches, %zu seconds of audio:\n",
+          channels, batch_frames, total / BENCH_SAMPLERATE );
+
+  for (k=0; kernels[k].name; k++) {
+    char name[32];
+
+    if (!kernels[k].supported) {
+      printf( "  %-32s not supported by this CPU\n", kernels[k].name );
+      continue;
+    }
+
+    snprintf( name, sizeof(name), "%s", kernels[k].name );
+    bench_report( name, total, bench_convert( kernels[k].func, in, out, total, NULL ) );
+    if (memcmp( out, expected, batch_frames * channels * sizeof(int16_t) )) {
+      fprintf( stderr, "The %s conversion differs from the scalar one.\n", kernels[k].name );
+      result = 1;
+    }
+
+    rotter_dither_init( &dither );
+    snprintf( name, sizeof(name), "%s, with dither", kernels[k].name );
+    bench_report( name, total, bench_convert( kernels[k].func, in, out, total, &dither ) );
+  }
+
+  free( in );
+  free( expected );
+  free( out );
+
+  if (bench_interleave_channels( interleavers, 1, total ))
+    result = 1;
+  if (bench_interleave_channels( interleavers, 2, total ))
+    result = 1;
+  if (bench_interleave_channels( interleavers, multichannel, total ))
+    result = 1;
+
+  return result;
+}
@@ -0,0 +1,194 @@
+/*
+
+  benchring.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <jack/ringbuffer.h>
+
+#include "bench.h"
+#include "config.h"
+
+
+/*
+  Times moving audio from the JACK callback to the writer, through the
+  interleaved frame ring (framering.c) and through a jack_ringbuffer_t
+  for each channel, as rotter did before.
+
+  JACK periods of audio are written in, and batches read out as soon as
+  they are there, until the requested length of audio has gone through.
+  Both ways end with interleaved frames for the encoder, which are summed
+  to stand in for it reading them; the sums must match.
+*/
+
+
+static int channels = DEFAULT_CHANNELS;
+static size_t jack_period = BENCH_JACK_PERIOD;
+static size_t batch_frames = 1152;
+static size_t ring_frames = DEFAULT_RB_LEN * BENCH_SAMPLERATE;
+
+
+static double sum_frames( const jack_default_audio_sample_t *buf, size_t frames )
+{
+  double sum = 0.0;
+  size_t i;
+
+  for (i=0; i<frames * channels; i++)
+    sum += buf[i];
+
+  return sum;
+}
+
+
+static double bench_framering( jack_default_audio_sample_t **src, size_t total, double *sum )
+{
+  rotter_framering_t *ring = rotter_framering_create( channels, ring_frames );
+  rotter_framering_vector_t vec[2];
+  double start;
+  size_t done;
+
+  if (!ring) {
+    fprintf( stderr, "Failed to create frame ring.\n" );
+    exit( -1 );
+  }
+
+  *sum = 0.0;
+  start = bench_now();
+  for (done=0; done<total; done+=jack_period) {
+    rotter_framering_write( ring, src, 0, jack_period );
+
+    while (rotter_framering_read_space( ring ) >= batch_frames) {
+      size_t frames = rotter_framering_get_read_vector( ring, vec, batch_frames );
+      *sum += sum_frames( vec[0].buf, vec[0].frames );
+      *sum += sum_frames( vec[1].buf, vec[1].frames );
+      rotter_framering_read_advance( ring, frames );
+    }
+  }
+
+  rotter_framering_free( ring );
+  return bench_now() - start;
+}
+
+
+static double bench_jack_ringbuffer( jack_default_audio_sample_t **src, size_t total, double *sum )
+{
+  const size_t sample_size = sizeof(jack_default_audio_sample_t);
+  jack_ringbuffer_t **rb = calloc( channels, sizeof(jack_ringbuffer_t*) );
+  jack_default_audio_sample_t **tmp = calloc( channels, sizeof(jack_default_audio_sample_t*) );
+  jack_default_audio_sample_t *interleaved = calloc( batch_frames * channels, sample_size );
+  double start;
+  size_t done;
+  int c;
+
+  for (c=0; c<channels; c++) {
+    rb[c] = jack_ringbuffer_create( ring_frames * sample_size );
+    tmp[c] = calloc( batch_frames, sample_size );
+  }
+
+  *sum = 0.0;
+  start = bench_now();
+  for (done=0; done<total; done+=jack_period) {
+    for (c=0; c<channels; c++)
+      jack_ringbuffer_write( rb[c], (char*)src[c], jack_period * sample_size );
+
+    while (jack_ringbuffer_read_space( rb[0] ) >= batch_frames * sample_size) {
+      for (c=0; c<channels; c++)
+        jack_ringbuffer_read( rb[c], (char*)tmp[c], batch_frames * sample_size );
+      rotter_interleave( interleaved, tmp, 0, batch_frames, channels );
+      *sum += sum_frames( interleaved, batch_frames );
+    }
+  }
+
+  for (c=0; c<channels; c++) {
+    jack_ringbuffer_free( rb[c] );
+    free( tmp[c] );
+  }
+  free( interleaved );
+  free( tmp );
+  free( rb );
+  return bench_now() - start;
+}
+
+
+static void usage()
+{
+  printf("Usage: bench-ring [options]\n");
+  printf("   -c <channels> Number of channels (default %d)\n", DEFAULT_CHANNELS);
+  printf("   -n <frames>   Frames in each JACK period (default %d)\n", BENCH_JACK_PERIOD);
+  printf("   -b <frames>   Frames read by the writer at a time (default 1152)\n");
+  printf("   -s <secs>     Seconds of audio to move (default %d)\n", BENCH_DEFAULT_SECS);
+  exit(1);
+}
+
+
+int main( int argc, char *argv[] )
+{
+  jack_default_audio_sample_t **src;
+  size_t total = BENCH_DEFAULT_SECS * BENCH_SAMPLERATE;
+  double framering_sum, jack_sum;
+  double framering_secs, jack_secs;
+  int opt, c;
+
+  while ((opt = getopt(argc, argv, "c:n:b:s:h")) != -1) {
+    switch (opt) {
+      case 'c': channels = atoi(optarg); break;
+      case 'n': jack_period = atol(optarg); break;
+      case 'b': batch_frames = atol(optarg); break;
+      case 's': total = atol(optarg) * BENCH_SAMPLERATE; break;
+      default: usage(); break;
+    }
+  }
+
+  if (channels < 1 || jack_period < 1 || batch_frames < 1 ||
+      jack_period + batch_frames > ring_frames)
+    usage();
+
+  rotter_convert_init();
+
+  src = calloc( channels, sizeof(jack_default_audio_sample_t*) );
+  for (c=0; c<channels; c++) {
+    src[c] = calloc( jack_period, sizeof(jack_default_audio_sample_t) );
+    bench_fill( src[c], jack_period, c + 1 );
+  }
+
+  printf( "%d channels, %zu frame JACK periods, %zu frame reads, %zu seconds of audio:\n",
+          channels, jack_period, batch_frames, total / BENCH_SAMPLERATE );
+
+  framering_secs = bench_framering( src, total, &framering_sum );
+  jack_secs = bench_jack_ringbuffer( src, total, &jack_sum );
+
+  bench_report( "framering", total, framering_secs );
+  bench_report( "jack_ringbuffer per channel", total, jack_secs );
+
+  for (c=0; c<channels; c++)
+    free( src[c] );
+  free( src );
+
+  if (framering_sum != jack_sum) {
+    fprintf( stderr, "The audio read from the two rings differs.\n" );
+    return 1;
+  }
+
+  return 0;
+}
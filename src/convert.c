@@ -0,0 +1,536 @@
+/*
+
+  convert.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "rotter.h"
+#include "config.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ROTTER_CONVERT_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define ROTTER_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+
+/*
+  Conversion of floating point samples to 16-bit integers.
+
+  Samples are scaled, clamped and rounded to the nearest integer, in
+  blocks using whichever vector instructions the CPU has; the kernel is
+  picked once at start-up by rotter_convert_init().
+
+  With dither enabled (-D), triangular (TPDF) noise of +/-1 LSB is
+  added before rounding. Each random number is made by a xorshift
+  generator and its two 16-bit halves are subtracted, which gives the
+  triangular distribution without needing two generators.
+
+  The JACK callback uses the interleaving kernels here to copy each
+  port's buffer into the frame ring: mono is a plain copy, stereo is
+  unpacked with vector instructions, and other channel counts are
+  transposed four channels at a time, a tile of frames at a time so
+  that the strided stores stay within the cache.
+*/
+
+
+// ------- Globals -------
+int dither_output = 0;       // Add TPDF dither when reducing to 16 bits
+
+typedef void (*convert_func_t)( const jack_default_audio_sample_t *in, int16_t *out,
+                                size_t count, rotter_dither_t *dither );
+
+static void convert_scalar( const jack_default_audio_sample_t *in, int16_t *out,
+                            size_t count, rotter_dither_t *dither );
+
+typedef void (*interleave_func_t)( jack_default_audio_sample_t *dest,
+                                   const jack_default_audio_sample_t *left,
+                                   const jack_default_audio_sample_t *right,
+                                   size_t nframes );
+
+static void interleave_stereo_scalar( jack_default_audio_sample_t *dest,
+                                      const jack_default_audio_sample_t *left,
+                                      const jack_default_audio_sample_t *right,
+                                      size_t nframes );
+
+typedef void (*interleave_quad_func_t)( jack_default_audio_sample_t *dest, unsigned int stride,
+                                        jack_default_audio_sample_t **in, size_t nframes );
+
+static void interleave_quad_scalar( jack_default_audio_sample_t *dest, unsigned int stride,
+                                    jack_default_audio_sample_t **in, size_t nframes );
+
+static convert_func_t convert_func = convert_scalar;
+static interleave_func_t interleave_stereo_func = interleave_stereo_scalar;
+static interleave_quad_func_t interleave_quad_func = interleave_quad_scalar;
+
+
+// Number of frames interleaved at a time, for more than two channels
+#define INTERLEAVE_TILE  (256)
+
+// Scale of the difference of two 16-bit random numbers, to give +/-1 LSB
+#define DITHER_SCALE     (1.0f / 65536.0f)
+
+
+static inline uint32_t xorshift32( uint32_t x )
+{
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+
+// Seed the dither generators; each lane must start non-zero
+void rotter_dither_init( rotter_dither_t *dither )
+{
+  uint32_t seed = (uint32_t)time(NULL) ^ (uint32_t)(uintptr_t)dither;
+  int i;
+
+  for (i=0; i<ROTTER_DITHER_LANES; i++) {
+    seed = xorshift32( seed ? seed : 0x9e3779b9 );
+    dither->lanes[i] = seed;
+  }
+}
+
+
+static void convert_scalar( const jack_default_audio_sample_t *in, int16_t *out,
+                            size_t count, rotter_dither_t *dither )
+{
+  size_t i;
+
+  for (i=0; i<count; i++) {
+    float v = in[i] * 32768.0f;
+    if (dither) {
+      uint32_t r = dither->lanes[0] = xorshift32( dither->lanes[0] );
+      v += (float)((int32_t)(r & 0xffff) - (int32_t)(r >> 16)) * DITHER_SCALE;
+    }
+    v = v > 32767.0f ? 32767.0f : v;
+    v = v < -32768.0f ? -32768.0f : v;
+    out[i] = (int16_t)lrintf( v );
+  }
+}
+
+
+static void interleave_stereo_scalar( jack_default_audio_sample_t *dest,
+                                      const jack_default_audio_sample_t *left,
+                                      const jack_default_audio_sample_t *right,
+                                      size_t nframes )
+{
+  size_t i;
+
+  for (i=0; i<nframes; i++) {
+    dest[i*2] = left[i];
+    dest[i*2 + 1] = right[i];
+  }
+}
+
+
+// Interleave four channels into frames of 'stride' samples
+static void interleave_quad_scalar( jack_default_audio_sample_t *dest, unsigned int stride,
+                                    jack_default_audio_sample_t **in, size_t nframes )
+{
+  size_t i;
+
+  for (i=0; i<nframes; i++) {
+    jack_default_audio_sample_t *out = dest + i * stride;
+    out[0] = in[0][i];
+    out[1] = in[1][i];
+    out[2] = in[2][i];
+    out[3] = in[3][i];
+  }
+}
+
+
+#ifdef ROTTER_CONVERT_X86
+
+static inline __m128 __attribute__((target("sse2")))
+dither_sse2( __m128i *state )
+{
+  __m128i x = *state;
+  x = _mm_xor_si128( x, _mm_slli_epi32( x, 13 ) );
+  x = _mm_xor_si128( x, _mm_srli_epi32( x, 17 ) );
+  x = _mm_xor_si128( x, _mm_slli_epi32( x, 5 ) );
+  *state = x;
+
+  return _mm_mul_ps( _mm_cvtepi32_ps( _mm_sub_epi32(
+                       _mm_and_si128( x, _mm_set1_epi32( 0xffff ) ),
+                       _mm_srli_epi32( x, 16 ) ) ),
+                     _mm_set1_ps( DITHER_SCALE ) );
+}
+
+static void __attribute__((target("sse2")))
+convert_sse2( const jack_default_audio_sample_t *in, int16_t *out,
+              size_t count, rotter_dither_t *dither )
+{
+  const __m128 scale = _mm_set1_ps( 32768.0f );
+  const __m128 max = _mm_set1_ps( 32767.0f );
+  const __m128 min = _mm_set1_ps( -32768.0f );
+  __m128i state0 = _mm_setzero_si128(), state1 = _mm_setzero_si128();
+  size_t i = 0;
+
+  if (dither) {
+    state0 = _mm_loadu_si128( (const __m128i*)&dither->lanes[0] );
+    state1 = _mm_loadu_si128( (const __m128i*)&dither->lanes[4] );
+  }
+
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_mul_ps( _mm_loadu_ps( in + i ), scale );
+    __m128 b = _mm_mul_ps( _mm_loadu_ps( in + i + 4 ), scale );
+    if (dither) {
+      a = _mm_add_ps( a, dither_sse2( &state0 ) );
+      b = _mm_add_ps( b, dither_sse2( &state1 ) );
+    }
+
+    // Clamp before converting: out of range values would become INT_MIN
+    a = _mm_max_ps( _mm_min_ps( a, max ), min );
+    b = _mm_max_ps( _mm_min_ps( b, max ), min );
+    _mm_storeu_si128( (__m128i*)(out + i),
+                      _mm_packs_epi32( _mm_cvtps_epi32( a ), _mm_cvtps_epi32( b ) ) );
+  }
+
+  if (dither) {
+    _mm_storeu_si128( (__m128i*)&dither->lanes[0], state0 );
+    _mm_storeu_si128( (__m128i*)&dither->lanes[4], state1 );
+  }
+
+  convert_scalar( in + i, out + i, count - i, dither );
+}
+
+
+static inline __m256 __attribute__((target("avx2")))
+dither_avx2( __m256i *state )
+{
+  __m256i x = *state;
+  x = _mm256_xor_si256( x, _mm256_slli_epi32( x, 13 ) );
+  x = _mm256_xor_si256( x, _mm256_srli_epi32( x, 17 ) );
+  x = _mm256_xor_si256( x, _mm256_slli_epi32( x, 5 ) );
+  *state = x;
+
+  return _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_sub_epi32(
+                          _mm256_and_si256( x, _mm256_set1_epi32( 0xffff ) ),
+                          _mm256_srli_epi32( x, 16 ) ) ),
+                        _mm256_set1_ps( DITHER_SCALE ) );
+}
+
+static void __attribute__((target("avx2")))
+convert_avx2( const jack_default_audio_sample_t *in, int16_t *out,
+              size_t count, rotter_dither_t *dither )
+{
+  const __m256 scale = _mm256_set1_ps( 32768.0f );
+  const __m256 max = _mm256_set1_ps( 32767.0f );
+  const __m256 min = _mm256_set1_ps( -32768.0f );
+  __m256i state = _mm256_setzero_si256();
+  size_t i = 0;
+
+  if (dither)
+    state = _mm256_loadu_si256( (const __m256i*)dither->lanes );
+
+  for (; i + 16 <= count; i += 16) {
+    __m256 a = _mm256_mul_ps( _mm256_loadu_ps( in + i ), scale );
+    __m256 b = _mm256_mul_ps( _mm256_loadu_ps( in + i + 8 ), scale );
+    __m256i packed;
+    if (dither) {
+      a = _mm256_add_ps( a, dither_avx2( &state ) );
+      b = _mm256_add_ps( b, dither_avx2( &state ) );
+    }
+
+    a = _mm256_max_ps( _mm256_min_ps( a, max ), min );
+    b = _mm256_max_ps( _mm256_min_ps( b, max ), min );
+
+    // Packing works within each 128-bit lane, so put the halves back in order
+    packed = _mm256_packs_epi32( _mm256_cvtps_epi32( a ), _mm256_cvtps_epi32( b ) );
+    _mm256_storeu_si256( (__m256i*)(out + i), _mm256_permute4x64_epi64( packed, 0xd8 ) );
+  }
+
+  if (dither)
+    _mm256_storeu_si256( (__m256i*)dither->lanes, state );
+
+  convert_sse2( in + i, out + i, count - i, dither );
+}
+
+
+static void __attribute__((target("sse2")))
+interleave_stereo_sse2( jack_default_audio_sample_t *dest,
+                        const jack_default_audio_sample_t *left,
+                        const jack_default_audio_sample_t *right,
+                        size_t nframes )
+{
+  size_t i = 0;
+
+  for (; i + 4 <= nframes; i += 4) {
+    __m128 l = _mm_loadu_ps( left + i );
+    __m128 r = _mm_loadu_ps( right + i );
+    _mm_storeu_ps( dest + i*2, _mm_unpacklo_ps( l, r ) );
+    _mm_storeu_ps( dest + i*2 + 4, _mm_unpackhi_ps( l, r ) );
+  }
+
+  interleave_stereo_scalar( dest + i*2, left + i, right + i, nframes - i );
+}
+
+
+static void __attribute__((target("avx")))
+interleave_stereo_avx( jack_default_audio_sample_t *dest,
+                       const jack_default_audio_sample_t *left,
+                       const jack_default_audio_sample_t *right,
+                       size_t nframes )
+{
+  size_t i = 0;
+
+  for (; i + 8 <= nframes; i += 8) {
+    __m256 l = _mm256_loadu_ps( left + i );
+    __m256 r = _mm256_loadu_ps( right + i );
+
+    // Unpacking works within each 128-bit lane, so swap the middle halves over
+    __m256 lo = _mm256_unpacklo_ps( l, r );
+    __m256 hi = _mm256_unpackhi_ps( l, r );
+    _mm256_storeu_ps( dest + i*2, _mm256_permute2f128_ps( lo, hi, 0x20 ) );
+    _mm256_storeu_ps( dest + i*2 + 8, _mm256_permute2f128_ps( lo, hi, 0x31 ) );
+  }
+
+  interleave_stereo_sse2( dest + i*2, left + i, right + i, nframes - i );
+}
+
+
+// Transpose blocks of four frames of four channels
+static void __attribute__((target("sse2")))
+interleave_quad_sse2( jack_default_audio_sample_t *dest, unsigned int stride,
+                      jack_default_audio_sample_t **in, size_t nframes )
+{
+  size_t i = 0;
+
+  for (; i + 4 <= nframes; i += 4) {
+    __m128 r0 = _mm_loadu_ps( in[0] + i );
+    __m128 r1 = _mm_loadu_ps( in[1] + i );
+    __m128 r2 = _mm_loadu_ps( in[2] + i );
+    __m128 r3 = _mm_loadu_ps( in[3] + i );
+    jack_default_audio_sample_t *out = dest + i * stride;
+
+    _MM_TRANSPOSE4_PS( r0, r1, r2, r3 );
+    _mm_storeu_ps( out, r0 );
+    _mm_storeu_ps( out + stride, r1 );
+    _mm_storeu_ps( out + stride*2, r2 );
+    _mm_storeu_ps( out + stride*3, r3 );
+  }
+
+  if (i < nframes) {
+    jack_default_audio_sample_t *rest[4] = { in[0] + i, in[1] + i, in[2] + i, in[3] + i };
+    interleave_quad_scalar( dest + i * stride, stride, rest, nframes - i );
+  }
+}
+
+#endif   // ROTTER_CONVERT_X86
+
+
+#ifdef ROTTER_CONVERT_NEON
+
+static inline float32x4_t dither_neon( uint32x4_t *state )
+{
+  uint32x4_t x = *state;
+  x = veorq_u32( x, vshlq_n_u32( x, 13 ) );
+  x = veorq_u32( x, vshrq_n_u32( x, 17 ) );
+  x = veorq_u32( x, vshlq_n_u32( x, 5 ) );
+  *state = x;
+
+  return vmulq_n_f32( vcvtq_f32_s32( vsubq_s32(
+                        vreinterpretq_s32_u32( vandq_u32( x, vdupq_n_u32( 0xffff ) ) ),
+                        vreinterpretq_s32_u32( vshrq_n_u32( x, 16 ) ) ) ),
+                      DITHER_SCALE );
+}
+
+static void convert_neon( const jack_default_audio_sample_t *in, int16_t *out,
+                          size_t count, rotter_dither_t *dither )
+{
+  uint32x4_t state0 = vdupq_n_u32( 0 ), state1 = vdupq_n_u32( 0 );
+  size_t i = 0;
+
+  if (dither) {
+    state0 = vld1q_u32( &dither->lanes[0] );
+    state1 = vld1q_u32( &dither->lanes[4] );
+  }
+
+  for (; i + 8 <= count; i += 8) {
+    float32x4_t a = vmulq_n_f32( vld1q_f32( in + i ), 32768.0f );
+    float32x4_t b = vmulq_n_f32( vld1q_f32( in + i + 4 ), 32768.0f );
+    if (dither) {
+      a = vaddq_f32( a, dither_neon( &state0 ) );
+      b = vaddq_f32( b, dither_neon( &state1 ) );
+    }
+
+    // Both the conversion and the narrowing saturate
+    vst1q_s16( out + i, vcombine_s16( vqmovn_s32( vcvtnq_s32_f32( a ) ),
+                                      vqmovn_s32( vcvtnq_s32_f32( b ) ) ) );
+  }
+
+  if (dither) {
+    vst1q_u32( &dither->lanes[0], state0 );
+    vst1q_u32( &dither->lanes[4], state1 );
+  }
+
+  convert_scalar( in + i, out + i, count - i, dither );
+}
+
+
+static void interleave_stereo_neon( jack_default_audio_sample_t *dest,
+                                    const jack_default_audio_sample_t *left,
+                                    const jack_default_audio_sample_t *right,
+                                    size_t nframes )
+{
+  size_t i = 0;
+
+  for (; i + 4 <= nframes; i += 4) {
+    float32x4x2_t lr;
+    lr.val[0] = vld1q_f32( left + i );
+    lr.val[1] = vld1q_f32( right + i );
+    vst2q_f32( dest + i*2, lr );
+  }
+
+  interleave_stereo_scalar( dest + i*2, left + i, right + i, nframes - i );
+}
+
+
+// Transpose blocks of four frames of four channels
+static void interleave_quad_neon( jack_default_audio_sample_t *dest, unsigned int stride,
+                                  jack_default_audio_sample_t **in, size_t nframes )
+{
+  size_t i = 0;
+
+  for (; i + 4 <= nframes; i += 4) {
+    float32x4x2_t t0 = vzipq_f32( vld1q_f32( in[0] + i ), vld1q_f32( in[2] + i ) );
+    float32x4x2_t t1 = vzipq_f32( vld1q_f32( in[1] + i ), vld1q_f32( in[3] + i ) );
+    float32x4x2_t u0 = vzipq_f32( t0.val[0], t1.val[0] );
+    float32x4x2_t u1 = vzipq_f32( t0.val[1], t1.val[1] );
+    jack_default_audio_sample_t *out = dest + i * stride;
+
+    vst1q_f32( out, u0.val[0] );
+    vst1q_f32( out + stride, u0.val[1] );
+    vst1q_f32( out + stride*2, u1.val[0] );
+    vst1q_f32( out + stride*3, u1.val[1] );
+  }
+
+  if (i < nframes) {
+    jack_default_audio_sample_t *rest[4] = { in[0] + i, in[1] + i, in[2] + i, in[3] + i };
+    interleave_quad_scalar( dest + i * stride, stride, rest, nframes - i );
+  }
+}
+
+#endif   // ROTTER_CONVERT_NEON
+
+
+// Pick the fastest conversion kernel that this CPU supports
+void rotter_convert_init()
+{
+  const char *name = "scalar";
+
+#ifdef ROTTER_CONVERT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports( "avx2" )) {
+    convert_func = convert_avx2;
+    name = "AVX2";
+  } else if (__builtin_cpu_supports( "sse2" )) {
+    convert_func = convert_sse2;
+    name = "SSE2";
+  }
+
+  if (__builtin_cpu_supports( "avx" )) {
+    interleave_stereo_func = interleave_stereo_avx;
+  } else if (__builtin_cpu_supports( "sse2" )) {
+    interleave_stereo_func = interleave_stereo_sse2;
+  }
+
+  if (__builtin_cpu_supports( "sse2" ))
+    interleave_quad_func = interleave_quad_sse2;
+#elif defined(ROTTER_CONVERT_NEON)
+  convert_func = convert_neon;
+  interleave_stereo_func = interleave_stereo_neon;
+  interleave_quad_func = interleave_quad_neon;
+  name = "NEON";
+#endif
+
+  rotter_debug( "Using %s sample conversion%s.", name, dither_output ? ", with dither" : "" );
+}
+
+
+/*
+  Convert 'count' floating point samples to 16-bit integers.
+  'dither' is the encoder's dither state, or NULL for none.
+*/
+void rotter_float_to_s16( const jack_default_audio_sample_t *in, int16_t *out,
+                          size_t count, rotter_dither_t *dither )
+{
+  convert_func( in, out, count, dither );
+}
+
+
+/*
+  Interleave 'nframes' frames, starting at 'offset' in each of the
+  per-channel buffers in 'src', into 'dest'.
+*/
+void rotter_interleave( jack_default_audio_sample_t *dest,
+                        jack_default_audio_sample_t **src,
+                        size_t offset, size_t nframes,
+                        unsigned int channels )
+{
+  size_t base;
+
+  if (channels == 1) {
+    memcpy( dest, src[0] + offset, nframes * sizeof(jack_default_audio_sample_t) );
+    return;
+  }
+
+  if (channels == 2) {
+    interleave_stereo_func( dest, src[0] + offset, src[1] + offset, nframes );
+    return;
+  }
+
+  // Other channel counts are done four channels at a time,
+  // over a tile of frames that stays in the cache between passes
+  for (base=0; base < nframes; base += INTERLEAVE_TILE) {
+    size_t tile = nframes - base;
+    unsigned int c = 0;
+    size_t i;
+
+    if (tile > INTERLEAVE_TILE)
+      tile = INTERLEAVE_TILE;
+
+    for (; c + 4 <= channels; c += 4) {
+      jack_default_audio_sample_t *in[4] = {
+        src[c] + offset + base, src[c+1] + offset + base,
+        src[c+2] + offset + base, src[c+3] + offset + base
+      };
+      interleave_quad_func( dest + base * channels + c, channels, in, tile );
+    }
+
+    for (; c < channels; c++) {
+      const jack_default_audio_sample_t *in = src[c] + offset + base;
+      jack_default_audio_sample_t *out = dest + base * channels + c;
+      for (i=0; i < tile; i++) {
+        out[i * channels] = in[i];
+      }
+    }
+  }
+}
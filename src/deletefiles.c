@@ -28,171 +28,899 @@
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
 #include <dirent.h>
 
 #include "rotter.h"
 #include "config.h"
 
-pid_t delete_child_pid = 0;     // PID of process deleting old files
 
-
-static void delete_file( const char* filepath, dev_t device, time_t timestamp )
+static dev_t get_file_device( const char* filepath )
 {
   struct stat sb;
 
   if (stat( filepath, &sb )) {
     rotter_error( "Warning: failed to stat file: %s", filepath );
-    return;
+    return -1;
   }
 
-  if (sb.st_dev != device) {
-    rotter_debug( "Warning: %s isn't on same device as root dir.", filepath );
-    return;
-  }
+  return sb.st_dev;
+}
 
-  if (sb.st_mtime < timestamp) {
-    rotter_debug( "Deleting file: %s", filepath );
 
-    if (unlink(filepath)) {
-      rotter_error( "Warning: failed to delete file: %s (%s)", filepath, strerror(errno) );
-      return;
+/*
+  Retention (-d, -m and -z) works from a manifest of the files that
+  rotter has written, kept in MANIFEST_FILENAME at the top of the
+  archive. A line is appended once each file has been closed (and, with
+  -A, written), giving the time it was last written to, the space it
+  takes up on disk and the path (relative to the root directory), so
+  the manifest is in time order:
+
+    ROTTER-MANIFEST 2 00000000000000000060 00000000000057671680
+    1433516400 57671680 2015/06/05/14/archive.mp3
+
+  The numbers in the header are the offset of the first entry that
+  hasn't been deleted yet, and the total size of the files from there
+  on. Deleting old files only reads the entries that are being deleted,
+  oldest first, rather than looking at every file in the archive; the
+  deleted part is cut off the front of the manifest once it gets big.
+  A file that has been written to since its entry was added (when
+  rotter is restarted part way through a period) isn't deleted; its
+  entry is put back on the end, with the new time.
+  Other files in the same directories as deleted archive files are
+  deleted too, if they are older, as they were before.
+
+  Files are deleted once they are older than -d hours, and then, if the
+  filesystem is fuller than the high -m mark or the archive is bigger
+  than the high -z mark, until it is back down to the low mark.
+
+  If the manifest is missing (the first time that -d is used), it is
+  built by looking through the whole archive once.
+
+  The manifest is locked with flock() while it is being changed. It may
+  be replaced while another process is waiting for the lock, so the
+  lock is only kept if the file is still the manifest.
+*/
+
+
+// Open and lock the manifest
+static int open_manifest( const char* manifest, int flags )
+{
+  while (1) {
+    struct stat fd_sb, path_sb;
+    int fd = open( manifest, flags );
+    if (fd < 0)
+      return -1;
+
+    if (flock( fd, LOCK_EX )) {
+      close( fd );
+      return -1;
     }
+
+    if (fstat( fd, &fd_sb ) == 0 && stat( manifest, &path_sb ) == 0 &&
+        fd_sb.st_dev == path_sb.st_dev && fd_sb.st_ino == path_sb.st_ino)
+      return fd;
+
+    // It was replaced while waiting for the lock
+    close( fd );
   }
+}
 
+
+static void write_manifest_header( char *header, off_t head, long long total )
+{
+  snprintf( header, MANIFEST_HEADER_LEN + 1, "%s %020lld %020lld\n", MANIFEST_MAGIC, (long long)head, total );
 }
 
 
-static dev_t get_file_device( const char* filepath )
+// Read the header of the manifest; returns -1 if it isn't one we understand
+static int read_manifest_header( int fd, off_t *head, long long *total )
+{
+  char header[MANIFEST_HEADER_LEN + 1];
+  long long head_ll;
+
+  if (pread( fd, header, MANIFEST_HEADER_LEN, 0 ) != MANIFEST_HEADER_LEN)
+    return -1;
+  header[MANIFEST_HEADER_LEN] = '\0';
+
+  if (strncmp( header, MANIFEST_MAGIC " ", strlen(MANIFEST_MAGIC) + 1 ) ||
+      sscanf( header + strlen(MANIFEST_MAGIC), "%lld %lld", &head_ll, total ) != 2 ||
+      head_ll < MANIFEST_HEADER_LEN)
+    return -1;
+
+  *head = head_ll;
+  if (*total < 0)
+    *total = 0;
+
+  return 0;
+}
+
+
+typedef struct retention_s
+{
+  time_t timestamp;          // Delete files last written before this
+  long long free_bytes;      // Delete at least this much, for the filesystem usage marks
+  double quota_high;         // Delete the oldest files when the archive is bigger than this
+  double quota_low;          // ...until it is this big
+} retention_t;
+
+typedef struct manifest_entry_s
+{
+  time_t when;
+  long long usage;
+  char *path;
+  int kept;                  // Left in the manifest, rather than deleted
+} manifest_entry_t;
+
+typedef struct manifest_list_s
 {
+  manifest_entry_t *entries;
+  size_t count;
+  size_t size;
+} manifest_list_t;
+
+
+// Space taken up on disk by a file (and its seek index), and when it was last written to
+static long long file_disk_usage( const char *filepath, time_t *mtime )
+{
+  char index_path[MAX_FILEPATH_LEN];
+  long long usage = 0;
   struct stat sb;
 
-  if (stat( filepath, &sb )) {
-    rotter_error( "Warning: failed to stat file: %s", filepath );
+  if (stat( filepath, &sb ))
     return -1;
+  usage += (long long)sb.st_blocks * 512;
+  *mtime = sb.st_mtime;
+
+  snprintf( index_path, sizeof(index_path), "%s%s", filepath, SEEK_INDEX_SUFFIX );
+  if (stat( index_path, &sb ) == 0)
+    usage += (long long)sb.st_blocks * 512;
+
+  return usage;
+}
+
+
+// Add entries to the end of the (locked) manifest, and then update its header
+// 'add_usage' is set if their size isn't in the total already
+static int append_entries( int fd, const char *manifest, manifest_entry_t *entries, size_t count,
+                           int kept_only, int add_usage, off_t head, long long total )
+{
+  char header[MANIFEST_HEADER_LEN + 1];
+  char line[MAX_FILEPATH_LEN + 48];
+  struct stat sb;
+  off_t end;
+  size_t i;
+
+  if (fstat( fd, &sb ))
+    return -1;
+  end = sb.st_size;
+
+  for (i=0; i<count; i++) {
+    int len;
+
+    if (kept_only && !entries[i].kept)
+      continue;
+
+    len = snprintf( line, sizeof(line), "%lld %lld %s\n", (long long)entries[i].when,
+                    entries[i].usage, entries[i].path );
+    if (pwrite( fd, line, len, end ) != len) {
+      rotter_error( "Warning: failed to add %s to %s: %s", entries[i].path, manifest, strerror(errno) );
+      return -1;
+    }
+    end += len;
+    if (add_usage)
+      total += entries[i].usage;
   }
 
-  return sb.st_dev;
+  // The header is only updated once the entries are there
+  write_manifest_header( header, head, total );
+  if (pwrite( fd, header, MANIFEST_HEADER_LEN, 0 ) != MANIFEST_HEADER_LEN) {
+    rotter_error( "Warning: failed to update %s: %s", manifest, strerror(errno) );
+    return -1;
+  }
+
+  return 0;
 }
 
 
-static void deletefiles_in_dir( const char* dirpath, dev_t device, time_t timestamp )
+// Add a file that has been closed (and all written) to the manifest
+void deletefiles_record( const char* dirpath, const char* filepath )
+{
+  char manifest[MAX_FILEPATH_LEN];
+  size_t dirpath_len = strlen( dirpath );
+  manifest_entry_t entry;
+  long long total;
+  off_t head;
+  int fd;
+
+  // Only files inside the archive are looked after
+  if (strncmp( filepath, dirpath, dirpath_len ) || filepath[dirpath_len] != '/')
+    return;
+
+  // Entries are given the file's own time, so that it can be checked
+  // that nothing has been written to the file since
+  entry.usage = file_disk_usage( filepath, &entry.when );
+  if (entry.usage < 0) {
+    rotter_error( "Warning: failed to stat file: %s", filepath );
+    return;
+  }
+  entry.path = (char*)filepath + dirpath_len + 1;
+  entry.kept = 1;
+
+  // If there isn't a manifest, the file is found when it is built
+  snprintf( manifest, sizeof(manifest), "%s/%s", dirpath, MANIFEST_FILENAME );
+  fd = open_manifest( manifest, O_RDWR );
+  if (fd < 0) {
+    if (errno != ENOENT)
+      rotter_error( "Warning: failed to open %s: %s", manifest, strerror(errno) );
+    return;
+  }
+
+  // It is built again by the deletion thread if it can't be read
+  if (read_manifest_header( fd, &head, &total ) == 0)
+    append_entries( fd, manifest, &entry, 1, 0, 1, head, total );
+
+  close( fd );
+}
+
+
+static int manifest_list_add( manifest_list_t *list, time_t when, long long usage, const char *path )
+{
+  if (list->count == list->size) {
+    size_t size = list->size ? list->size * 2 : 256;
+    manifest_entry_t *entries = realloc( list->entries, size * sizeof(manifest_entry_t) );
+    if (entries == NULL)
+      return -1;
+    list->entries = entries;
+    list->size = size;
+  }
+
+  list->entries[list->count].path = strdup( path );
+  if (list->entries[list->count].path == NULL)
+    return -1;
+  list->entries[list->count].when = when;
+  list->entries[list->count].usage = usage;
+  list->entries[list->count].kept = 0;
+  list->count++;
+
+  return 0;
+}
+
+
+static void manifest_list_free( manifest_list_t *list )
+{
+  size_t i;
+
+  for (i=0; i<list->count; i++)
+    free( list->entries[i].path );
+  free( list->entries );
+}
+
+
+static int compare_entries( const void *a, const void *b )
+{
+  const manifest_entry_t *ea = a, *eb = b;
+
+  if (ea->when < eb->when) return -1;
+  if (ea->when > eb->when) return 1;
+  return strcmp( ea->path, eb->path );
+}
+
+
+// Find all of the files in the archive, for building the manifest
+static void find_files_in_dir( const char* dirpath, const char *relpath, dev_t device, manifest_list_t *list )
 {
   DIR *dirp = opendir(dirpath);
   struct dirent *dp;
 
   if (dirp==NULL) {
-    rotter_fatal( "Failed to open directory: %s.", dirpath );
+    rotter_error( "Warning: failed to open directory: %s.", dirpath );
     return;
   }
 
-  // Check each item in the directory
   while( (dp = readdir( dirp )) != NULL ) {
-    int newpath_len;
-    char* newpath;
+    char newpath[MAX_FILEPATH_LEN];
+    char newrelpath[MAX_FILEPATH_LEN];
+    size_t name_len = strlen( dp->d_name );
+    size_t suffix_len = strlen( PREPARED_FILE_SUFFIX );
+    struct stat sb;
 
     if (strcmp( ".", dp->d_name )==0) continue;
     if (strcmp( "..", dp->d_name )==0) continue;
 
-    newpath_len = strlen(dirpath) + strlen(dp->d_name) + 2;
-    newpath = malloc( newpath_len );
-    snprintf( newpath, newpath_len, "%s/%s", dirpath, dp->d_name );
+    snprintf( newpath, sizeof(newpath), "%s/%s", dirpath, dp->d_name );
+    if (relpath[0]) {
+      snprintf( newrelpath, sizeof(newrelpath), "%s/%s", relpath, dp->d_name );
+    } else {
+      snprintf( newrelpath, sizeof(newrelpath), "%s", dp->d_name );
+    }
+
+    if (lstat( newpath, &sb )) {
+      rotter_error( "Warning: failed to stat file: %s", newpath );
+      continue;
+    }
+
+    if (sb.st_dev != device) {
+      rotter_debug( "Warning: %s isn't on same device as root dir.", newpath );
+    } else if (S_ISDIR(sb.st_mode)) {
+      find_files_in_dir( newpath, newrelpath, device, list );
+    } else if (S_ISREG(sb.st_mode)) {
+      // Leave out the manifest itself, and files that are still being prepared
+      if (!strncmp( dp->d_name, MANIFEST_FILENAME, strlen(MANIFEST_FILENAME) ))
+        continue;
+      if (name_len > suffix_len && !strcmp( dp->d_name + name_len - suffix_len, PREPARED_FILE_SUFFIX ))
+        continue;
+      if (manifest_list_add( list, sb.st_mtime, (long long)sb.st_blocks * 512, newrelpath ))
+        rotter_error( "Warning: failed to allocate memory for manifest entry." );
+    } else {
+      rotter_error( "Warning: not a file or a directory: %s", newpath );
+    }
+  }
 
-    if (dp->d_type == DT_DIR) {
+  closedir( dirp );
+}
 
-      // Check we are on the same device
-      if (get_file_device(newpath) != device) {
-        rotter_debug( "Warning: %s isn't on same device as root dir.", dirpath );
-      } else {
-        // Delete files in the directory
-        deletefiles_in_dir( newpath, device, timestamp );
 
-        // Try and delete the directory itself
-        if (rmdir(newpath) && errno != ENOTEMPTY) {
-          rotter_error( "Warning: failed to delete directory: %s (%s)",
-                        newpath, strerror(errno) );
-        }
-      }
+// Write all of a buffer to a file
+static int write_all( int fd, const char *buf, size_t len )
+{
+  while (len > 0) {
+    ssize_t written = write( fd, buf, len );
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += written;
+    len -= written;
+  }
+
+  return 0;
+}
+
+
+static unsigned manifest_serial = 0;
+
+
+// Write out a new manifest, starting with some entries
+static int write_manifest( const char *manifest, manifest_entry_t *entries, size_t count,
+                           int src_fd, off_t src_offset, long long total )
+{
+  char newpath[MAX_FILEPATH_LEN];
+  char buf[65536];
+  size_t used, i;
+  ssize_t len;
+  int fd, result = 0;
+
+  // Each thread deleting files needs a name of its own
+  snprintf( newpath, sizeof(newpath), "%s.%d.%u", manifest, (int)getpid(),
+            __atomic_add_fetch( &manifest_serial, 1, __ATOMIC_RELAXED ) );
+  fd = open( newpath, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+  if (fd < 0) {
+    rotter_error( "Warning: failed to create %s: %s", newpath, strerror(errno) );
+    return -1;
+  }
+
+  write_manifest_header( buf, MANIFEST_HEADER_LEN, total );
+  used = MANIFEST_HEADER_LEN;
+  for (i=0; i<count && result==0; i++) {
+    if (used > sizeof(buf) - (MAX_FILEPATH_LEN + 48)) {
+      result = write_all( fd, buf, used );
+      used = 0;
+    }
+    used += snprintf( buf + used, sizeof(buf) - used, "%lld %lld %s\n",
+                      (long long)entries[i].when, entries[i].usage, entries[i].path );
+  }
+  if (result == 0)
+    result = write_all( fd, buf, used );
+
+  // Followed by the rest of an existing manifest
+  if (src_fd >= 0) {
+    while (result == 0 && (len = pread( src_fd, buf, sizeof(buf), src_offset )) > 0) {
+      result = write_all( fd, buf, len );
+      src_offset += len;
+    }
+  }
+
+  if (close( fd ))
+    result = -1;
+  if (result || rename( newpath, manifest )) {
+    rotter_error( "Warning: failed to write %s: %s", manifest, strerror(errno) );
+    unlink( newpath );
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Build the manifest from the files in the archive
+static void rebuild_manifest( const char* dirpath, const char *manifest, dev_t device )
+{
+  manifest_list_t list = { NULL, 0, 0 };
+  long long total = 0;
+  size_t i;
+
+  rotter_info( "Building list of archive files in %s; this is only done once.", dirpath );
+  find_files_in_dir( dirpath, "", device, &list );
+  qsort( list.entries, list.count, sizeof(manifest_entry_t), compare_entries );
+  for (i=0; i<list.count; i++)
+    total += list.entries[i].usage;
+
+  if (write_manifest( manifest, list.entries, list.count, -1, 0, total ) == 0)
+    rotter_debug( "Found %lu files in %s, taking up %lld MB.", (unsigned long)list.count, dirpath, total / 1048576 );
+  manifest_list_free( &list );
+}
+
+
+// Reads the manifest a line at a time
+typedef struct manifest_reader_s
+{
+  int fd;
+  off_t offset;              // Where the next read from the file starts
+  char buf[4 * MAX_FILEPATH_LEN];
+  size_t len;
+  size_t pos;
+} manifest_reader_t;
+
+
+// Get the next line (without its newline); returns its length, including
+// the newline, or -1 at the end of the manifest
+static ssize_t read_manifest_line( manifest_reader_t *reader, char **line )
+{
+  char *newline;
+  ssize_t len;
+
+  while ((newline = memchr( reader->buf + reader->pos, '\n', reader->len - reader->pos )) == NULL) {
+    // Move what is left to the start of the buffer, and read some more
+    memmove( reader->buf, reader->buf + reader->pos, reader->len - reader->pos );
+    reader->len -= reader->pos;
+    reader->pos = 0;
+    if (reader->len == sizeof(reader->buf))
+      return -1;
+
+    len = pread( reader->fd, reader->buf + reader->len, sizeof(reader->buf) - reader->len, reader->offset );
+    if (len <= 0)
+      return -1;
+    reader->len += len;
+    reader->offset += len;
+  }
+
+  *newline = '\0';
+  *line = reader->buf + reader->pos;
+  len = newline + 1 - *line;
+  reader->pos += len;
 
-    } else if (dp->d_type == DT_REG) {
+  return len;
+}
 
-      delete_file( newpath, device, timestamp );
 
+// Read the entries to be deleted from the front of the manifest
+// 'start' and 'end' are set to where they are in the manifest
+static int expired_entries( const char* manifest, retention_t *retention, manifest_list_t *list,
+                            off_t *start, off_t *end )
+{
+  manifest_reader_t *reader;
+  char *line;
+  ssize_t line_len;
+  long long total = 0, target, freed = 0;
+  off_t head = 0;
+  int fd;
+
+  fd = open_manifest( manifest, O_RDWR );
+  if (fd < 0)
+    return -1;
+
+  if (read_manifest_header( fd, &head, &total )) {
+    rotter_error( "Warning: %s is damaged or from another version; building it again.", manifest );
+    unlink( manifest );
+    close( fd );
+    errno = ENOENT;
+    return -1;
+  }
+  *start = head;
+
+  // How much needs to be deleted to get back under the low marks?
+  target = retention->free_bytes;
+  if (retention->quota_high > 0 && total > retention->quota_high) {
+    rotter_info( "Archive is taking up %lld MB, over the quota.", total / 1048576 );
+    if (total - retention->quota_low > target)
+      target = total - retention->quota_low;
+  }
+
+  reader = calloc( 1, sizeof(manifest_reader_t) );
+  if (reader == NULL) {
+    rotter_error( "Warning: failed to allocate memory for reading %s.", manifest );
+    close( fd );
+    return -1;
+  }
+  reader->fd = fd;
+  reader->offset = head;
+
+  // Only the entries being deleted are read
+  while ((line_len = read_manifest_line( reader, &line )) > 0) {
+    long long when, usage;
+    int path_start = 0;
+
+    if (sscanf( line, "%lld %lld %n", &when, &usage, &path_start ) < 2 || path_start == 0) {
+      rotter_error( "Warning: skipping bad line in %s: %s", manifest, line );
+    } else if (when >= retention->timestamp && freed >= target) {
+      break;
+    } else if (manifest_list_add( list, when, usage, line + path_start )) {
+      rotter_error( "Warning: failed to allocate memory for manifest entry." );
+      break;
     } else {
-      rotter_error( "Warning: not a file or a directory: %s", newpath );
+      freed += usage;
+    }
+    head += line_len;
+  }
+  free( reader );
+  *end = head;
+
+  // Unlocks the manifest; it is only changed once the files have been deleted,
+  // so that appending to it isn't held up
+  close( fd );
+
+  return 0;
+}
+
+
+/*
+  Take the entries that have been dealt with off the front of the
+  manifest, once the files have been deleted. Entries that were kept
+  (for files that have been written to since they were added, or
+  couldn't be deleted) are put back on the end.
+*/
+static void commit_entries( const char* manifest, manifest_list_t *list, off_t start, off_t end )
+{
+  long long total = 0;
+  struct stat sb;
+  off_t head;
+  size_t i;
+  int fd;
+
+  fd = open_manifest( manifest, O_RDWR );
+  if (fd < 0) {
+    rotter_error( "Warning: failed to open %s: %s", manifest, strerror(errno) );
+    return;
+  }
+
+  // Has another process been through it in the meantime?
+  if (read_manifest_header( fd, &head, &total ) || head != start) {
+    rotter_error( "Warning: %s was changed while deleting files.", manifest );
+    close( fd );
+    return;
+  }
+
+  // Only the space of the files that have gone comes off the total
+  for (i=0; i<list->count; i++) {
+    if (!list->entries[i].kept)
+      total -= list->entries[i].usage;
+  }
+  if (total < 0)
+    total = 0;
+
+  if (append_entries( fd, manifest, list->entries, list->count, 1, 0, end, total ) == 0 &&
+      fstat( fd, &sb ) == 0)
+  {
+    // Cut the deleted part off, once it has got big
+    if (end > MANIFEST_COMPACT_SIZE && end > sb.st_size / 2) {
+      rotter_debug( "Compacting %s.", manifest );
+      if (read_manifest_header( fd, &head, &total ) == 0)
+        write_manifest( manifest, NULL, 0, fd, head, total );
+    }
+  }
+
+  // Unlocks the manifest
+  close( fd );
+}
+
+
+// Try to remove a directory and then its parents, up to the root directory
+static void remove_empty_dirs( int root_fd, char *reldir )
+{
+  while (reldir[0]) {
+    char *slash;
+
+    if (unlinkat( root_fd, reldir, AT_REMOVEDIR )) {
+      if (errno != ENOTEMPTY && errno != EEXIST && errno != ENOENT)
+        rotter_error( "Warning: failed to delete directory: %s (%s)", reldir, strerror(errno) );
+      return;
     }
-    free( newpath );
 
+    slash = strrchr( reldir, '/' );
+    if (slash == NULL)
+      return;
+    *slash = '\0';
+  }
+}
+
+
+// Delete the other files in a directory that are old enough
+static void delete_old_files_in_dir( int dir_fd, time_t timestamp )
+{
+  DIR *dirp;
+  struct dirent *dp;
+  int fd = dup( dir_fd );
+
+  if (fd < 0 || (dirp = fdopendir( fd )) == NULL) {
+    if (fd >= 0) close( fd );
+    return;
+  }
+
+  while( (dp = readdir( dirp )) != NULL ) {
+    struct stat sb;
+
+    if (fstatat( dir_fd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW ) == 0 &&
+        S_ISREG(sb.st_mode) && sb.st_mtime < timestamp)
+    {
+      rotter_debug( "Deleting file: %s", dp->d_name );
+      if (unlinkat( dir_fd, dp->d_name, 0 ))
+        rotter_error( "Warning: failed to delete file: %s (%s)", dp->d_name, strerror(errno) );
+    }
   }
 
   closedir( dirp );
 }
 
 
+// Finish with a directory that has had expired files deleted from it
+static void finish_dir( int root_fd, int dir_fd, char *reldir, time_t timestamp )
+{
+  // Not the root directory, which may hold the whole archive
+  if (reldir[0] == '\0')
+    return;
+
+  delete_old_files_in_dir( dir_fd, timestamp );
+  close( dir_fd );
+  remove_empty_dirs( root_fd, reldir );
+}
+
 
-// Delete files older than 'hours'
-int deletefiles( const char* dirpath, int hours )
+// Delete the files in a list of entries taken off the manifest
+static int delete_entries( const char* dirpath, manifest_list_t *list, time_t timestamp )
 {
-  int old_niceness, new_niceness = 15;
-  time_t now = time(NULL);
-  dev_t device = get_file_device( dirpath );
+  char current_dir[MAX_FILEPATH_LEN] = "";
+  char index_name[MAX_FILEPATH_LEN];
+  int root_fd, dir_fd, dir_errno = 0;
+  size_t i;
+
+  root_fd = open( dirpath, O_RDONLY | O_DIRECTORY );
+  if (root_fd < 0) {
+    rotter_error( "Warning: failed to open directory: %s (%s)", dirpath, strerror(errno) );
+    return -1;
+  }
+  dir_fd = root_fd;
+
+  for (i=0; i<list->count; i++) {
+    char *path = list->entries[i].path;
+    char *slash = strrchr( path, '/' );
+    const char *name = slash ? slash + 1 : path;
+    size_t dir_len = slash ? (size_t)(slash - path) : 0;
+    struct stat sb;
+
+    // Entries come in time order, so files in the same directory are together
+    if (strlen(current_dir) != dir_len || strncmp( current_dir, path, dir_len )) {
+      if (dir_fd >= 0 && dir_fd != root_fd)
+        finish_dir( root_fd, dir_fd, current_dir, timestamp );
+
+      snprintf( current_dir, sizeof(current_dir), "%.*s", (int)dir_len, path );
+      dir_fd = root_fd;
+      if (dir_len > 0) {
+        dir_fd = openat( root_fd, current_dir, O_RDONLY | O_DIRECTORY );
+        dir_errno = errno;
+      }
+    }
+
+    /*
+      Entries that aren't kept are taken out of the manifest, and their
+      size out of its total, so only entries for files that have been
+      deleted, or are already gone, are left out. If a file can't be
+      deleted, its entry goes back in, to try again next time.
+    */
+    if (dir_fd < 0) {
+      list->entries[i].kept = (dir_errno != ENOENT);
+      continue;
+    }
 
-  if (hours<=0)
+    if (fstatat( dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW )) {
+      list->entries[i].kept = (errno != ENOENT);
+      continue;
+    }
+
+    // The file has been written to since its entry was added, so it goes back in
+    if (sb.st_mtime > list->entries[i].when) {
+      list->entries[i].when = sb.st_mtime;
+      list->entries[i].kept = 1;
+      continue;
+    }
+
+    rotter_debug( "Deleting file: %s/%s", dirpath, path );
+    if (unlinkat( dir_fd, name, 0 ) && errno != ENOENT) {
+      rotter_error( "Warning: failed to delete file: %s/%s (%s)", dirpath, path, strerror(errno) );
+      list->entries[i].kept = 1;
+      continue;
+    }
+
+    // And its seek index, if it has one
+    snprintf( index_name, sizeof(index_name), "%s%s", name, SEEK_INDEX_SUFFIX );
+    unlinkat( dir_fd, index_name, 0 );
+  }
+
+  if (dir_fd >= 0 && dir_fd != root_fd)
+    finish_dir( root_fd, dir_fd, current_dir, timestamp );
+
+  close( root_fd );
+
+  return 0;
+}
+
+
+// Delete the files that have expired from the archive
+static void deletefiles_in_archive( const char* dirpath, dev_t device, retention_t *retention )
+{
+  manifest_list_t list = { NULL, 0, 0 };
+  char manifest[MAX_FILEPATH_LEN];
+  time_t timestamp = retention->timestamp;
+  off_t start, end;
+
+  snprintf( manifest, sizeof(manifest), "%s/%s", dirpath, MANIFEST_FILENAME );
+
+  if (expired_entries( manifest, retention, &list, &start, &end )) {
+    if (errno != ENOENT) {
+      rotter_error( "Warning: failed to open %s: %s", manifest, strerror(errno) );
+      return;
+    }
+
+    rebuild_manifest( dirpath, manifest, device );
+    if (expired_entries( manifest, retention, &list, &start, &end )) {
+      rotter_error( "Warning: failed to open %s: %s", manifest, strerror(errno) );
+      return;
+    }
+  }
+
+  // Other files are deleted if they are older than the archive files deleted
+  if (list.count > 0 && list.entries[list.count-1].when > timestamp)
+    timestamp = list.entries[list.count-1].when;
+
+  rotter_debug( "%lu files have expired in %s.", (unsigned long)list.count, dirpath );
+  if (delete_entries( dirpath, &list, timestamp ) == 0 && list.count > 0)
+    commit_entries( manifest, &list, start, end );
+  manifest_list_free( &list );
+}
+
+
+// How much needs deleting to get the filesystem under the low usage mark
+static long long bytes_over_usage( rotter_stream_t *stream )
+{
+  struct statvfs sv;
+  double used, usable, percent;
+
+  if (stream->delete_usage_high <= 0)
     return 0;
 
-  if (delete_child_pid) {
-    rotter_error( "Not deleting files: the last deletion process has not finished." );
-    return delete_child_pid;
+  if (statvfs( stream->root_directory, &sv )) {
+    rotter_error( "Warning: failed to get free space for %s: %s", stream->root_directory, strerror(errno) );
+    return 0;
   }
 
-  rotter_info( "Deleting files older than %d hours in %s.", hours, dirpath );
+  // Worked out in the same way as df(1)
+  used = (double)(sv.f_blocks - sv.f_bfree) * sv.f_frsize;
+  usable = used + (double)sv.f_bavail * sv.f_frsize;
+  if (usable <= 0)
+    return 0;
 
-  // Fork a new process
-  delete_child_pid = fork();
-  if (delete_child_pid>0) {
-    // Parent is here
-    rotter_debug( "Forked new proccess to delete files (pid=%d).", delete_child_pid );
-    return delete_child_pid;
-  } else if (delete_child_pid<0) {
-    rotter_error( "Warning: fork failed: %s", strerror(errno) );
+  percent = used * 100 / usable;
+  if (percent <= stream->delete_usage_high)
     return 0;
+
+  rotter_info( "Filesystem for %s is %1.1f%% full.", stream->root_directory, percent );
+  return used - (usable * stream->delete_usage_low / 100);
+}
+
+
+/*
+  Deleting files is pretty unimportant, so it is done on a thread of
+  its own at the lowest priority that it can have, rather than holding
+  up the I/O stage. A thread, rather than a forked process, so that it
+  can't be caught by a lock that one of the other threads was holding
+  at the time of the fork.
+*/
+
+static volatile int delete_stopping = 0;
+
+
+static void* deletefiles_thread_func( void *arg )
+{
+  rotter_stream_t *stream = arg;
+  const char* dirpath = stream->root_directory;
+  time_t now = time(NULL);
+  dev_t device;
+  retention_t retention;
+  int i;
+
+#ifdef SCHED_IDLE
+  {
+    struct sched_param param;
+    memset( &param, 0, sizeof(param) );
+    if (pthread_setschedparam( pthread_self(), SCHED_IDLE, &param ))
+      rotter_debug( "Failed to lower the priority of the deletion thread." );
   }
+#endif
 
-  // Make this process nicer
-  // (deleting files is pretty unimportant)
-  old_niceness = nice( new_niceness );
-  rotter_debug( "Changed child proccess niceless from %d to %d.", old_niceness, new_niceness );
-  
-  // Sleep for 10 seconds, so we don't use up CPU while a new new files 
+  // Wait for 10 seconds, so we don't use up CPU while a new new files
   // are just starting to be encoded, and so that we don't delete empty directories
   // just as they are being created.
-  sleep(10);
+  for (i=0; i<DELETE_DELAY && !delete_stopping; i++)
+    sleep(1);
+
+  if (!delete_stopping) {
+    retention.timestamp = (stream->delete_hours>0) ? now-(stream->delete_hours*3600) : 0;
+    retention.free_bytes = bytes_over_usage( stream );
+    retention.quota_high = stream->delete_quota_high;
+    retention.quota_low = stream->delete_quota_low;
 
-  // Recursively process directories
-  deletefiles_in_dir( dirpath, device, now-(hours*3600) );
+    device = get_file_device( dirpath );
+    deletefiles_in_archive( dirpath, device, &retention );
+  }
 
-  // End of child process
-  exit(0);
+  __atomic_store_n( &stream->delete_state, ROTTER_DELETE_FINISHED, __ATOMIC_RELEASE );
+  return NULL;
 }
 
 
-// Harvest zombie processes
-void deletefiles_cleanup_child()
+// Delete files older than 'delete_hours', and then the oldest files if
+// the disk or the archive is too full
+int deletefiles( rotter_stream_t *stream )
 {
-  // Has a child process finished?
-  if (delete_child_pid) {
-    int status = 0;
-    pid_t pid = waitpid( delete_child_pid, &status, WNOHANG );
-    if (pid) {
-      delete_child_pid = 0;
-      if (status) {
-        rotter_error( "File deletion child-process exited with status %d", status );
-      } else {
-        rotter_debug( "File deletion child-process has finished." );
-      }
-    }
+  const char* dirpath = stream->root_directory;
+
+  if (stream->delete_hours<=0 && stream->delete_usage_high<=0 && stream->delete_quota_high<=0)
+    return 0;
+
+  if (__atomic_load_n( &stream->delete_state, __ATOMIC_ACQUIRE ) != ROTTER_DELETE_IDLE) {
+    rotter_error( "Not deleting files: the last deletion thread has not finished." );
+    return -1;
+  }
+
+  if (stream->delete_hours>0)
+    rotter_info( "Deleting files older than %d hours in %s.", stream->delete_hours, dirpath );
+
+  stream->delete_state = ROTTER_DELETE_RUNNING;
+  if (pthread_create( &stream->delete_thread, NULL, deletefiles_thread_func, stream )) {
+    rotter_error( "Warning: failed to start thread to delete files." );
+    stream->delete_state = ROTTER_DELETE_IDLE;
+    return -1;
+  }
+
+  rotter_debug( "Started new thread to delete files." );
+  return 0;
+}
+
+
+// Join the deletion thread, once it has finished
+void deletefiles_cleanup_thread( rotter_stream_t *stream )
+{
+  if (__atomic_load_n( &stream->delete_state, __ATOMIC_ACQUIRE ) == ROTTER_DELETE_FINISHED) {
+    pthread_join( stream->delete_thread, NULL );
+    stream->delete_state = ROTTER_DELETE_IDLE;
+    rotter_debug( "File deletion thread has finished." );
+  }
+}
+
+
+// Wait for the deletion thread, cutting short its wait before starting
+void deletefiles_stop( rotter_stream_t *stream )
+{
+  delete_stopping = 1;
+  if (stream->delete_state != ROTTER_DELETE_IDLE) {
+    pthread_join( stream->delete_thread, NULL );
+    stream->delete_state = ROTTER_DELETE_IDLE;
   }
 }
@@ -0,0 +1,1026 @@
+/*
+
+  extract.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+// For timegm()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "rotter.h"
+
+
+/*
+  rotter-extract copies a stretch of time out of an archive written by
+  rotter, into a single file, without decoding the audio.
+
+  The archive files that cover the time range are found using the same
+  file layouts as rotter. MPEG Audio (mp2 and mp3) is copied a whole frame
+  at a time, so the cut is accurate to within a frame (about 26 ms); the
+  seek index written with -I is used to go straight to the right place,
+  and is also written for the new file. WAV files are copied exactly, to
+  the sample, using the start time in their bext chunk.
+*/
+
+
+#define EXTRACT_NAME          "rotter-extract"
+#define EXTRACT_BUFFER_SIZE   (1048576)
+#define WAV_MAX_HEADER        (65536)
+
+typedef enum {
+  EXTRACT_MPEG=0,
+  EXTRACT_WAV
+} ExtractKind;
+
+
+// Reads through an archive file, a large buffer at a time
+typedef struct extract_reader_s
+{
+  int fd;
+  unsigned char *buf;
+  size_t pos;                      // Position of the next byte in the buffer
+  size_t len;                      // Number of bytes in the buffer
+  off_t offset;                    // Offset in the file of the next byte
+  int eof;
+} extract_reader_t;
+
+// An entry read from a seek index
+typedef struct extract_index_s
+{
+  time_t when;
+  off_t offset;
+} extract_index_t;
+
+// The part of an MPEG Audio file written by one run of rotter
+typedef struct extract_run_s
+{
+  off_t offset;                    // Offset of the first byte of the run
+  double duration;                 // Length of the audio in the run
+  double start;                    // Start time of the run (0 if not known)
+} extract_run_t;
+
+// The file being extracted to
+typedef struct extract_output_s
+{
+  const char *filepath;
+  FILE *file;
+  off_t offset;                    // Number of bytes written
+  int started;                     // Flag to indicate that some audio has been written
+
+  // MPEG Audio seek index
+  unsigned char *entries;
+  size_t entries_len;
+  size_t entries_size;
+  time_t next_index_time;
+
+  // WAV header, copied from the first file
+  unsigned char *wav_header;
+  size_t wav_header_len;
+  size_t wav_fmt_pos;              // Position of the fmt chunk
+  size_t wav_fmt_len;
+  size_t wav_fact_pos;             // Position of the fact chunk (0 if there isn't one)
+  int wav_block_align;
+} extract_output_t;
+
+
+// ------- Globals -------
+int quiet = 0;          // Only display error messages
+int verbose = 0;        // Increase number of logging messages
+
+static time_t range_start = 0;     // Start of the time range (inclusive)
+static time_t range_end = 0;       // End of the time range (exclusive)
+
+
+
+void rotter_log( RotterLogLevel level, const char* fmt, ... )
+{
+  va_list args;
+
+  if (level == ROTTER_DEBUG && !verbose) return;
+  if (level == ROTTER_INFO && quiet) return;
+
+  // Display the message level
+  if (level == ROTTER_DEBUG ) {
+    fprintf( stderr, "[DEBUG]  " );
+  } else if (level == ROTTER_INFO ) {
+    fprintf( stderr, "[INFO]   " );
+  } else if (level == ROTTER_ERROR ) {
+    fprintf( stderr, "[ERROR]  " );
+  } else if (level == ROTTER_FATAL ) {
+    fprintf( stderr, "[FATAL]  " );
+  } else {
+    fprintf( stderr, "[UNKNOWN]" );
+  }
+
+  // Display the error message
+  va_start( args, fmt );
+  vfprintf( stderr, fmt, args );
+  fprintf( stderr, "\n" );
+  va_end( args );
+
+  // If fatal then stop
+  if (level == ROTTER_FATAL)
+    exit( EXIT_FAILURE );
+}
+
+
+static unsigned int get_le16( const unsigned char *p )
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32( const unsigned char *p )
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64( const unsigned char *p )
+{
+  return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void put_le32( unsigned char *p, uint32_t value )
+{
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+static void put_le64( unsigned char *p, uint64_t value )
+{
+  put_le32( p, value );
+  put_le32( p + 4, value >> 32 );
+}
+
+
+
+// Make sure that there are at least 'count' bytes in the buffer
+// Result: number of bytes available (fewer at the end of the file)
+static size_t reader_fill( extract_reader_t *reader, size_t count )
+{
+  if (reader->len - reader->pos >= count || reader->eof)
+    return reader->len - reader->pos;
+
+  memmove( reader->buf, reader->buf + reader->pos, reader->len - reader->pos );
+  reader->len -= reader->pos;
+  reader->pos = 0;
+
+  while (reader->len < count && !reader->eof) {
+    ssize_t result = read( reader->fd, reader->buf + reader->len, EXTRACT_BUFFER_SIZE - reader->len );
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      rotter_error( "Failed to read archive file: %s", strerror(errno) );
+      reader->eof = 1;
+    } else if (result == 0) {
+      reader->eof = 1;
+    } else {
+      reader->len += result;
+    }
+  }
+
+  return reader->len - reader->pos;
+}
+
+static void reader_skip( extract_reader_t *reader, size_t count )
+{
+  reader->pos += count;
+  reader->offset += count;
+}
+
+static int reader_rewind( extract_reader_t *reader )
+{
+  reader->pos = 0;
+  reader->len = 0;
+  reader->offset = 0;
+  reader->eof = 0;
+  return lseek( reader->fd, 0, SEEK_SET ) < 0 ? -1 : 0;
+}
+
+
+static int output_write( extract_output_t *out, const void *data, size_t len )
+{
+  if (fwrite( data, 1, len, out->file ) != len) {
+    rotter_error( "Failed to write to %s: %s", out->filepath, strerror(errno) );
+    return -1;
+  }
+
+  out->offset += len;
+  out->started = 1;
+  return 0;
+}
+
+
+
+// Read the seek index written next to an MPEG Audio file, if there is one
+static extract_index_t* read_seek_index( const char *filepath, size_t *count )
+{
+  char indexpath[MAX_FILEPATH_LEN + sizeof(SEEK_INDEX_SUFFIX)];
+  unsigned char header[SEEK_INDEX_HEADER_LEN];
+  unsigned char entry[SEEK_INDEX_ENTRY_LEN];
+  extract_index_t *index = NULL;
+  size_t size = 0;
+  FILE *file;
+
+  *count = 0;
+  snprintf( indexpath, sizeof(indexpath), "%s%s", filepath, SEEK_INDEX_SUFFIX );
+  file = fopen( indexpath, "rb" );
+  if (file == NULL)
+    return NULL;
+
+  if (fread( header, 1, sizeof(header), file ) != sizeof(header) ||
+      memcmp( header, SEEK_INDEX_MAGIC, 4 ) || get_le32( header + 4 ) != SEEK_INDEX_VERSION)
+  {
+    rotter_error( "Ignoring seek index with an unknown format: %s", indexpath );
+    fclose( file );
+    return NULL;
+  }
+
+  while (fread( entry, 1, sizeof(entry), file ) == sizeof(entry)) {
+    if (*count == size) {
+      extract_index_t *bigger;
+      size = size ? size * 2 : 4096;
+      bigger = realloc( index, size * sizeof(extract_index_t) );
+      if (bigger == NULL) {
+        rotter_error( "Failed to allocate memory for seek index." );
+        free( index );
+        fclose( file );
+        *count = 0;
+        return NULL;
+      }
+      index = bigger;
+    }
+
+    rotter_get_seek_entry( entry, &index[*count].when, &index[*count].offset );
+    (*count)++;
+  }
+
+  fclose( file );
+  rotter_debug( "Read %lu entries from seek index %s.", (unsigned long)*count, indexpath );
+  return index;
+}
+
+
+// Get the start time, to the nearest minute, from an ID3v1 tag written by rotter (0 if there isn't one)
+static time_t id3_start_time( const unsigned char *tag )
+{
+  char title[31];
+  struct tm tm;
+
+  memset( &tm, 0, sizeof(tm) );
+  memcpy( title, tag + 3, 30 );
+  title[30] = '\0';
+  if (sscanf( title, "Recorded %d-%d-%d %d:%d", &tm.tm_year, &tm.tm_mon,
+              &tm.tm_mday, &tm.tm_hour, &tm.tm_min ) != 5)
+    return 0;
+
+  // The tag is in local time
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  return mktime( &tm );
+}
+
+
+// Is this the Xing/LAME tag frame at the start of a file, rather than audio?
+static int is_info_frame( const unsigned char *frame, int frame_len )
+{
+  int i;
+
+  for (i=4; i<40 && i+4<=frame_len; i++) {
+    if (!memcmp( frame + i, "Xing", 4 ) || !memcmp( frame + i, "Info", 4 ))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+static extract_run_t* add_run( extract_run_t *runs, size_t *count, size_t *size, off_t offset )
+{
+  if (*count == *size) {
+    extract_run_t *bigger;
+    *size = *size ? *size * 2 : 16;
+    bigger = realloc( runs, *size * sizeof(extract_run_t) );
+    if (bigger == NULL) {
+      rotter_error( "Failed to allocate memory for the runs of rotter in a file." );
+      free( runs );
+      return NULL;
+    }
+    runs = bigger;
+  }
+
+  runs[*count].offset = offset;
+  runs[*count].duration = 0.0;
+  runs[*count].start = 0.0;
+  (*count)++;
+  return runs;
+}
+
+
+/*
+  Without a seek index, find the parts of an MPEG Audio file written by
+  each run of rotter, and when each one started.
+
+  Each run ends with an ID3v1 tag giving its start time, to the nearest
+  minute; MP3 runs also start with a Xing/LAME frame. A run without a
+  tag is still being written (or rotter didn't stop cleanly): if it is
+  the last of several, it is taken to end when the file was last
+  modified. The reader is left at the start of the file.
+*/
+static extract_run_t* mpeg_find_runs( extract_reader_t *reader, time_t modified, size_t *count )
+{
+  extract_run_t *runs = NULL;
+  size_t size = 0;
+  size_t r;
+
+  *count = 0;
+  runs = add_run( runs, count, &size, 0 );
+
+  while (runs) {
+    extract_run_t *run = &runs[*count - 1];
+    const unsigned char *p;
+    int frame_len, samples, samplerate;
+
+    if (reader_fill( reader, 4 ) < 4)
+      break;
+    p = reader->buf + reader->pos;
+
+    if (rotter_parse_mpeg_header( p, &frame_len, &samples, &samplerate ) == 0) {
+      if (reader_fill( reader, frame_len ) < frame_len)
+        break;
+      p = reader->buf + reader->pos;
+
+      // A run that didn't leave a tag, followed by a new run
+      if (run->duration > 0.0 && is_info_frame( p, frame_len )) {
+        runs = add_run( runs, count, &size, reader->offset );
+        if (runs == NULL)
+          break;
+        run = &runs[*count - 1];
+      }
+
+      run->duration += (double)samples / samplerate;
+      reader_skip( reader, frame_len );
+    } else if (!memcmp( p, "TAG", 3 ) && reader_fill( reader, 128 ) >= 128) {
+      run->start = id3_start_time( reader->buf + reader->pos );
+      reader_skip( reader, 128 );
+      runs = add_run( runs, count, &size, reader->offset );
+    } else {
+      reader_skip( reader, 1 );
+    }
+  }
+
+  if (runs == NULL || reader_rewind( reader )) {
+    free( runs );
+    *count = 0;
+    return NULL;
+  }
+
+  // Nothing follows the last tag
+  if (*count > 1 && runs[*count - 1].duration == 0.0)
+    (*count)--;
+
+  // A single run without a tag is taken to start with its period, as before
+  if (*count > 1 && runs[*count - 1].start == 0.0)
+    runs[*count - 1].start = modified - runs[*count - 1].duration;
+
+  for (r=0; r<*count; r++) {
+    rotter_debug( "Run %lu of rotter starts at offset %lld, %.1f seconds long, started %.0f.",
+                  (unsigned long)r + 1, (long long)runs[r].offset, runs[r].duration, runs[r].start );
+  }
+
+  return runs;
+}
+
+
+// Copy a frame to the output, adding it to the seek index if it starts a new second
+static int output_mpeg_frame( extract_output_t *out, const unsigned char *frame, int frame_len, double frame_time )
+{
+  if (frame_time >= out->next_index_time) {
+    if (out->entries_len + SEEK_INDEX_ENTRY_LEN > out->entries_size) {
+      size_t size = out->entries_size ? out->entries_size * 2 : SEEK_INDEX_ENTRY_LEN * 4096;
+      unsigned char *entries = realloc( out->entries, size );
+      if (entries == NULL) {
+        rotter_error( "Failed to allocate memory for seek index." );
+        return -1;
+      }
+      out->entries = entries;
+      out->entries_size = size;
+    }
+
+    rotter_put_seek_entry( out->entries + out->entries_len, out->next_index_time, out->offset );
+    out->entries_len += SEEK_INDEX_ENTRY_LEN;
+    out->next_index_time = (time_t)frame_time + 1;
+  }
+
+  return output_write( out, frame, frame_len );
+}
+
+
+/*
+  Copy the frames of an MPEG Audio file that fall within the time range.
+  The frame headers are followed through the file, to keep track of the
+  time; the ID3v1 tags and Xing/LAME frames left by each run of rotter
+  are left out.
+*/
+static int extract_mpeg_file( const char *filepath, time_t period_start, extract_output_t *out,
+                              extract_reader_t *reader )
+{
+  extract_index_t *index = NULL;
+  extract_run_t *runs = NULL;
+  size_t index_count = 0;
+  size_t run_count = 0;
+  size_t k = 0, r = 0;
+  off_t end_offset;
+  double frame_time;
+  unsigned long skipped = 0;
+  struct stat st;
+  int result = 0;
+
+  reader->fd = open( filepath, O_RDONLY );
+  if (reader->fd < 0 || fstat( reader->fd, &st )) {
+    rotter_error( "Failed to open %s: %s", filepath, strerror(errno) );
+    if (reader->fd >= 0) close( reader->fd );
+    return -1;
+  }
+
+  end_offset = st.st_size;
+  reader->pos = 0;
+  reader->len = 0;
+  reader->offset = 0;
+  reader->eof = 0;
+
+  index = read_seek_index( filepath, &index_count );
+  if (index) {
+    // Jump straight to the first frame in the range
+    while (k < index_count && index[k].when < range_start)
+      k++;
+    if (k == index_count) {
+      rotter_debug( "%s ends before the start of the range.", filepath );
+      goto finished;
+    }
+    reader->offset = index[k].offset;
+    frame_time = index[k].when;
+
+    for (k=0; k<index_count; k++) {
+      if (index[k].when >= range_end) {
+        end_offset = index[k].offset;
+        break;
+      }
+    }
+    k = 0;
+
+    if (lseek( reader->fd, reader->offset, SEEK_SET ) < 0) {
+      rotter_error( "Failed to seek in %s: %s", filepath, strerror(errno) );
+      result = -1;
+      goto finished;
+    }
+  } else {
+    frame_time = period_start;
+    runs = mpeg_find_runs( reader, st.st_mtime, &run_count );
+    if (run_count > 1) {
+      rotter_info( "No seek index; placing the %lu runs of rotter in %s by their ID3 tags, to the nearest minute.",
+                   (unsigned long)run_count, filepath );
+    } else if (run_count == 1 && runs[0].start > period_start) {
+      rotter_info( "No seek index; taking the start time from the ID3 tag, to the nearest minute." );
+    }
+  }
+
+  rotter_info( "Extracting from %s.", filepath );
+
+  while (reader->offset < end_offset) {
+    const unsigned char *p;
+    int frame_len, samples, samplerate;
+
+    if (reader_fill( reader, 4 ) < 4)
+      break;
+    p = reader->buf + reader->pos;
+
+    // Keep the time in step with the index, which also covers gaps between runs of rotter
+    while (k < index_count && index[k].offset < reader->offset)
+      k++;
+    if (k < index_count && index[k].offset == reader->offset)
+      frame_time = index[k].when;
+
+    // Without one, the time jumps forward at the start of each run of rotter
+    while (r < run_count && runs[r].offset <= reader->offset) {
+      if (runs[r].start > frame_time)
+        frame_time = runs[r].start;
+      r++;
+    }
+
+    if (rotter_parse_mpeg_header( p, &frame_len, &samples, &samplerate ) == 0) {
+      // The last frame may not have been written yet
+      if (reader_fill( reader, frame_len ) < frame_len)
+        break;
+      p = reader->buf + reader->pos;
+
+      if (!index && frame_time >= range_end)
+        break;
+
+      if (frame_time >= range_start && !is_info_frame( p, frame_len )) {
+        if (output_mpeg_frame( out, p, frame_len, frame_time )) {
+          result = -1;
+          break;
+        }
+      }
+
+      frame_time += (double)samples / samplerate;
+      reader_skip( reader, frame_len );
+    } else if (!memcmp( p, "TAG", 3 ) && reader_fill( reader, 128 ) >= 128) {
+      // The ID3v1 tag at the end of an earlier run of rotter
+      reader_skip( reader, 128 );
+    } else {
+      // Look for the next frame
+      skipped++;
+      reader_skip( reader, 1 );
+    }
+  }
+
+  if (skipped)
+    rotter_error( "Skipped %lu bytes that weren't MPEG Audio frames in %s.", skipped, filepath );
+
+finished:
+  free( index );
+  free( runs );
+  close( reader->fd );
+  return result;
+}
+
+
+// Write out the seek index for the new MPEG Audio file
+static int finish_mpeg_output( extract_output_t *out )
+{
+  char indexpath[MAX_FILEPATH_LEN + sizeof(SEEK_INDEX_SUFFIX)];
+  unsigned char header[SEEK_INDEX_HEADER_LEN] = SEEK_INDEX_MAGIC;
+  FILE *file;
+  int result = 0;
+
+  // The output file is named on the command line, so may be any length
+  if (snprintf( indexpath, sizeof(indexpath), "%s%s", out->filepath, SEEK_INDEX_SUFFIX ) >= (int)sizeof(indexpath)) {
+    rotter_error( "Output file path is too long to write a seek index next to it: %s", out->filepath );
+    return -1;
+  }
+
+  file = fopen( indexpath, "wb" );
+  if (file == NULL) {
+    rotter_error( "Failed to open %s: %s", indexpath, strerror(errno) );
+    return -1;
+  }
+
+  put_le32( header + 4, SEEK_INDEX_VERSION );
+  if (fwrite( header, 1, sizeof(header), file ) != sizeof(header) ||
+      fwrite( out->entries, 1, out->entries_len, file ) != out->entries_len)
+  {
+    rotter_error( "Failed to write %s: %s", indexpath, strerror(errno) );
+    result = -1;
+  }
+
+  if (fclose( file )) {
+    rotter_error( "Failed to close %s: %s", indexpath, strerror(errno) );
+    result = -1;
+  }
+
+  return result;
+}
+
+
+
+// Fill in the origination date and time of a bext chunk, like rotter does
+static void set_bext_time( unsigned char *bext, double start, int samplerate )
+{
+  time_t start_sec = (time_t)start;
+  char tmp_str[32];
+  time_t midnight;
+  struct tm tm;
+
+  localtime_r( &start_sec, &tm );
+  snprintf( tmp_str, sizeof(tmp_str), "%4.4d-%2.2d-%2.2d", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday );
+  memcpy( bext + 320, tmp_str, 10 );
+  snprintf( tmp_str, sizeof(tmp_str), "%2.2d:%2.2d:%2.2d", tm.tm_hour, tm.tm_min, tm.tm_sec );
+  memcpy( bext + 330, tmp_str, 8 );
+
+  tm.tm_hour = 0;
+  tm.tm_min = 0;
+  tm.tm_sec = 0;
+  midnight = mktime( &tm );
+  put_le64( bext + 338, (uint64_t)llround( (start - midnight) * samplerate ) );
+}
+
+
+// Get the start time of a WAV file from its bext chunk
+static double get_bext_time( const unsigned char *bext, int samplerate, time_t period_start )
+{
+  char tmp_str[20];
+  struct tm tm;
+  time_t midnight;
+
+  memset( &tm, 0, sizeof(tm) );
+  memcpy( tmp_str, bext + 320, 10 );
+  tmp_str[10] = '\0';
+  if (sscanf( tmp_str, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday ) != 3)
+    return period_start;
+
+  // The time reference counts samples since midnight, local time
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  midnight = mktime( &tm );
+
+  return midnight + (double)get_le64( bext + 338 ) / samplerate;
+}
+
+
+/*
+  Copy the samples of a WAV file that fall within the time range.
+  The header of the first file is used for the new file.
+*/
+static int extract_wav_file( const char *filepath, time_t period_start, extract_output_t *out,
+                             extract_reader_t *reader )
+{
+  unsigned char *header = reader->buf;
+  size_t header_len, pos = 12;
+  size_t bext_pos = 0, fmt_pos = 0, fmt_len = 0, fact_pos = 0, data_pos = 0;
+  uint64_t data_len = 0, ds64_data_len = 0;
+  int64_t first, last, frames;
+  int samplerate = 0, block_align = 0, rf64;
+  double file_start;
+  struct stat st;
+  ssize_t result;
+
+  reader->fd = open( filepath, O_RDONLY );
+  if (reader->fd < 0 || fstat( reader->fd, &st )) {
+    rotter_error( "Failed to open %s: %s", filepath, strerror(errno) );
+    if (reader->fd >= 0) close( reader->fd );
+    return -1;
+  }
+
+  result = pread( reader->fd, header, WAV_MAX_HEADER, 0 );
+  header_len = result > 0 ? result : 0;
+  rf64 = header_len >= 12 && !memcmp( header, "RF64", 4 );
+  if (header_len < 12 || (memcmp( header, "RIFF", 4 ) && !rf64) || memcmp( header + 8, "WAVE", 4 )) {
+    rotter_error( "%s is not a WAV file.", filepath );
+    close( reader->fd );
+    return -1;
+  }
+
+  // Find the chunks that we need, up to the start of the audio
+  while (pos + 8 <= header_len) {
+    uint32_t chunk_len = get_le32( header + pos + 4 );
+
+    if (!memcmp( header + pos, "ds64", 4 ) && pos + 8 + 16 <= header_len) {
+      ds64_data_len = get_le64( header + pos + 8 + 8 );
+    } else if (!memcmp( header + pos, "bext", 4 ) && pos + 8 + 346 <= header_len) {
+      bext_pos = pos;
+    } else if (!memcmp( header + pos, "fmt ", 4 ) && pos + 8 + 16 <= header_len) {
+      fmt_pos = pos;
+      fmt_len = 8 + chunk_len;
+    } else if (!memcmp( header + pos, "fact", 4 )) {
+      fact_pos = pos;
+    } else if (!memcmp( header + pos, "data", 4 )) {
+      data_pos = pos + 8;
+      data_len = (rf64 && chunk_len == 0xFFFFFFFF) ? ds64_data_len : chunk_len;
+      break;
+    }
+
+    pos += 8 + chunk_len + (chunk_len & 1);
+  }
+
+  if (fmt_pos == 0 || data_pos == 0) {
+    rotter_error( "Failed to find the audio in %s.", filepath );
+    close( reader->fd );
+    return -1;
+  }
+
+  samplerate = get_le32( header + fmt_pos + 8 + 4 );
+  block_align = get_le16( header + fmt_pos + 8 + 12 );
+  if (samplerate <= 0 || block_align <= 0) {
+    rotter_error( "Unsupported audio format in %s.", filepath );
+    close( reader->fd );
+    return -1;
+  }
+
+  // The sizes in the header may not have been filled in yet
+  if (data_len == 0 || data_pos + data_len > (uint64_t)st.st_size)
+    data_len = st.st_size - data_pos;
+  frames = data_len / block_align;
+
+  file_start = bext_pos ? get_bext_time( header + bext_pos + 8, samplerate, period_start ) : period_start;
+  first = (int64_t)ceil( (range_start - file_start) * samplerate );
+  last = (int64_t)ceil( (range_end - file_start) * samplerate );
+  if (first < 0) first = 0;
+  if (last > frames) last = frames;
+  if (first >= last) {
+    rotter_debug( "%s is outside of the range.", filepath );
+    close( reader->fd );
+    return 0;
+  }
+
+  if (!out->started) {
+    // Use this file's header for the new file
+    out->wav_header = malloc( data_pos );
+    if (out->wav_header == NULL) {
+      rotter_error( "Failed to allocate memory for WAV header." );
+      close( reader->fd );
+      return -1;
+    }
+    memcpy( out->wav_header, header, data_pos );
+    out->wav_header_len = data_pos;
+    out->wav_fmt_pos = fmt_pos;
+    out->wav_fmt_len = fmt_len;
+    out->wav_fact_pos = fact_pos;
+    out->wav_block_align = block_align;
+
+    // The new file isn't going to be bigger than 4GB
+    if (rf64) {
+      memcpy( out->wav_header, "RIFF", 4 );
+      pos = 12;
+      while (pos + 8 <= data_pos) {
+        if (!memcmp( out->wav_header + pos, "ds64", 4 ))
+          memcpy( out->wav_header + pos, "JUNK", 4 );
+        pos += 8 + get_le32( out->wav_header + pos + 4 );
+      }
+    }
+
+    if (bext_pos)
+      set_bext_time( out->wav_header + bext_pos + 8, file_start + (double)first / samplerate, samplerate );
+
+    if (output_write( out, out->wav_header, out->wav_header_len )) {
+      close( reader->fd );
+      return -1;
+    }
+  } else if (fmt_len != out->wav_fmt_len ||
+             memcmp( header + fmt_pos, out->wav_header + out->wav_fmt_pos, fmt_len ))
+  {
+    rotter_error( "%s has a different audio format to the files before it.", filepath );
+    close( reader->fd );
+    return -1;
+  }
+
+  if (out->offset + (last - first) * block_align > 0xFFFFFFFFLL) {
+    rotter_error( "The time range is too long for a WAV file." );
+    close( reader->fd );
+    return -1;
+  }
+
+  rotter_info( "Extracting from %s.", filepath );
+
+  // Copy the audio straight across
+  reader->pos = 0;
+  reader->len = 0;
+  reader->eof = 0;
+  reader->offset = data_pos + first * block_align;
+  if (lseek( reader->fd, reader->offset, SEEK_SET ) < 0) {
+    rotter_error( "Failed to seek in %s: %s", filepath, strerror(errno) );
+    close( reader->fd );
+    return -1;
+  }
+
+  data_len = (last - first) * block_align;
+  while (data_len > 0) {
+    size_t len = reader_fill( reader, 1 );
+    if (len == 0) {
+      rotter_error( "%s is shorter than expected.", filepath );
+      break;
+    }
+    if (len > data_len)
+      len = data_len;
+    if (output_write( out, reader->buf + reader->pos, len )) {
+      close( reader->fd );
+      return -1;
+    }
+    reader_skip( reader, len );
+    data_len -= len;
+  }
+
+  close( reader->fd );
+  return 0;
+}
+
+
+// Fill in the sizes in the header of the new WAV file
+static int finish_wav_output( extract_output_t *out )
+{
+  uint32_t data_len = out->offset - out->wav_header_len;
+  unsigned char *header = out->wav_header;
+
+  put_le32( header + 4, out->offset - 8 );
+  put_le32( header + out->wav_header_len - 4, data_len );
+  if (out->wav_fact_pos)
+    put_le32( header + out->wav_fact_pos + 8, data_len / out->wav_block_align );
+
+  if (fflush( out->file ) ||
+      pwrite( fileno(out->file), header, out->wav_header_len, 0 ) != out->wav_header_len)
+  {
+    rotter_error( "Failed to write WAV header: %s", strerror(errno) );
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+// Parse a time in UTC, such as "2015-06-05 14:52:10"
+static int parse_time( const char *str, time_t *result )
+{
+  struct tm tm;
+  char sep, zone = 'Z';
+  int n;
+
+  memset( &tm, 0, sizeof(tm) );
+  n = sscanf( str, "%d-%d-%d%c%d:%d:%d%c", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+              &sep, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &zone );
+  if (n < 7 || (sep != ' ' && sep != 'T') || zone != 'Z')
+    return -1;
+
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  *result = timegm( &tm );
+
+  return 0;
+}
+
+
+static void usage()
+{
+  printf("%s version %s\n\n", EXTRACT_NAME, PACKAGE_VERSION);
+  printf("Usage: %s [options] -o <file> <root_directory> <start> <end>\n", EXTRACT_NAME);
+  printf("   -o <file>     File to write the extracted audio to\n");
+  printf("   -f <format>   Format of the archive files: mp3, mp2 or wav (default mp3)\n");
+  printf("   -L <layout>   File layout of the archive (default %s)\n", DEFAULT_FILE_LAYOUT);
+  printf("   -N <filename> Name of the archive files (default '%s')\n", DEFAULT_ARCHIVE_NAME);
+  printf("   -p <secs>     Period of each archive file (in seconds, default %d)\n", DEFAULT_ARCHIVE_PERIOD_SECONDS);
+  printf("   -u            Archive file names are in UTC rather than local time\n");
+  printf("   -v            Enable verbose mode\n");
+  printf("   -q            Enable quiet mode\n");
+  printf("\n");
+  printf("The start and end are in UTC, written as YYYY-MM-DD HH:MM:SS.\n");
+  printf("The layouts are the same as for rotter, apart from 'accurate'.\n");
+  exit(1);
+}
+
+
+int main( int argc, char *argv[] )
+{
+  extract_output_t out;
+  extract_reader_t reader;
+  const char *root_directory = NULL;
+  const char *file_layout = DEFAULT_FILE_LAYOUT;
+  const char *archive_name = NULL;
+  const char *format = "mp3";
+  long period_seconds = DEFAULT_ARCHIVE_PERIOD_SECONDS;
+  ExtractKind kind = EXTRACT_MPEG;
+  int utc = 0;
+  int result = 0;
+  time_t period;
+  int opt;
+
+  memset( &out, 0, sizeof(out) );
+  memset( &reader, 0, sizeof(reader) );
+
+  while ((opt = getopt(argc, argv, "o:f:L:N:p:uvqh")) != -1) {
+    switch (opt) {
+      case 'o':  out.filepath = optarg; break;
+      case 'f':  format = optarg; break;
+      case 'L':  file_layout = optarg; break;
+      case 'N':  archive_name = optarg; break;
+      case 'p':  period_seconds = atol(optarg); break;
+      case 'u':  utc = 1; break;
+      case 'v':  verbose = 1; break;
+      case 'q':  quiet = 1; break;
+      default:  usage(); break;
+    }
+  }
+
+  if (argc - optind != 3 || out.filepath == NULL)
+    usage();
+
+  root_directory = argv[optind];
+  if (parse_time( argv[optind+1], &range_start ) || parse_time( argv[optind+2], &range_end )) {
+    rotter_fatal( "Times should be given as YYYY-MM-DD HH:MM:SS (in UTC)." );
+  }
+  if (range_end <= range_start) {
+    rotter_fatal( "The end of the range should be after the start." );
+  }
+  if (period_seconds <= 0) {
+    rotter_fatal( "Invalid archive period: %ld", period_seconds );
+  }
+
+  if (!strcasecmp( format, "mp3" ) || !strcasecmp( format, "mp2" )) {
+    kind = EXTRACT_MPEG;
+  } else if (!strcasecmp( format, "wav" ) || !strcasecmp( format, "wav32" )) {
+    kind = EXTRACT_WAV;
+    format = "wav";
+  } else {
+    rotter_fatal( "Audio in %s format can't be extracted.", format );
+  }
+
+  // The file names include the hundredths of a second that recording started at
+  if (!strcasecmp( file_layout, "accurate" )) {
+    rotter_fatal( "The 'accurate' file layout isn't supported." );
+  }
+
+  reader.buf = malloc( EXTRACT_BUFFER_SIZE );
+  if (reader.buf == NULL) {
+    rotter_fatal( "Failed to allocate memory for reading archive files." );
+  }
+
+  out.file = fopen( out.filepath, "wb" );
+  if (out.file == NULL) {
+    rotter_fatal( "Failed to open %s: %s", out.filepath, strerror(errno) );
+  }
+  setvbuf( out.file, NULL, _IOFBF, EXTRACT_BUFFER_SIZE );
+  out.next_index_time = range_start;
+
+  // Go through each of the periods that overlap the range
+  for (period = range_start - (range_start % period_seconds); period < range_end; period += period_seconds) {
+    char filepath[MAX_FILEPATH_LEN];
+    struct tm tm;
+
+    if (utc) {
+      gmtime_r( &period, &tm );
+    } else {
+      localtime_r( &period, &tm );
+    }
+
+    if (rotter_time_to_filepath( root_directory, archive_name, file_layout, &tm, 0, format, filepath )) {
+      rotter_fatal( "Failed to build file path for layout: %s", file_layout );
+    }
+
+    if (access( filepath, R_OK )) {
+      rotter_error( "Missing archive file: %s", filepath );
+      continue;
+    }
+
+    if (kind == EXTRACT_MPEG) {
+      result = extract_mpeg_file( filepath, period, &out, &reader );
+    } else {
+      result = extract_wav_file( filepath, period, &out, &reader );
+    }
+    if (result)
+      break;
+  }
+
+  if (result == 0 && !out.started) {
+    rotter_error( "No audio found for that time range." );
+    result = -1;
+  }
+
+  if (result == 0) {
+    if (kind == EXTRACT_MPEG) {
+      result = finish_mpeg_output( &out );
+    } else {
+      result = finish_wav_output( &out );
+    }
+  }
+
+  if (fclose( out.file )) {
+    rotter_error( "Failed to close %s: %s", out.filepath, strerror(errno) );
+    result = -1;
+  }
+
+  if (result) {
+    unlink( out.filepath );
+  } else {
+    rotter_info( "Wrote %lld bytes to %s.", (long long)out.offset, out.filepath );
+  }
+
+  free( out.entries );
+  free( out.wav_header );
+  free( reader.buf );
+
+  return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+/*
+
+  fileio.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+// For fallocate() and sync_file_range()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rotter.h"
+#include "config.h"
+
+
+// ------- Globals -------
+int preallocate = 0;         // Reserve disk space for each archive file when it is opened
+int incremental_writeback = 0;   // Hand audio to the disk as it is written, rather than syncing
+
+static pthread_mutex_t sync_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long sync_count = 0;    // Number of syncs since the last report
+static double sync_total = 0.0;         // Total time spent syncing (in seconds)
+static double sync_longest = 0.0;       // Longest time for a single sync (in seconds)
+
+
+/*
+  Reserve space on disk for 'bytes' more bytes at the end of a file,
+  so that it is laid out in a few large extents rather than growing
+  a little at every write.
+
+  The file keeps its size (FALLOC_FL_KEEP_SIZE): the encoders append
+  to the end of the file, and a reader shouldn't see a tail of zeros.
+*/
+void rotter_preallocate_file( const char *filepath, off_t bytes )
+{
+#ifdef HAVE_FALLOCATE
+  struct stat st;
+  int fd;
+
+  if (bytes <= 0)
+    return;
+
+  fd = open( filepath, O_WRONLY );
+  if (fd < 0) {
+    rotter_error( "Failed to open %s to preallocate it: %s", filepath, strerror(errno) );
+    return;
+  }
+
+  if (fstat( fd, &st ) == 0) {
+    rotter_debug( "Preallocating %ld bytes for %s.", (long)bytes, filepath );
+    if (fallocate( fd, FALLOC_FL_KEEP_SIZE, st.st_size, bytes )) {
+      // Not every filesystem supports it; the file just isn't preallocated
+      rotter_debug( "Failed to preallocate %s: %s", filepath, strerror(errno) );
+    }
+  }
+
+  close( fd );
+#endif
+}
+
+
+// Give back any preallocated space that wasn't used, once a file has been closed
+void rotter_trim_file( const char *filepath )
+{
+#ifdef HAVE_FALLOCATE
+  struct stat st;
+  int fd;
+
+  fd = open( filepath, O_WRONLY );
+  if (fd < 0) {
+    rotter_debug( "Failed to open %s to trim it: %s", filepath, strerror(errno) );
+    return;
+  }
+
+  // Truncating to the current size frees the blocks beyond the end
+  if (fstat( fd, &st ) == 0 && ftruncate( fd, st.st_size )) {
+    rotter_error( "Failed to trim %s: %s", filepath, strerror(errno) );
+  }
+
+  close( fd );
+#endif
+}
+
+
+// An archive file that has been closed, for finishing off
+typedef struct rotter_closed_file_s
+{
+  char root_directory[MAX_FILEPATH_LEN];
+  char filepath[MAX_FILEPATH_LEN];
+  int trim;                        // Give back the space that was preallocated
+} rotter_closed_file_t;
+
+
+static void rotter_finish_closed_file( void *arg )
+{
+  rotter_closed_file_t *closed = (rotter_closed_file_t*)arg;
+
+  if (closed->trim)
+    rotter_trim_file( closed->filepath );
+
+  // Add it to the list of files to be deleted once they expire
+  deletefiles_record( closed->root_directory, closed->filepath );
+
+  free( closed );
+}
+
+
+/*
+  Finish off an archive file once its encoder has closed it. With
+  asynchronous output (-A), the end of the file may still be waiting to
+  be written, so this is put off until it has been.
+*/
+void rotter_file_closed( rotter_stream_t *stream, rotter_file_t *file )
+{
+  rotter_closed_file_t *closed = calloc( 1, sizeof(rotter_closed_file_t) );
+  if (closed == NULL) {
+    rotter_error( "Failed to allocate memory for closed file." );
+    return;
+  }
+
+  snprintf( closed->root_directory, sizeof(closed->root_directory), "%s", stream->root_directory );
+  snprintf( closed->filepath, sizeof(closed->filepath), "%s", file->filepath );
+  closed->trim = preallocate && file->encoder->bytes_per_second > 0;
+
+  if (async_output && rotter_aio_after( rotter_finish_closed_file, closed ) == 0)
+    return;
+
+  rotter_finish_closed_file( closed );
+}
+
+
+/*
+  Incremental writeback (-W): rather than a full sync of each file
+  every few seconds, the part written since last time is handed to the
+  disk with sync_file_range(), without waiting for it. The part handed
+  over the time before should have reached the disk by now; once it
+  has, it is dropped from the page cache, so that weeks of archive
+  writes don't push other files out of memory.
+*/
+void rotter_writeback_file( rotter_file_t *file, int fd )
+{
+  off_t start = file->writeback_start;
+  off_t end = file->writeback_end;
+  struct stat st;
+
+  if (fstat( fd, &st )) {
+    rotter_error( "Failed to get size of archive file: %s", strerror(errno) );
+    return;
+  }
+
+  if (end > start) {
+#ifdef HAVE_SYNC_FILE_RANGE
+    if (sync_file_range( fd, start, end - start, SYNC_FILE_RANGE_WAIT_BEFORE |
+                         SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER ))
+#else
+    if (fdatasync( fd ))
+#endif
+    {
+      rotter_error( "Failed to write archive file to disk: %s", strerror(errno) );
+    }
+
+    posix_fadvise( fd, start, end - start, POSIX_FADV_DONTNEED );
+  }
+
+  // Start writing out the new part of the file
+  file->writeback_start = end;
+  file->writeback_end = st.st_size;
+#ifdef HAVE_SYNC_FILE_RANGE
+  if (st.st_size > end) {
+    if (sync_file_range( fd, end, st.st_size - end, SYNC_FILE_RANGE_WRITE )) {
+      rotter_error( "Failed to start writing archive file to disk: %s", strerror(errno) );
+    }
+  }
+#endif
+}
+
+
+// Record how long a sync took
+void rotter_sync_stats_add( double seconds )
+{
+  pthread_mutex_lock( &sync_stats_lock );
+  sync_count++;
+  sync_total += seconds;
+  if (seconds > sync_longest)
+    sync_longest = seconds;
+  pthread_mutex_unlock( &sync_stats_lock );
+}
+
+
+// Log how long syncs have been taking, since the last report
+void rotter_sync_stats_report()
+{
+  pthread_mutex_lock( &sync_stats_lock );
+  if (sync_count > 0) {
+    rotter_info( "Synced to disk %lu times, taking %.1f ms on average and %.1f ms at most.",
+                 sync_count, (sync_total / sync_count) * 1000, sync_longest * 1000 );
+  }
+  sync_count = 0;
+  sync_total = 0.0;
+  sync_longest = 0.0;
+  pthread_mutex_unlock( &sync_stats_lock );
+}
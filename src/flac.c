@@ -0,0 +1,513 @@
+/*
+
+  flac.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "rotter.h"
+
+
+// ------- Globals -------
+int flac_compression = DEFAULT_FLAC_COMPRESSION;   // FLAC compression level (0 fastest, 8 smallest)
+int flac_threads = 1;                              // Threads for libFLAC to encode each file with
+
+
+#ifdef HAVE_FLAC
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <FLAC/metadata.h>
+#include <FLAC/stream_encoder.h>
+
+
+/*
+  FLAC encoder, using libFLAC's stream encoder directly.
+
+  The file is written through our own callbacks, so that its descriptor
+  can be used for syncing and writeback, and so that it can be queued
+  for asynchronous output with -A. At the end of each file libFLAC
+  seeks back to fill in the STREAMINFO block and a seek table; the seek
+  table has a point every FLAC_SEEKPOINT_SECONDS, up to the length of the
+  archive period, and any points past the end of a shorter file are
+  left unused.
+
+  libFLAC resets its settings when a file is finished, so the encoder is
+  set up afresh as each file is opened.
+*/
+
+
+// ------ Structures ---------
+typedef struct flac_state_s
+{
+  FLAC__StreamEncoder *encoder;
+  int bits_per_sample;
+  FLAC__int32 *i32_buffer;         // Samples to be encoded
+  size_t i32_buffer_size;
+  short int *i16_buffer;           // 16-bit samples, before they are widened
+  size_t i16_buffer_size;
+  rotter_dither_t dither;
+} flac_state_t;
+
+typedef struct flac_handle_s
+{
+  int fd;
+  rotter_aio_file_t *aio;              // Asynchronous output (-A)
+  off_t pos;                           // Where libFLAC is writing to, with -A
+  FLAC__StreamMetadata *metadata[2];   // Seek table and Vorbis comment
+} flac_handle_t;
+
+
+
+static FLAC__StreamEncoderWriteStatus flac_write_callback(const FLAC__StreamEncoder *encoder,
+    const FLAC__byte buffer[], size_t bytes, uint32_t samples, uint32_t current_frame, void *client_data)
+{
+  flac_handle_t *handle = (flac_handle_t*)client_data;
+  size_t written = 0;
+
+  if (handle->aio) {
+    // Once libFLAC has seeked back to fill in the metadata, the write
+    // has to wait for the rest of the file
+    int result = handle->pos == rotter_aio_tell( handle->aio ) ?
+                   rotter_aio_write( handle->aio, buffer, bytes ) :
+                   rotter_aio_write_at( handle->aio, buffer, bytes, handle->pos );
+    if (result)
+      return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    handle->pos += bytes;
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+  }
+
+  while (written < bytes) {
+    ssize_t result = write( handle->fd, buffer + written, bytes - written );
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      rotter_error( "Warning: failed to write encoded audio to disk: %s", strerror(errno) );
+      return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    }
+    written += result;
+  }
+
+  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static FLAC__StreamEncoderSeekStatus flac_seek_callback(const FLAC__StreamEncoder *encoder,
+    FLAC__uint64 absolute_byte_offset, void *client_data)
+{
+  flac_handle_t *handle = (flac_handle_t*)client_data;
+
+  if (handle->aio) {
+    handle->pos = absolute_byte_offset;
+    return FLAC__STREAM_ENCODER_SEEK_STATUS_OK;
+  }
+
+  if (lseek( handle->fd, absolute_byte_offset, SEEK_SET ) < 0)
+    return FLAC__STREAM_ENCODER_SEEK_STATUS_ERROR;
+
+  return FLAC__STREAM_ENCODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamEncoderTellStatus flac_tell_callback(const FLAC__StreamEncoder *encoder,
+    FLAC__uint64 *absolute_byte_offset, void *client_data)
+{
+  flac_handle_t *handle = (flac_handle_t*)client_data;
+  off_t pos = handle->aio ? handle->pos : lseek( handle->fd, 0, SEEK_CUR );
+
+  if (pos < 0)
+    return FLAC__STREAM_ENCODER_TELL_STATUS_ERROR;
+
+  *absolute_byte_offset = pos;
+  return FLAC__STREAM_ENCODER_TELL_STATUS_OK;
+}
+
+
+// Convert floating point samples to 24-bit integers
+static void float32_to_s24(const jack_default_audio_sample_t *in, FLAC__int32 *out, size_t count)
+{
+  size_t i;
+
+  // Branch-free, so that the compiler can vectorise it
+  for (i=0; i<count; i++) {
+    float v = in[i] * 8388608.0f;
+    v = v > 8388607.0f ? 8388607.0f : v;
+    v = v < -8388608.0f ? -8388608.0f : v;
+    out[i] = lrintf( v );
+  }
+}
+
+
+/*
+  Encode and write some audio from the ring buffer to disk
+*/
+static int write_flac(encoder_funcs_t *enc, void *fh, size_t frame_count, const jack_default_audio_sample_t *buffer)
+{
+  flac_state_t *state = (flac_state_t*)enc->state;
+  size_t samples = frame_count * enc->channels;
+  size_t i;
+
+  // Make sure there is enough space for the integer samples
+  if (samples * sizeof(FLAC__int32) > state->i32_buffer_size) {
+    FLAC__int32 *i32_buffer = realloc( state->i32_buffer, samples * sizeof(FLAC__int32) );
+    if (!i32_buffer) {
+      rotter_fatal( "realloc on i32_buffer failed" );
+      return -1;
+    }
+    state->i32_buffer = i32_buffer;
+    state->i32_buffer_size = samples * sizeof(FLAC__int32);
+  }
+
+  if (state->bits_per_sample == 16) {
+    if (samples * sizeof(short int) > state->i16_buffer_size) {
+      short int *i16_buffer = realloc( state->i16_buffer, samples * sizeof(short int) );
+      if (!i16_buffer) {
+        rotter_fatal( "realloc on i16_buffer failed" );
+        return -1;
+      }
+      state->i16_buffer = i16_buffer;
+      state->i16_buffer_size = samples * sizeof(short int);
+    }
+
+    // Use the same (vectorised, and maybe dithered) conversion as the other 16-bit formats
+    rotter_float_to_s16( buffer, state->i16_buffer, samples, dither_output ? &state->dither : NULL );
+    for (i=0; i<samples; i++)
+      state->i32_buffer[i] = state->i16_buffer[i];
+  } else {
+    float32_to_s24( buffer, state->i32_buffer, samples );
+  }
+
+  if (!FLAC__stream_encoder_process_interleaved( state->encoder, state->i32_buffer, frame_count )) {
+    rotter_error( "Error: while encoding audio: %s",
+                  FLAC__stream_encoder_get_resolved_state_string( state->encoder ) );
+    return -1;
+  }
+
+  // Success
+  return 0;
+}
+
+
+static int sync_flac(encoder_funcs_t *enc, void *fh)
+{
+  flac_handle_t *handle = (flac_handle_t*)fh;
+
+  if (handle->aio)
+    return rotter_aio_sync( handle->aio );
+
+  // Audio is written out as each block is encoded
+  return fdatasync( handle->fd );
+}
+
+
+static int flush_flac(encoder_funcs_t *enc, void *fh)
+{
+  flac_handle_t *handle = (flac_handle_t*)fh;
+
+  if (handle->aio && rotter_aio_flush( handle->aio ))
+    return -1;
+
+  return handle->fd;
+}
+
+
+// Close the file (in the background with -A, once the rest of it has been written)
+static int close_flac_file(flac_handle_t *handle)
+{
+  if (handle->aio)
+    return rotter_aio_close( handle->aio );
+
+  if (close( handle->fd )) {
+    rotter_error( "Failed to close output file: %s", strerror(errno) );
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static void free_flac_handle(flac_handle_t *handle)
+{
+  int i;
+
+  for (i=0; i<2; i++) {
+    if (handle->metadata[i])
+      FLAC__metadata_object_delete( handle->metadata[i] );
+  }
+
+  free( handle );
+}
+
+
+static int close_flac(encoder_funcs_t *enc, void *fh, struct timeval *file_start)
+{
+  flac_state_t *state = (flac_state_t*)enc->state;
+  flac_handle_t *handle = (flac_handle_t*)fh;
+  int result = 0;
+
+  if (handle==NULL) return -1;
+
+  rotter_debug("Closing FLAC output file.");
+
+  // Encode the last block, and fill in the STREAMINFO and seek table
+  if (!FLAC__stream_encoder_finish( state->encoder )) {
+    rotter_error( "Failed to finish FLAC file: %s",
+                  FLAC__stream_encoder_get_resolved_state_string( state->encoder ) );
+    result = -1;
+  }
+
+  if (close_flac_file( handle ))
+    result = -1;
+
+  free_flac_handle( handle );
+
+  return result;
+}
+
+
+// Add a NAME=value field to a Vorbis comment block
+static void add_comment(FLAC__StreamMetadata *comments, const char *name, const char *value)
+{
+  FLAC__StreamMetadata_VorbisComment_Entry entry;
+
+  if (!FLAC__metadata_object_vorbiscomment_entry_from_name_value_pair( &entry, name, value ) ||
+      !FLAC__metadata_object_vorbiscomment_append_comment( comments, entry, 0 ))
+  {
+    rotter_error( "Warning: failed to add %s to FLAC metadata.", name );
+  }
+}
+
+
+// Create the seek table and Vorbis comment for a new file
+static int create_flac_metadata(encoder_funcs_t *enc, flac_handle_t *handle, struct timeval *file_start)
+{
+  FLAC__uint64 total_samples = (FLAC__uint64)enc->period_seconds * enc->samplerate;
+  FLAC__StreamMetadata *seektable = NULL;
+  FLAC__StreamMetadata *comments = NULL;
+  char str[64];
+  struct tm tm;
+
+  handle->metadata[0] = seektable = FLAC__metadata_object_new( FLAC__METADATA_TYPE_SEEKTABLE );
+  handle->metadata[1] = comments = FLAC__metadata_object_new( FLAC__METADATA_TYPE_VORBIS_COMMENT );
+  if (seektable == NULL || comments == NULL) {
+    rotter_error( "Failed to allocate memory for FLAC metadata." );
+    return -1;
+  }
+
+  if (total_samples > 0) {
+    if (!FLAC__metadata_object_seektable_template_append_spaced_points_by_samples( seektable,
+          enc->samplerate * FLAC_SEEKPOINT_SECONDS, total_samples ) ||
+        !FLAC__metadata_object_seektable_template_sort( seektable, 1 ))
+    {
+      rotter_error( "Failed to create FLAC seek table." );
+      return -1;
+    }
+  }
+
+  localtime_r( &file_start->tv_sec, &tm );
+
+  snprintf( str, sizeof(str), "Recorded %4.4d-%2.2d-%2.2d %2.2d:%2.2d",
+            tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min );
+  add_comment( comments, "TITLE", str );
+
+  if (originator)
+    add_comment( comments, "ARTIST", originator );
+
+  snprintf( str, sizeof(str), "%4.4d-%2.2d-%2.2dT%2.2d:%2.2d:%2.2d",
+            tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec );
+  add_comment( comments, "DATE", str );
+
+  snprintf( str, sizeof(str), "Created by %s v%s", PACKAGE_NAME, PACKAGE_VERSION );
+  add_comment( comments, "COMMENT", str );
+
+  return 0;
+}
+
+
+// Apply our settings to the libFLAC encoder, before starting a file
+static int setup_flac(encoder_funcs_t *enc, flac_handle_t *handle)
+{
+  flac_state_t *state = (flac_state_t*)enc->state;
+  FLAC__StreamEncoder *encoder = state->encoder;
+
+  if (!FLAC__stream_encoder_set_channels( encoder, enc->channels ) ||
+      !FLAC__stream_encoder_set_bits_per_sample( encoder, state->bits_per_sample ) ||
+      !FLAC__stream_encoder_set_sample_rate( encoder, enc->samplerate ) ||
+      !FLAC__stream_encoder_set_compression_level( encoder, flac_compression ) ||
+      !FLAC__stream_encoder_set_total_samples_estimate( encoder, (FLAC__uint64)enc->period_seconds * enc->samplerate ) ||
+      !FLAC__stream_encoder_set_metadata( encoder, handle->metadata, 2 ))
+  {
+    rotter_error( "FLAC error: failed to configure encoder." );
+    return -1;
+  }
+
+#ifdef HAVE_FLAC__STREAM_ENCODER_SET_NUM_THREADS
+  if (flac_threads > 1 &&
+      FLAC__stream_encoder_set_num_threads( encoder, flac_threads ) != FLAC__STREAM_ENCODER_SET_NUM_THREADS_OK)
+  {
+    // Carry on with a single thread
+    rotter_debug( "FLAC error: failed to set number of encoding threads to %d.", flac_threads );
+  }
+#endif
+
+  return 0;
+}
+
+
+static void* open_flac(encoder_funcs_t *enc, const char* filepath, struct timeval *file_start)
+{
+  flac_state_t *state = (flac_state_t*)enc->state;
+  flac_handle_t *handle = NULL;
+  FLAC__StreamEncoderInitStatus status;
+
+  rotter_debug("Opening FLAC output file: %s", filepath);
+
+  handle = calloc( 1, sizeof(flac_handle_t) );
+  if (handle==NULL) {
+    rotter_error( "Failed to allocate memory for output file." );
+    return NULL;
+  }
+
+  // FLAC files can't be appended to, so an existing file is replaced
+  // (as it was when FLAC files were written by libsndfile)
+  handle->fd = open( filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+  if (handle->fd < 0) {
+    rotter_error( "Failed to open output file: %s", strerror(errno) );
+    free_flac_handle( handle );
+    return NULL;
+  }
+
+  if (async_output) {
+    handle->aio = rotter_aio_fdopen( handle->fd, filepath );
+    if (handle->aio == NULL) {
+      close( handle->fd );
+      free_flac_handle( handle );
+      return NULL;
+    }
+  }
+
+  if (create_flac_metadata( enc, handle, file_start ) || setup_flac( enc, handle )) {
+    close_flac_file( handle );
+    free_flac_handle( handle );
+    return NULL;
+  }
+
+  status = FLAC__stream_encoder_init_stream( state->encoder, flac_write_callback,
+             flac_seek_callback, flac_tell_callback, NULL, handle );
+  if (status != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+    rotter_error( "Failed to start FLAC encoder: %s", FLAC__StreamEncoderInitStatusString[status] );
+    close_flac_file( handle );
+    free_flac_handle( handle );
+    return NULL;
+  }
+
+  return (void*)handle;
+}
+
+
+static void deinit_flac(encoder_funcs_t *enc)
+{
+  flac_state_t *state = (flac_state_t*)enc->state;
+
+  rotter_debug("Shutting down FLAC encoder.");
+  if (state) {
+    if (state->encoder) {
+      FLAC__stream_encoder_delete( state->encoder );
+      state->encoder = NULL;
+    }
+
+    if (state->i32_buffer) {
+      free(state->i32_buffer);
+      state->i32_buffer = NULL;
+    }
+
+    if (state->i16_buffer) {
+      free(state->i16_buffer);
+      state->i16_buffer = NULL;
+    }
+
+    free(state);
+  }
+
+  free(enc);
+}
+
+
+encoder_funcs_t* init_flac( output_format_t* format, int channels, int bitrate )
+{
+  encoder_funcs_t* funcs = NULL;
+  flac_state_t* state = NULL;
+
+  // Allocate memory for callback functions
+  funcs = calloc( 1, sizeof(encoder_funcs_t) );
+  if ( funcs==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder callback functions structure." );
+    return NULL;
+  }
+
+  funcs->file_suffix = "flac";
+  funcs->channels = channels;
+  funcs->samplerate = jack_get_sample_rate( client );
+  funcs->open = open_flac;
+  funcs->close = close_flac;
+  funcs->write = write_flac;
+  funcs->sync = sync_flac;
+  funcs->flush = flush_flac;
+  funcs->deinit = deinit_flac;
+
+  // Allocate memory for encoder state
+  funcs->state = state = calloc( 1, sizeof(flac_state_t) );
+  if ( state==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder state." );
+    deinit_flac(funcs);
+    return NULL;
+  }
+
+  state->bits_per_sample = format->param;
+  rotter_dither_init( &state->dither );
+
+  state->encoder = FLAC__stream_encoder_new();
+  if (state->encoder == NULL) {
+    rotter_error( "FLAC error: failed to initialise." );
+    deinit_flac(funcs);
+    return NULL;
+  }
+
+  rotter_debug( "Encoding using libFLAC version %s.", FLAC__VERSION_STRING );
+  rotter_debug( "  Input: %d Hz, %d channels", funcs->samplerate, channels );
+  rotter_debug( "  Output: FLAC %d bit, compression level %d", state->bits_per_sample, flac_compression );
+
+#ifdef HAVE_FLAC__STREAM_ENCODER_SET_NUM_THREADS
+  if (flac_threads > 1)
+    rotter_debug( "  Encoding with %d threads", flac_threads );
+#else
+  if (flac_threads > 1)
+    rotter_debug( "  This version of libFLAC can only encode with a single thread" );
+#endif
+
+  return funcs;
+}
+
+#endif   // HAVE_FLAC
@@ -0,0 +1,310 @@
+/*
+
+  framering.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "rotter.h"
+#include "config.h"
+
+
+/*
+  Single-producer / single-consumer ring of interleaved audio frames.
+
+  The read and write positions are free-running frame counters, so the
+  fill level is simply (write - read) and no slot needs to be kept empty.
+  The capacity is rounded up to a power of two, so that a position can
+  be turned into an index with a mask.
+
+  The JACK callback is the only writer and the archive writer is the only
+  reader. Each side publishes its position with a single release store,
+  however many channels are being recorded.
+*/
+
+
+static size_t next_power_of_two( size_t n )
+{
+  size_t p = 1;
+  while (p < n) p <<= 1;
+  return p;
+}
+
+
+rotter_framering_t* rotter_framering_create( unsigned int channels, size_t frames )
+{
+  rotter_framering_t *ring = NULL;
+  size_t buffer_size;
+
+  if (posix_memalign( (void**)&ring, ROTTER_CACHE_LINE, sizeof(rotter_framering_t) )) {
+    return NULL;
+  }
+
+  memset( ring, 0, sizeof(rotter_framering_t) );
+  ring->channels = channels;
+  ring->size = next_power_of_two( frames );
+  ring->mask = ring->size - 1;
+
+  buffer_size = ring->size * channels * sizeof(jack_default_audio_sample_t);
+  if (posix_memalign( (void**)&ring->buf, ROTTER_CACHE_LINE, buffer_size )) {
+    free( ring );
+    return NULL;
+  }
+
+  // Touch every page now, rather than in the realtime callback
+  memset( ring->buf, 0, buffer_size );
+
+  return ring;
+}
+
+
+/*
+  Create a ring whose buffer is a shared mapping of the file 'fd',
+  so that it is backed by disk rather than by memory.
+  The space for the whole ring is allocated in the file up front.
+*/
+rotter_framering_t* rotter_framering_map( int fd, unsigned int channels, size_t frames )
+{
+  rotter_framering_t *ring = NULL;
+  size_t buffer_size;
+  void *buf;
+
+  if (posix_memalign( (void**)&ring, ROTTER_CACHE_LINE, sizeof(rotter_framering_t) )) {
+    return NULL;
+  }
+
+  memset( ring, 0, sizeof(rotter_framering_t) );
+  ring->channels = channels;
+  ring->size = next_power_of_two( frames );
+  ring->mask = ring->size - 1;
+
+  buffer_size = ring->size * channels * sizeof(jack_default_audio_sample_t);
+  if (posix_fallocate( fd, 0, buffer_size )) {
+    free( ring );
+    return NULL;
+  }
+
+  buf = mmap( NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if (buf == MAP_FAILED) {
+    free( ring );
+    return NULL;
+  }
+
+  ring->buf = buf;
+  ring->mapped = 1;
+
+  return ring;
+}
+
+
+void rotter_framering_free( rotter_framering_t *ring )
+{
+  if (ring==NULL) return;
+
+  if (ring->mlocked) {
+    munlock( ring->buf, ring->size * ring->channels * sizeof(jack_default_audio_sample_t) );
+    munlock( ring, sizeof(rotter_framering_t) );
+  }
+
+  if (ring->mapped) {
+    munmap( ring->buf, ring->size * ring->channels * sizeof(jack_default_audio_sample_t) );
+  } else {
+    free( ring->buf );
+  }
+  free( ring );
+}
+
+
+// Lock the ring into physical memory, to avoid page faults in the realtime thread
+int rotter_framering_mlock( rotter_framering_t *ring )
+{
+  if (mlock( ring, sizeof(rotter_framering_t) ))
+    return -1;
+
+  if (mlock( ring->buf, ring->size * ring->channels * sizeof(jack_default_audio_sample_t) )) {
+    munlock( ring, sizeof(rotter_framering_t) );
+    return -1;
+  }
+
+  ring->mlocked = 1;
+  return 0;
+}
+
+
+// Number of frames that can be written (called by the producer)
+size_t rotter_framering_write_space( rotter_framering_t *ring )
+{
+  size_t read_pos = __atomic_load_n( &ring->read_pos, __ATOMIC_ACQUIRE );
+  return ring->size - (ring->write_pos - read_pos);
+}
+
+
+// Number of frames that can be read (called by the consumer)
+size_t rotter_framering_read_space( rotter_framering_t *ring )
+{
+  size_t write_pos = __atomic_load_n( &ring->write_pos, __ATOMIC_ACQUIRE );
+  return write_pos - ring->read_pos;
+}
+
+
+/*
+  Interleave 'nframes' frames, starting at 'offset' in each of the
+  per-channel source buffers, into the ring and publish them.
+  The caller must have checked that there is enough write space.
+*/
+void rotter_framering_write( rotter_framering_t *ring,
+                             jack_default_audio_sample_t **src,
+                             size_t offset, size_t nframes )
+{
+  const unsigned int channels = ring->channels;
+  size_t pos = ring->write_pos;
+  size_t done = 0;
+
+  while (done < nframes) {
+    size_t index = pos & ring->mask;
+    size_t chunk = ring->size - index;
+    jack_default_audio_sample_t *dest = &ring->buf[index * channels];
+
+    if (chunk > nframes - done)
+      chunk = nframes - done;
+
+    rotter_interleave( dest, src, offset + done, chunk, channels );
+
+    pos += chunk;
+    done += chunk;
+  }
+
+  // Publish all of the frames at once
+  __atomic_store_n( &ring->write_pos, pos, __ATOMIC_RELEASE );
+}
+
+
+/*
+  Get pointers to up to 'nframes' frames that are ready to be read,
+  without copying them. The frames may be split in two, where the
+  ring wraps around. Returns the total number of frames.
+  The space is not released until rotter_framering_read_advance().
+*/
+size_t rotter_framering_get_read_vector( rotter_framering_t *ring,
+                                         rotter_framering_vector_t vec[2],
+                                         size_t nframes )
+{
+  size_t available = rotter_framering_read_space( ring );
+  size_t index = ring->read_pos & ring->mask;
+  size_t first;
+
+  if (nframes > available)
+    nframes = available;
+
+  first = ring->size - index;
+  if (first > nframes)
+    first = nframes;
+
+  vec[0].buf = &ring->buf[index * ring->channels];
+  vec[0].frames = first;
+  vec[1].buf = ring->buf;
+  vec[1].frames = nframes - first;
+
+  return nframes;
+}
+
+
+// Hand 'nframes' frames of space back to the producer, once they have been used
+void rotter_framering_read_advance( rotter_framering_t *ring, size_t nframes )
+{
+  __atomic_store_n( &ring->read_pos, ring->read_pos + nframes, __ATOMIC_RELEASE );
+}
+
+
+/*
+  Copy up to 'nframes' interleaved frames from the ring into 'dest',
+  and release the space.
+  Returns the number of frames read.
+*/
+size_t rotter_framering_read( rotter_framering_t *ring,
+                              jack_default_audio_sample_t *dest,
+                              size_t nframes )
+{
+  const size_t frame_size = ring->channels * sizeof(jack_default_audio_sample_t);
+  rotter_framering_vector_t vec[2];
+
+  nframes = rotter_framering_get_read_vector( ring, vec, nframes );
+  memcpy( dest, vec[0].buf, vec[0].frames * frame_size );
+  memcpy( dest + vec[0].frames * ring->channels, vec[1].buf, vec[1].frames * frame_size );
+  rotter_framering_read_advance( ring, nframes );
+
+  return nframes;
+}
+
+
+/*
+  Move up to 'nframes' interleaved frames from the ring 'src' to the
+  ring 'dest', which must have the same number of channels.
+  The caller must be the consumer of 'src' and the producer of 'dest'.
+  Returns the number of frames moved.
+*/
+size_t rotter_framering_transfer( rotter_framering_t *src,
+                                  rotter_framering_t *dest,
+                                  size_t nframes )
+{
+  const size_t frame_size = src->channels * sizeof(jack_default_audio_sample_t);
+  size_t available = rotter_framering_read_space( src );
+  size_t space = rotter_framering_write_space( dest );
+  size_t read_pos = src->read_pos;
+  size_t write_pos = dest->write_pos;
+  size_t done = 0;
+
+  if (nframes > available)
+    nframes = available;
+  if (nframes > space)
+    nframes = space;
+
+  while (done < nframes) {
+    size_t src_index = read_pos & src->mask;
+    size_t dest_index = write_pos & dest->mask;
+    size_t chunk = nframes - done;
+
+    if (chunk > src->size - src_index)
+      chunk = src->size - src_index;
+    if (chunk > dest->size - dest_index)
+      chunk = dest->size - dest_index;
+
+    memcpy( &dest->buf[dest_index * dest->channels],
+            &src->buf[src_index * src->channels],
+            chunk * frame_size );
+
+    read_pos += chunk;
+    write_pos += chunk;
+    done += chunk;
+  }
+
+  // Publish the frames in 'dest' before freeing their space in 'src'
+  __atomic_store_n( &dest->write_pos, write_pos, __ATOMIC_RELEASE );
+  __atomic_store_n( &src->read_pos, read_pos, __ATOMIC_RELEASE );
+
+  return done;
+}
@@ -0,0 +1,270 @@
+/*
+
+  iostage.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "rotter.h"
+#include "config.h"
+
+
+/*
+  The I/O stage finishes off each archive file once its period has
+  been drained: closing the file, resetting its encoder for the next
+  file and deleting old archives. It runs on its own thread, so that
+  a slow close at the end of one period doesn't hold up encoding the
+  audio for the next one.
+
+  The writers queue up period slots, which are given back to the JACK
+  callback once their file has been closed.
+
+  With a look-ahead (-P), the I/O stage also opens the file for the
+  next period a few seconds before it starts, so that creating the
+  directories and the file doesn't delay the first audio of the period.
+  It is opened with a '.part' suffix, and renamed once audio arrives
+  for its period; if another slot ended up recording that period, the
+  unused file is removed without touching the real one.
+*/
+
+
+static pthread_t io_thread;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static rotter_ringbuffer_t *io_queue_head = NULL;
+static rotter_ringbuffer_t *io_queue_tail = NULL;
+static int io_stopping = 0;
+static int io_thread_running = 0;
+
+
+// Queue up a drained period slot, to have its file closed
+void rotter_io_close_file( rotter_ringbuffer_t *ringbuffer )
+{
+  pthread_mutex_lock( &io_lock );
+  ringbuffer->io_next = NULL;
+  if (io_queue_tail) {
+    io_queue_tail->io_next = ringbuffer;
+  } else {
+    io_queue_head = ringbuffer;
+  }
+  io_queue_tail = ringbuffer;
+  pthread_cond_signal( &io_cond );
+  pthread_mutex_unlock( &io_lock );
+}
+
+
+// Close the files for a period slot and give it back to the JACK callback
+static void rotter_io_finish_period( rotter_ringbuffer_t *ringbuffer )
+{
+  rotter_stream_t *stream = ringbuffer->stream;
+  int closed = 0;
+  int f;
+
+  for (f=0; f<ringbuffer->file_count; f++) {
+    if (ringbuffer->files[f].handle)
+      closed = 1;
+  }
+
+  if (closed) {
+    rotter_close_file( stream, ringbuffer );
+
+    // Get the encoders ready for the next file now, rather than at the
+    // start of the next period
+    for (f=0; f<ringbuffer->file_count; f++) {
+      encoder_funcs_t *encoder = ringbuffer->files[f].encoder;
+      if (encoder->reset && encoder->reset( encoder )) {
+        rotter_fatal( "%sFailed to reset encoder for ringbuffer %c.", stream->log_prefix, ringbuffer->label );
+      }
+    }
+
+    // Delete files older than delete_hours, or if the disk is getting full
+    deletefiles( stream );
+  }
+
+  __atomic_store_n( &ringbuffer->state, ROTTER_SLOT_FREE, __ATOMIC_RELEASE );
+}
+
+
+// Try to take a period slot for the I/O stage, if it is in state 'from'
+static int rotter_io_claim_slot( rotter_ringbuffer_t *ringbuffer, int from )
+{
+  return __atomic_compare_exchange_n( &ringbuffer->state, &from, ROTTER_SLOT_PREPARING, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+}
+
+
+// Open the file for the next period of a stream, if it is about to start
+static void rotter_io_prepare_period( rotter_stream_t *stream, time_t now )
+{
+  rotter_ringbuffer_t *active = __atomic_load_n( &stream->active_ringbuffer, __ATOMIC_ACQUIRE );
+  rotter_ringbuffer_t *free_slot = NULL;
+  time_t next_period;
+  int b;
+
+  // Wait until the first period has started
+  if (active == NULL)
+    return;
+
+  next_period = active->period_start + stream->archive_period_seconds;
+
+  for (b=0; b<stream->ringbuffer_count; b++) {
+    rotter_ringbuffer_t *ringbuffer = stream->ringbuffers[b];
+    int state = __atomic_load_n( &ringbuffer->state, __ATOMIC_ACQUIRE );
+
+    if (state == ROTTER_SLOT_READY) {
+      if (ringbuffer->prepared_period == next_period)
+        return;
+
+      // The period it was opened for has already gone by
+      if (ringbuffer->prepared_period <= active->period_start &&
+          rotter_io_claim_slot( ringbuffer, ROTTER_SLOT_READY ))
+      {
+        rotter_discard_file( stream, ringbuffer );
+        __atomic_store_n( &ringbuffer->state, ROTTER_SLOT_FREE, __ATOMIC_RELEASE );
+        state = ROTTER_SLOT_FREE;
+      }
+    }
+
+    if (state == ROTTER_SLOT_FREE && free_slot == NULL)
+      free_slot = ringbuffer;
+  }
+
+  if (now < next_period - lookahead_secs || free_slot == NULL)
+    return;
+
+  // The JACK callback may have just taken the slot
+  if (!rotter_io_claim_slot( free_slot, ROTTER_SLOT_FREE ))
+    return;
+
+  free_slot->file_start.tv_sec = next_period;
+  free_slot->file_start.tv_usec = 0;
+  free_slot->prepared_period = next_period;
+  free_slot->prepared = 1;
+
+  if (rotter_open_file( stream, free_slot )) {
+    rotter_error( "%sFailed to open files for the next period ahead of time.", stream->log_prefix );
+    rotter_discard_file( stream, free_slot );
+    __atomic_store_n( &free_slot->state, ROTTER_SLOT_FREE, __ATOMIC_RELEASE );
+    return;
+  }
+
+  __atomic_store_n( &free_slot->state, ROTTER_SLOT_READY, __ATOMIC_RELEASE );
+}
+
+
+static void* rotter_io_thread_func( void *arg )
+{
+  time_t next_stats_report = time(NULL) + SYNC_STATS_PERIOD;
+
+  while (1) {
+    rotter_ringbuffer_t *ringbuffer = NULL;
+    int s;
+
+    pthread_mutex_lock( &io_lock );
+    if (io_queue_head == NULL && !io_stopping) {
+      // Wake up at least once a second to join the deletion threads
+      struct timespec timeout;
+      clock_gettime( CLOCK_REALTIME, &timeout );
+      timeout.tv_sec += MAX_WRITER_SLEEP;
+      pthread_cond_timedwait( &io_cond, &io_lock, &timeout );
+    }
+
+    ringbuffer = io_queue_head;
+    if (ringbuffer) {
+      io_queue_head = ringbuffer->io_next;
+      if (io_queue_head == NULL)
+        io_queue_tail = NULL;
+    } else if (io_stopping) {
+      // Nothing left to close
+      pthread_mutex_unlock( &io_lock );
+      rotter_sync_stats_report();
+      break;
+    }
+    pthread_mutex_unlock( &io_lock );
+
+    if (ringbuffer)
+      rotter_io_finish_period( ringbuffer );
+
+    for (s=0; s<stream_count; s++) {
+      rotter_stream_t *stream = streams[s];
+
+      // Did the JACK callback have to stay in an old period?
+      if (stream->slot_starved) {
+        rotter_error( "%sNo free period slot at the start of a new period; consider increasing -K.", stream->log_prefix );
+        stream->slot_starved = 0;
+      }
+
+      deletefiles_cleanup_thread( stream );
+
+      if (lookahead_secs > 0 && !io_stopping)
+        rotter_io_prepare_period( stream, time(NULL) );
+    }
+
+    // How long have the writers been spending on syncing to disk?
+    if (time(NULL) >= next_stats_report) {
+      rotter_sync_stats_report();
+      next_stats_report = time(NULL) + SYNC_STATS_PERIOD;
+    }
+  }
+
+  return NULL;
+}
+
+
+// Start the I/O stage thread
+int rotter_io_start()
+{
+  io_stopping = 0;
+  if (pthread_create( &io_thread, NULL, rotter_io_thread_func, NULL )) {
+    rotter_fatal( "Failed to start I/O thread." );
+    return -1;
+  }
+
+  io_thread_running = 1;
+  return 0;
+}
+
+
+// Close any files that are still queued, then stop the I/O stage thread
+// and wait for any deletions that it started
+void rotter_io_stop()
+{
+  int s;
+
+  if (!io_thread_running)
+    return;
+
+  pthread_mutex_lock( &io_lock );
+  io_stopping = 1;
+  pthread_cond_signal( &io_cond );
+  pthread_mutex_unlock( &io_lock );
+
+  pthread_join( io_thread, NULL );
+  io_thread_running = 0;
+
+  for (s=0; s<stream_count; s++)
+    deletefiles_stop( streams[s] );
+}
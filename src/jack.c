@@ -41,48 +41,40 @@
 
 
 // ------- Globals -------
-jack_port_t *inport[2] = {NULL, NULL};
 jack_client_t *client = NULL;
-rotter_ringbuffer_t *active_ringbuffer = NULL;
+jack_nframes_t sample_rate = 0;
+int64_t jack_clock_offset = 0;    // Microseconds between JACK time and the Unix epoch
 
 // Given unix timestamp for current time
-// Returns unix timestamp for the start of this archive period
-// relies on global archive_period_seconds variable
-static time_t start_of_period(time_t now)
+// Returns unix timestamp for the start of this stream's archive period
+static time_t start_of_period(rotter_stream_t *stream, time_t now)
 {
-  return (floor(now / archive_period_seconds) * archive_period_seconds);
+  return now - (now % stream->archive_period_seconds);
 }
 
 
-static int write_to_ringbuffer(rotter_ringbuffer_t *rb, jack_nframes_t start,
-                               jack_nframes_t nframes)
+static int write_to_ringbuffer(rotter_stream_t *stream, rotter_ringbuffer_t *rb,
+                               jack_nframes_t start, jack_nframes_t nframes)
 {
-  size_t to_write = sizeof(jack_default_audio_sample_t) * nframes;
-  unsigned int c;
+  size_t space, buffered;
 
-  if (nframes <= 0)
+  if (nframes <= 0 || rb == NULL)
     return 0;
 
-  for (c=0; c < channels; c++)
-  {
-    size_t space = jack_ringbuffer_write_space(rb->buffer[c]);
-    if (space < to_write) {
-      // Glitch in audio is preferable to a fatal error or ring buffer corruption
-      rb->overflow = 1;
-      return 0;
-    }
+  // A single space check covers all of the channels
+  space = rotter_framering_write_space(rb->ring);
+  if (space < nframes) {
+    // Glitch in audio is preferable to a fatal error or ring buffer corruption
+    rb->overflow = 1;
+    return 0;
   }
 
-  for (c=0; c < channels; c++)
-  {
-    jack_default_audio_sample_t *buf = jack_port_get_buffer(inport[c], nframes);
-    size_t len = 0;
+  rotter_framering_write(rb->ring, stream->port_buffers, start, nframes);
 
-    len = jack_ringbuffer_write(rb->buffer[c], (char*)&buf[start], to_write);
-    if (len < to_write) {
-      rotter_fatal("Failed to write to ring buffer.");
-      return 1;
-    }
+  // Wake up the writer, once there is a whole batch of encoder frames to write
+  buffered = rb->ring->size - space;
+  if (buffered < stream->batch_frames && buffered + nframes >= stream->batch_frames) {
+    rotter_wakeup_writer(rb);
   }
 
   // Success
@@ -90,43 +82,101 @@ static int write_to_ringbuffer(rotter_ringbuffer_t *rb, jack_nframes_t start,
 }
 
 
-/* Callback called by JACK when audio is available
-   Use as little CPU time as possible, just copy accross the audio
-   into the ring buffer
+// Try to take a period slot for the JACK callback, if it is in state 'from'
+static int claim_slot(rotter_ringbuffer_t *rb, int from)
+{
+  return __atomic_compare_exchange_n(&rb->state, &from, ROTTER_SLOT_FILLING, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+/*
+  Move to a free period slot, for a period starting at time 'tv'.
+  A slot whose file has already been opened for this period by the
+  I/O stage is used if there is one.
+  The slot that was being filled is handed to the writer to drain and close.
+  Returns -1 (and keeps filling the current slot) if no slot is free.
 */
-static
-int callback_jack(jack_nframes_t nframes, void *arg)
+static int start_new_period(rotter_stream_t *stream, struct timeval *tv)
+{
+  rotter_ringbuffer_t *next = NULL;
+  time_t this_period = start_of_period(stream, tv->tv_sec);
+  int next_index = -1;
+  int i;
+
+  // Look for a slot that is ready for this period
+  for (i=0; i < stream->ringbuffer_count; i++) {
+    rotter_ringbuffer_t *rb = stream->ringbuffers[i];
+    if (__atomic_load_n(&rb->state, __ATOMIC_ACQUIRE) == ROTTER_SLOT_READY &&
+        rb->prepared_period == this_period && claim_slot(rb, ROTTER_SLOT_READY)) {
+      next = rb;
+      next_index = i;
+      break;
+    }
+  }
+
+  // Otherwise look for a free slot, starting after the one being filled
+  for (i=1; next == NULL && i <= stream->ringbuffer_count; i++) {
+    int index = (stream->active_index + i) % stream->ringbuffer_count;
+    if (claim_slot(stream->ringbuffers[index], ROTTER_SLOT_FREE)) {
+      next = stream->ringbuffers[index];
+      next_index = index;
+    }
+  }
+
+  if (next == NULL) {
+    // The writer is still closing every other period
+    stream->slot_starved = 1;
+    return -1;
+  }
+
+  if (stream->active_ringbuffer) {
+    __atomic_store_n(&stream->active_ringbuffer->state, ROTTER_SLOT_DRAINING, __ATOMIC_RELEASE);
+
+    // The writer needs to finish off the file for the old period
+    rotter_wakeup_writer(stream->active_ringbuffer);
+  }
+
+  next->file_start = *tv;
+  next->period_start = this_period;
+  __atomic_store_n(&next->state, ROTTER_SLOT_FILLING, __ATOMIC_RELEASE);
+  __atomic_store_n(&stream->active_ringbuffer, next, __ATOMIC_RELEASE);
+  stream->active_index = next_index;
+
+  return 0;
+}
+
+
+/*
+  Period boundaries using the system clock:
+  the callback buffer is split on whole second boundaries,
+  given the time returned by gettimeofday() for this cycle.
+*/
+static int process_system_clock(rotter_stream_t *stream, struct timeval tv,
+                                jack_nframes_t nframes)
 {
   jack_nframes_t frames_until_whole_second = 0;
   jack_nframes_t read_pos = 0;
   time_t this_period;
-  struct timeval tv;
-
-  // Get the current time
-  if (gettimeofday(&tv, NULL)) {
-    rotter_fatal("Failed to gettimeofday(): %s", strerror(errno));
-    return 1;
-  }
 
   // FIXME: this won't work if rotter is started *just* before the archive period
-  if (active_ringbuffer) {
+  if (stream->active_ringbuffer) {
     unsigned int duration;
     int result;
 
     // Calculate the number of frames until we have a whole number of seconds
     // FIXME: what if the callback buffer contains over 1 second of audio?
-    frames_until_whole_second = ceil(jack_get_sample_rate( client ) *
+    frames_until_whole_second = ceil(sample_rate *
                                 ((double)(1000000 - tv.tv_usec) / 1000000));
 
     if (frames_until_whole_second < nframes) {
-      result = write_to_ringbuffer(active_ringbuffer, read_pos, frames_until_whole_second);
+      result = write_to_ringbuffer(stream, stream->active_ringbuffer, read_pos, frames_until_whole_second);
       if (result)
         return result;
 
       // Calculate the duration of the audio that we wrote
       // and add it on to the current time
-      duration = ((double)frames_until_whole_second /
-                 jack_get_sample_rate( client )) * 1000000;
+      duration = ((double)frames_until_whole_second / sample_rate) * 1000000;
       tv.tv_usec += (duration - 1000000);
       tv.tv_sec += 1;
 
@@ -137,22 +187,117 @@ int callback_jack(jack_nframes_t nframes, void *arg)
 
 
   // Time to swap ring buffers, if we are now in a new archive period
-  this_period = start_of_period(tv.tv_sec);
-  if (active_ringbuffer == NULL || active_ringbuffer->period_start != this_period) {
-    if (active_ringbuffer) {
-      active_ringbuffer->close_file = 1;
+  this_period = start_of_period(stream, tv.tv_sec);
+  if (stream->active_ringbuffer == NULL || stream->active_ringbuffer->period_start != this_period) {
+    start_new_period(stream, &tv);
+  }
+
+  // Finally, write any frames after the 1 second boundary
+  return write_to_ringbuffer(stream, stream->active_ringbuffer, read_pos, nframes);
+}
+
+
+/*
+  Period boundaries using the JACK frame clock:
+  'cycle_start' is the time (in microseconds since the epoch)
+  of the first frame in this cycle, and the period boundary is
+  placed on an exact frame.
+*/
+static int process_jack_clock(rotter_stream_t *stream, int64_t cycle_start,
+                              jack_nframes_t nframes)
+{
+  jack_nframes_t read_pos = 0;
+  int result;
+
+  while (read_pos < nframes) {
+    int64_t frame_usecs = cycle_start + ((int64_t)read_pos * 1000000) / sample_rate;
+    int64_t period_end = 0, boundary_frame;
+
+    // Start a new period at the current frame?
+    if (stream->active_ringbuffer) {
+      period_end = (int64_t)(stream->active_ringbuffer->period_start + stream->archive_period_seconds) * 1000000;
+    }
+    if (stream->active_ringbuffer == NULL || frame_usecs >= period_end) {
+      struct timeval tv;
+      tv.tv_sec = frame_usecs / 1000000;
+      tv.tv_usec = frame_usecs % 1000000;
+      if (start_new_period(stream, &tv)) {
+        // No free slot: the rest of this cycle stays in the current period
+        break;
+      }
+      period_end = (int64_t)(stream->active_ringbuffer->period_start + stream->archive_period_seconds) * 1000000;
+    }
+
+    // Find the first frame at or after the end of the active period
+    boundary_frame = ((period_end - cycle_start) * sample_rate + 999999) / 1000000;
+    if (boundary_frame >= nframes) {
+      break;
     }
-    if (active_ringbuffer == ringbuffers[0]) {
-      active_ringbuffer = ringbuffers[1];
+
+    result = write_to_ringbuffer(stream, stream->active_ringbuffer, read_pos, boundary_frame - read_pos);
+    if (result)
+      return result;
+    read_pos = boundary_frame;
+  }
+
+  // Write any frames after the last boundary
+  return write_to_ringbuffer(stream, stream->active_ringbuffer, read_pos, nframes - read_pos);
+}
+
+
+/* Callback called by JACK when audio is available
+   Use as little CPU time as possible, just copy accross the audio
+   into the ring buffers
+*/
+static
+int callback_jack(jack_nframes_t nframes, void *arg)
+{
+  struct timeval tv;
+  int64_t cycle_start = 0;
+  int result = 0;
+  int s;
+
+  if (use_jack_clock) {
+    // Get the time that the first frame in this cycle was captured
+    jack_nframes_t frame_time;
+    jack_time_t cycle_usecs;
+#ifdef HAVE_JACK_GET_CYCLE_TIMES
+    jack_time_t next_usecs;
+    float period_usecs;
+    if (jack_get_cycle_times(client, &frame_time, &cycle_usecs, &next_usecs, &period_usecs)) {
+      rotter_fatal("Failed to get JACK cycle times.");
+      return 1;
+    }
+#else
+    frame_time = jack_last_frame_time(client);
+    cycle_usecs = jack_frames_to_time(client, frame_time);
+#endif
+    cycle_start = (int64_t)cycle_usecs + jack_clock_offset;
+  } else {
+    // Get the current time
+    if (gettimeofday(&tv, NULL)) {
+      rotter_fatal("Failed to gettimeofday(): %s", strerror(errno));
+      return 1;
+    }
+  }
+
+  for (s=0; s < stream_count && result == 0; s++) {
+    rotter_stream_t *stream = streams[s];
+    unsigned int c;
+
+    // Get the audio buffer for each of the ports
+    for (c=0; c < stream->channels; c++) {
+      stream->port_buffers[c] = jack_port_get_buffer(stream->inport[c], nframes);
+    }
+
+    if (use_jack_clock) {
+      result = process_jack_clock(stream, cycle_start, nframes);
     } else {
-      active_ringbuffer = ringbuffers[0];
+      result = process_system_clock(stream, tv, nframes);
     }
-    active_ringbuffer->file_start = tv;
-    active_ringbuffer->period_start = this_period;
   }
 
-  // Finally, write any frames after the 1 second boundary
-  return write_to_ringbuffer(active_ringbuffer, read_pos, nframes);
+  return result;
 }
 
 
@@ -161,9 +306,13 @@ static
 int xrun_callback_jack(void *arg)
 {
   jack_client_t *client = (jack_client_t*)arg;
+  int xrun_usecs = jack_get_xrun_delayed_usecs(client);
+  int s;
 
-  if (active_ringbuffer) {
-    active_ringbuffer->xrun_usecs += jack_get_xrun_delayed_usecs(client);
+  for (s=0; s < stream_count; s++) {
+    if (streams[s]->active_ringbuffer) {
+      streams[s]->active_ringbuffer->xrun_usecs += xrun_usecs;
+    }
   }
 
   return 0;
@@ -199,7 +348,7 @@ int connect_jack_port( const char* out, jack_port_t *port )
 
 
 // Crude way of automatically connecting up jack ports
-int autoconnect_jack_ports( jack_client_t* client )
+int autoconnect_jack_ports( jack_client_t* client, rotter_stream_t *stream )
 {
   const char **all_ports;
   unsigned int ch=0;
@@ -215,12 +364,12 @@ int autoconnect_jack_ports( jack_client_t* client )
   // Step through each port name
   for (i = 0; all_ports[i]; ++i) {
     // Connect the port
-    if (connect_jack_port( all_ports[i], inport[ch] )) {
+    if (connect_jack_port( all_ports[i], stream->inport[ch] )) {
       return -1;
     }
 
     // Found enough ports ?
-    if (++ch >= channels) break;
+    if (++ch >= stream->channels) break;
   }
 
   free( all_ports );
@@ -240,24 +389,19 @@ int init_jack( const char* client_name, jack_options_t jack_opt )
     return -1;
   }
   rotter_info( "JACK client registered as '%s'.", jack_get_client_name( client ) );
+  sample_rate = jack_get_sample_rate( client );
 
+  // Tie the system clock to the JACK clock
+  if (use_jack_clock) {
+    struct timeval tv;
+    jack_time_t jack_now = jack_get_time();
 
-  // Create our input port(s)
-  if (channels==1) {
-    if (!(inport[0] = jack_port_register(client, "mono", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0))) {
-      rotter_fatal("Cannot register mono input port.");
-      return -1;
-    }
-  } else {
-    if (!(inport[0] = jack_port_register(client, "left", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0))) {
-      rotter_fatal("Cannot register left input port.");
-      return -1;
-    }
-
-    if (!(inport[1] = jack_port_register(client, "right", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0))) {
-      rotter_fatal( "Cannot register left input port.");
+    if (gettimeofday(&tv, NULL)) {
+      rotter_fatal("Failed to gettimeofday(): %s", strerror(errno));
       return -1;
     }
+    jack_clock_offset = ((int64_t)tv.tv_sec * 1000000 + tv.tv_usec) - (int64_t)jack_now;
+    rotter_debug("Using the JACK frame clock for archive period boundaries.");
   }
 
   // Register xrun callback
@@ -277,6 +421,80 @@ int init_jack( const char* client_name, jack_options_t jack_opt )
 }
 
 
+// Register a stream's input ports
+/*
+  Longest station name that leaves room in a full JACK port name
+  ('<client>:<station>_<suffix>') for the longest client name and suffix
+*/
+size_t max_station_name_len()
+{
+  return jack_port_name_size() - jack_client_name_size() - 2 - MAX_PORT_SUFFIX_LEN;
+}
+
+
+int register_jack_ports( rotter_stream_t *stream )
+{
+  const char* names_mono[] = { "mono" };
+  const char* names_stereo[] = { "left", "right" };
+  // Room for the port's own name, after '<client>:'
+  int max_len = jack_port_name_size() - strlen( jack_get_client_name( client ) ) - 1;
+  char *port_name;
+  unsigned int c;
+
+  // Allocate memory for the port pointers
+  stream->inport = calloc( stream->channels, sizeof(jack_port_t*) );
+  stream->port_buffers = calloc( stream->channels, sizeof(jack_default_audio_sample_t*) );
+  if (!stream->inport || !stream->port_buffers) {
+    rotter_fatal("Failed to allocate memory for input ports.");
+    return -1;
+  }
+
+  port_name = malloc( max_len );
+  if (!port_name) {
+    rotter_fatal("Failed to allocate memory for input port names.");
+    return -1;
+  }
+
+  // Create our input port(s)
+  for (c=0; c < stream->channels; c++) {
+    char suffix[16];
+    int len;
+
+    if (stream->channels==1) {
+      snprintf( suffix, sizeof(suffix), "%s", names_mono[c] );
+    } else if (stream->channels==2) {
+      snprintf( suffix, sizeof(suffix), "%s", names_stereo[c] );
+    } else {
+      snprintf( suffix, sizeof(suffix), "in_%d", c+1 );
+    }
+
+    // Prefix the port names with the station name, if there is one
+    if (stream->name) {
+      len = snprintf( port_name, max_len, "%s_%s", stream->name, suffix );
+    } else {
+      len = snprintf( port_name, max_len, "%s", suffix );
+    }
+
+    if (len >= max_len) {
+      rotter_fatal("%sInput port name is too long for JACK.", stream->log_prefix);
+      free( port_name );
+      return -1;
+    }
+
+    if (!(stream->inport[c] = jack_port_register(client, port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0))) {
+      rotter_fatal("Cannot register input port '%s'.", port_name);
+      free( port_name );
+      return -1;
+    }
+  }
+
+  free( port_name );
+
+  // Success
+  return 0;
+}
+
+
 // Shut down jack related stuff
 int deinit_jack()
 {
@@ -41,64 +41,84 @@
 #include <lame/lame.h>
 
 
-// ------ Globals ---------
-static lame_global_flags *lame_opts = NULL;
-static short int *i16_buffer[2]={NULL,NULL};
-static unsigned char *mpeg_buffer=NULL;
+// ------ Structures ---------
+typedef struct lame_state_s
+{
+  lame_global_flags *lame_opts;
+  short int *i16_buffer;
+  size_t i16_buffer_size;
+  rotter_dither_t dither;
+  unsigned char *mpeg_buffer;
+  size_t mpeg_buffer_size;
+  int bitrate;
+} lame_state_t;
 
 
 #define SAMPLES_PER_FRAME     (1152)
 
 
-static void float32_to_short(
-  const jack_default_audio_sample_t in[],
-  short out[],
-  int num_samples)
-{
-  int n;
-
-  for(n=0; n<num_samples; n++) {
-    int tmp = lrintf(in[n] * 32768.0f);
-    if (tmp > SHRT_MAX) {
-      out[n] = SHRT_MAX;
-    } else if (tmp < SHRT_MIN) {
-      out[n] = SHRT_MIN;
-    } else {
-      out[n] = (short) tmp;
-    }
-  }
-}
-
-
 /*
   Encode and write some audio from the ring buffer to disk
 */
-static int write_lame(void *fh, size_t sample_count, jack_default_audio_sample_t *buffer[])
+static int write_lame(encoder_funcs_t *enc, void *fh, size_t frame_count, const jack_default_audio_sample_t *buffer)
 {
-  FILE* file = (FILE*)fh;
-  size_t i16_desired = sample_count * sizeof( short int );
-  int bytes_encoded=0, bytes_written=0;
-  int c=0;
+  lame_state_t *state = (lame_state_t*)enc->state;
+  int bytes_encoded=0;
+
+  // Make sure there is enough space for the encoded audio
+  if (MPEG_BUFFER_SIZE(frame_count) > state->mpeg_buffer_size) {
+    unsigned char *mpeg_buffer = realloc( state->mpeg_buffer, MPEG_BUFFER_SIZE(frame_count) );
+    if (!mpeg_buffer) {
+      rotter_fatal( "realloc on mpeg_buffer failed" );
+      return -1;
+    }
+    state->mpeg_buffer = mpeg_buffer;
+    state->mpeg_buffer_size = MPEG_BUFFER_SIZE(frame_count);
+  }
 
-  // Convert to 16-bit integer samples
-  for (c=0; c<channels; c++) {
-    i16_buffer[c] = (short int*)realloc(i16_buffer[c], i16_desired );
-    if (!i16_buffer[c]) rotter_fatal( "realloc on i16_buffer failed" );
-    float32_to_short( buffer[c], i16_buffer[c], sample_count );
+#ifdef HAVE_LAME_ENCODE_BUFFER_INTERLEAVED_IEEE_FLOAT
+  // Encode the floating point samples directly
+  if (enc->channels > 1) {
+    bytes_encoded = lame_encode_buffer_interleaved_ieee_float( state->lame_opts,
+              buffer, frame_count, state->mpeg_buffer, state->mpeg_buffer_size );
+  } else {
+    bytes_encoded = lame_encode_buffer_ieee_float( state->lame_opts,
+              buffer, NULL, frame_count, state->mpeg_buffer, state->mpeg_buffer_size );
   }
+#else
+  size_t i16_desired = frame_count * enc->channels * sizeof( short int );
+
+  // Make sure there is enough space for the 16-bit samples
+  if (i16_desired > state->i16_buffer_size) {
+    short int *i16_buffer = realloc( state->i16_buffer, i16_desired );
+    if (!i16_buffer) {
+      rotter_fatal( "realloc on i16_buffer failed" );
+      return -1;
+    }
+    state->i16_buffer = i16_buffer;
+    state->i16_buffer_size = i16_desired;
+  }
+
+  // Convert to 16-bit integer samples
+  rotter_float_to_s16( buffer, state->i16_buffer, frame_count * enc->channels,
+                       dither_output ? &state->dither : NULL );
 
   // Encode it
-  bytes_encoded = lame_encode_buffer( lame_opts,
-            i16_buffer[0], i16_buffer[1],
-            sample_count, mpeg_buffer, WRITE_BUFFER_SIZE );
+  if (enc->channels > 1) {
+    bytes_encoded = lame_encode_buffer_interleaved( state->lame_opts,
+              state->i16_buffer, frame_count, state->mpeg_buffer, state->mpeg_buffer_size );
+  } else {
+    bytes_encoded = lame_encode_buffer( state->lame_opts,
+              state->i16_buffer, NULL, frame_count, state->mpeg_buffer, state->mpeg_buffer_size );
+  }
+#endif
 
   if (bytes_encoded<0) {
     rotter_fatal( "Error: while encoding audio.");
     return -1;
   } else if (bytes_encoded>0) {
     // Write it to disk
-    bytes_written = fwrite(mpeg_buffer, 1, bytes_encoded, file);
-    if (bytes_written != bytes_encoded) {
+    if (write_mpegaudio_file(fh, state->mpeg_buffer, bytes_encoded)) {
       rotter_error( "Warning: failed to write encoded audio to disk: %s", strerror(errno) );
       return -1;
     }
@@ -109,27 +129,31 @@ static int write_lame(void *fh, size_t sample_count, jack_default_audio_sample_t
 }
 
 
-static void deinit_lame()
+static void deinit_lame(encoder_funcs_t *enc)
 {
-  int c;
+  lame_state_t *state = (lame_state_t*)enc->state;
 
   rotter_debug("Shutting down LAME encoder.");
-  if (lame_opts) {
-    lame_close(lame_opts);
-    lame_opts = NULL;
-  }
+  if (state) {
+    if (state->lame_opts) {
+      lame_close(state->lame_opts);
+      state->lame_opts = NULL;
+    }
 
-  for( c=0; c<2; c++) {
-    if (i16_buffer[c]) {
-      free(i16_buffer[c]);
-      i16_buffer[c]=NULL;
+    if (state->i16_buffer) {
+      free(state->i16_buffer);
+      state->i16_buffer=NULL;
     }
-  }
 
-  if (mpeg_buffer) {
-    free(mpeg_buffer);
-    mpeg_buffer=NULL;
+    if (state->mpeg_buffer) {
+      free(state->mpeg_buffer);
+      state->mpeg_buffer=NULL;
+    }
+
+    free(state);
   }
+
+  free(enc);
 }
 
 
@@ -153,33 +177,30 @@ static const char* lame_get_mode_name( lame_global_flags *glopts )
   else { return "Unknown Mode"; }
 }
 
-encoder_funcs_t* init_lame( output_format_t* format, int channels, int bitrate )
+// Create and configure a LAME encoder, ready to encode a new file
+static lame_global_flags* setup_lame( encoder_funcs_t *enc, int bitrate )
 {
-  encoder_funcs_t* funcs = NULL;
-
-  lame_opts = lame_init();
+  lame_global_flags *lame_opts = lame_init();
   if (lame_opts==NULL) {
     rotter_error("lame error: failed to initialise.");
     return NULL;
   }
 
-  rotter_info( "Encoding using liblame version %s.", get_lame_version() );
-
-  if ( 0 > lame_set_num_channels( lame_opts, channels ) ) {
+  if ( 0 > lame_set_num_channels( lame_opts, enc->channels ) ) {
     rotter_error("lame error: failed to set number of channels.");
-    deinit_lame();
+    lame_close( lame_opts );
     return NULL;
   }
 
-  if ( 0 > lame_set_in_samplerate( lame_opts, jack_get_sample_rate( client ) )) {
+  if ( 0 > lame_set_in_samplerate( lame_opts, enc->samplerate )) {
     rotter_error("lame error: failed to set input samplerate.");
-    deinit_lame();
+    lame_close( lame_opts );
     return NULL;
   }
 
-  if ( 0 > lame_set_out_samplerate( lame_opts, jack_get_sample_rate( client ) )) {
+  if ( 0 > lame_set_out_samplerate( lame_opts, enc->samplerate )) {
     rotter_error("lame error: failed to set output samplerate.");
-    deinit_lame();
+    lame_close( lame_opts );
     return NULL;
   }
 
@@ -187,52 +208,101 @@ encoder_funcs_t* init_lame( output_format_t* format, int channels, int bitrate )
   if (vbr_quality < 0) {
     if ( 0 > lame_set_VBR( lame_opts, vbr_off) ) {
       rotter_error("lame error: failed to turn off VBR.");
-      deinit_lame();
+      lame_close( lame_opts );
       return NULL;
     }
 
     if ( 0 > lame_set_brate( lame_opts, bitrate) ) {
       rotter_error("lame error: failed to set bitrate.");
-      deinit_lame();
+      lame_close( lame_opts );
       return NULL;
     }
   } else {
-    int q = 10 - vbr_quality;
-
-    rotter_debug("  Turning on VBR mode (q=%d)", q);
     if ( 0 > lame_set_VBR( lame_opts, vbr_default) ) {
       rotter_error("lame error: failed to turn on VBR.");
-      deinit_lame();
+      lame_close( lame_opts );
       return NULL;
     }
 
-    if ( 0 > lame_set_VBR_q( lame_opts, q) ) {
+    if ( 0 > lame_set_VBR_q( lame_opts, 10 - vbr_quality) ) {
       rotter_error("lame error: failed to set VBR quality.");
-      deinit_lame();
+      lame_close( lame_opts );
       return NULL;
     }
   }
 
   if ( 0 > lame_init_params( lame_opts ) ) {
     rotter_error("lame error: failed to initialize parameters.");
-    deinit_lame();
+    lame_close( lame_opts );
     return NULL;
   }
 
-  rotter_debug( "  Input: %d Hz, %d channels",
-            lame_get_in_samplerate(lame_opts),
-            lame_get_num_channels(lame_opts));
+  return lame_opts;
+}
 
-  rotter_debug( "  Output: %s Layer 3, %d kbps, %s",
-            lame_get_version_name(lame_opts),
-            lame_get_brate(lame_opts),
-            lame_get_mode_name(lame_opts));
 
-  // Allocate memory for encoded audio
-  mpeg_buffer = malloc( 1.25*SAMPLES_PER_FRAME + 7200 );
-  if ( mpeg_buffer==NULL ) {
-    rotter_error( "Failed to allocate memory for encoded audio." );
-    deinit_lame();
+/*
+  Flush the audio still inside the encoder into the file, then close it
+*/
+static int close_lame(encoder_funcs_t *enc, void *fh, struct timeval *file_start)
+{
+  lame_state_t *state = (lame_state_t*)enc->state;
+  int bytes_encoded=0;
+
+  if (fh==NULL) return -1;
+
+  bytes_encoded = lame_encode_flush( state->lame_opts, state->mpeg_buffer, state->mpeg_buffer_size );
+  if (bytes_encoded<0) {
+    rotter_error( "Error: while flushing encoded audio.");
+  } else if (bytes_encoded>0) {
+    if (write_mpegaudio_file(fh, state->mpeg_buffer, bytes_encoded)) {
+      rotter_error( "Warning: failed to write encoded audio to disk: %s", strerror(errno) );
+    }
+  }
+
+  // Fill in the Xing/LAME tag frame at the start of the file, so that
+  // players can seek within VBR files and know the length of the audio
+  if (lame_get_bWriteVbrTag( state->lame_opts )) {
+    size_t tag_len = lame_get_lametag_frame( state->lame_opts, state->mpeg_buffer, state->mpeg_buffer_size );
+    if (tag_len > 0 && tag_len <= state->mpeg_buffer_size) {
+      if (write_mpegaudio_tag(fh, state->mpeg_buffer, tag_len)) {
+        rotter_error( "Warning: failed to write LAME tag: %s", strerror(errno) );
+      }
+    }
+  }
+
+  return close_mpegaudio_file(enc, fh, file_start);
+}
+
+
+/*
+  A flushed LAME encoder can't carry on encoding,
+  so replace it with a new one for the next file.
+*/
+static int reset_lame(encoder_funcs_t *enc)
+{
+  lame_state_t *state = (lame_state_t*)enc->state;
+
+  if (state->lame_opts)
+    lame_close(state->lame_opts);
+
+  state->lame_opts = setup_lame(enc, state->bitrate);
+  if (state->lame_opts==NULL)
+    return -1;
+
+  return 0;
+}
+
+
+encoder_funcs_t* init_lame( output_format_t* format, int channels, int bitrate )
+{
+  encoder_funcs_t* funcs = NULL;
+  lame_state_t* state = NULL;
+  lame_global_flags *lame_opts = NULL;
+
+  // MPEG Audio only supports mono and stereo
+  if (channels > 2) {
+    rotter_error("lame error: only 1 or 2 channels are supported.");
     return NULL;
   }
 
@@ -240,20 +310,69 @@ encoder_funcs_t* init_lame( output_format_t* format, int channels, int bitrate )
   funcs = calloc( 1, sizeof(encoder_funcs_t) );
   if ( funcs==NULL ) {
     rotter_error( "Failed to allocate memory for encoder callback functions structure." );
-    deinit_lame();
     return NULL;
   }
 
   funcs->file_suffix = "mp3";
+  funcs->channels = channels;
+  funcs->samplerate = jack_get_sample_rate( client );
   funcs->open = open_mpegaudio_file;
-  funcs->close = close_mpegaudio_file;
+  funcs->close = close_lame;
   funcs->write = write_lame;
   funcs->sync = sync_mpegaudio_file;
+  funcs->flush = flush_mpegaudio_file;
+  funcs->reset = reset_lame;
   funcs->deinit = deinit_lame;
 
+  // Allocate memory for encoder state
+  funcs->state = state = calloc( 1, sizeof(lame_state_t) );
+  if ( state==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder state." );
+    deinit_lame(funcs);
+    return NULL;
+  }
+
+  rotter_debug( "Encoding using liblame version %s.", get_lame_version() );
+
+  if (vbr_quality >= 0) {
+    rotter_debug("  Turning on VBR mode (q=%d)", (int)(10 - vbr_quality));
+  }
+
+  // The size of VBR files can't be known in advance
+  if (vbr_quality < 0)
+    funcs->bytes_per_second = bitrate * 1000.0 / 8;
+
+  state->bitrate = bitrate;
+  rotter_dither_init( &state->dither );
+#ifdef HAVE_LAME_ENCODE_BUFFER_INTERLEAVED_IEEE_FLOAT
+  if (dither_output)
+    rotter_debug("  LAME is given floating point samples, so they aren't dithered");
+#endif
+  state->lame_opts = lame_opts = setup_lame( funcs, bitrate );
+  if (lame_opts==NULL) {
+    deinit_lame(funcs);
+    return NULL;
+  }
+
+  rotter_debug( "  Input: %d Hz, %d channels",
+            lame_get_in_samplerate(lame_opts),
+            lame_get_num_channels(lame_opts));
+
+  rotter_debug( "  Output: %s Layer 3, %d kbps, %s",
+            lame_get_version_name(lame_opts),
+            lame_get_brate(lame_opts),
+            lame_get_mode_name(lame_opts));
+
+  // Allocate memory for encoded audio
+  state->mpeg_buffer_size = MPEG_BUFFER_SIZE( SAMPLES_PER_FRAME );
+  state->mpeg_buffer = malloc( state->mpeg_buffer_size );
+  if ( state->mpeg_buffer==NULL ) {
+    rotter_error( "Failed to allocate memory for encoded audio." );
+    deinit_lame(funcs);
+    return NULL;
+  }
+
   return funcs;
 }
 
 #endif   // HAVE_LAME
-
-
@@ -27,12 +27,17 @@
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include "rotter.h"
 #include "config.h"
 
 
+// ------- Globals -------
+int seek_index = 0;          // Write a seek index next to each MPEG Audio file
+
+
 /*
   ID3v1.0 Structure
   Informal specification: http://www.id3.org/id3v1.html
@@ -42,6 +47,167 @@
 */
 
 
+// An MPEG Audio file, written either through stdio or asynchronously
+typedef struct mpegaudio_file_s
+{
+  FILE *file;
+  rotter_aio_file_t *aio;
+  char *filepath;
+  off_t start_offset;              // Where the audio for this file starts (it may have been appended to)
+  off_t offset;                    // Where the next byte written will go
+
+  // Seek index
+  int indexing;                    // Flag to indicate that frames are being indexed
+  int index_fd;                    // Sidecar file (-1 until it has been opened)
+  off_t next_frame;                // Offset of the next frame header
+  unsigned char header[4];         // Frame header, which may be split between writes
+  size_t header_len;
+  double frame_time;               // Time at the start of the next frame
+  time_t next_index_time;          // Time of the next index entry
+  unsigned char *entries;          // Index entries that haven't been written yet
+  size_t entries_len;
+  size_t entries_size;
+} mpegaudio_file_t;
+
+
+/*
+  Seek index (-I)
+
+  As the encoded audio is written, the frame headers are followed to
+  find the byte offset of the first frame that starts in each second.
+  These are kept in a sidecar file next to the archive file (with
+  SEEK_INDEX_SUFFIX added), which is written out whenever the audio
+  file is synced. It starts with the 4 bytes of SEEK_INDEX_MAGIC and a
+  32-bit version number, then each entry is a 64-bit Unix time and a
+  64-bit byte offset; everything is little-endian. If the audio file is
+  appended to, the index is appended to as well.
+
+  The times are based on the number of samples written, so the frame
+  found for a time may start a little before it (by the encoder delay).
+
+  Files opened ahead of time (-P) only get an index once they have been
+  given their real name, so unused ones never leave an index behind.
+*/
+
+// Queue up an index entry, to be written at the next sync
+static void add_index_entry(mpegaudio_file_t* file, time_t when, off_t offset)
+{
+  if (file->entries_len + SEEK_INDEX_ENTRY_LEN > file->entries_size) {
+    size_t size = file->entries_size ? file->entries_size * 2 : SEEK_INDEX_ENTRY_LEN * 64;
+    unsigned char *entries = realloc( file->entries, size );
+    if (entries == NULL) {
+      rotter_error( "Failed to allocate memory for seek index; no longer indexing." );
+      file->indexing = 0;
+      return;
+    }
+    file->entries = entries;
+    file->entries_size = size;
+  }
+
+  rotter_put_seek_entry( file->entries + file->entries_len, when, offset );
+  file->entries_len += SEEK_INDEX_ENTRY_LEN;
+}
+
+
+// Follow the frame headers through some encoded audio that is about to be written
+static void index_mpegaudio_frames(mpegaudio_file_t* file, const unsigned char *data, size_t len)
+{
+  off_t end = file->offset + len;
+
+  while (file->indexing && file->next_frame + (off_t)file->header_len < end) {
+    int frame_len, samples, samplerate;
+
+    // Collect the four bytes of the header
+    while (file->header_len < 4 && file->next_frame + (off_t)file->header_len < end) {
+      file->header[file->header_len] = data[file->next_frame + file->header_len - file->offset];
+      file->header_len++;
+    }
+    if (file->header_len < 4)
+      break;
+
+    if (rotter_parse_mpeg_header( file->header, &frame_len, &samples, &samplerate )) {
+      rotter_error( "Warning: lost track of MPEG Audio frames; no longer indexing." );
+      file->indexing = 0;
+      break;
+    }
+
+    if (file->frame_time >= file->next_index_time) {
+      add_index_entry( file, file->next_index_time, file->next_frame );
+      file->next_index_time = (time_t)file->frame_time + 1;
+    }
+
+    file->frame_time += (double)samples / samplerate;
+    file->next_frame += frame_len;
+    file->header_len = 0;
+  }
+}
+
+
+// Write out the index entries so far, opening the index file first if need be
+static void flush_mpegaudio_index(mpegaudio_file_t* file, int sync)
+{
+  size_t suffix_len = strlen(PREPARED_FILE_SUFFIX);
+  size_t path_len = strlen(file->filepath);
+  char indexpath[MAX_FILEPATH_LEN];
+
+  if (file->index_fd < 0) {
+    if (file->entries_len == 0)
+      return;
+
+    // Wait until a file opened ahead of time has been renamed
+    if (path_len > suffix_len && !strcmp(file->filepath + path_len - suffix_len, PREPARED_FILE_SUFFIX)) {
+      if (access( file->filepath, F_OK ) == 0)
+        return;
+      path_len -= suffix_len;
+    }
+
+    snprintf( indexpath, sizeof(indexpath), "%.*s%s", (int)path_len, file->filepath, SEEK_INDEX_SUFFIX );
+    file->index_fd = open( indexpath, O_WRONLY | O_CREAT | O_APPEND, 0666 );
+    if (file->index_fd < 0) {
+      rotter_error( "Failed to open seek index %s: %s", indexpath, strerror(errno) );
+      file->indexing = 0;
+      file->entries_len = 0;
+      return;
+    }
+
+    if (lseek( file->index_fd, 0, SEEK_END ) == 0) {
+      unsigned char header[SEEK_INDEX_HEADER_LEN] = SEEK_INDEX_MAGIC;
+      header[4] = SEEK_INDEX_VERSION;
+      if (write( file->index_fd, header, sizeof(header) ) != sizeof(header)) {
+        rotter_error( "Failed to write seek index header: %s", strerror(errno) );
+      }
+    }
+  }
+
+  if (file->entries_len > 0) {
+    if (write( file->index_fd, file->entries, file->entries_len ) != file->entries_len) {
+      rotter_error( "Failed to write seek index: %s", strerror(errno) );
+    }
+    file->entries_len = 0;
+  }
+
+  // With asynchronous output (-A), the writer doesn't wait for the disk
+  if (sync && !file->aio && fdatasync( file->index_fd )) {
+    rotter_error( "Failed to sync seek index: %s", strerror(errno) );
+  }
+}
+
+
+// Write some encoded audio to a file, without indexing it
+static int write_mpegaudio_data(mpegaudio_file_t* file, const void *data, size_t len)
+{
+  if (file->aio) {
+    if (rotter_aio_write( file->aio, data, len ))
+      return -1;
+  } else if (fwrite( data, 1, len, file->file ) != len) {
+    return -1;
+  }
+
+  file->offset += len;
+  return 0;
+}
+
+
 typedef struct id3v1_s
 {
   char tag[3];
@@ -55,7 +221,7 @@ typedef struct id3v1_s
 
 
 // Write an ID3v1 tag to a file handle
-static void write_id3v1(FILE* file, struct timeval *file_start)
+static void write_id3v1(mpegaudio_file_t* file, struct timeval *file_start)
 {
   char year[5];
   struct tm tm;
@@ -97,50 +263,172 @@ static void write_id3v1(FILE* file, struct timeval *file_start)
   id3.genre = 255;
 
   // Now write it to file
-  if (fwrite( &id3, sizeof(id3v1_t), 1, file) != 1) {
+  if (write_mpegaudio_data( file, &id3, sizeof(id3v1_t) )) {
     rotter_error( "Warning: failed to write ID3v1 tag." );
   }
 }
 
 
-int close_mpegaudio_file(void* fh, struct timeval *file_start)
+// Write some encoded audio to a file handle
+int write_mpegaudio_file(void *fh, const void *data, size_t len)
+{
+  mpegaudio_file_t *file = (mpegaudio_file_t*)fh;
+
+  if (file->indexing)
+    index_mpegaudio_frames( file, data, len );
+
+  return write_mpegaudio_data( file, data, len );
+}
+
+
+// Write a tag over the first frame of the file, once all the audio has been written
+int write_mpegaudio_tag(void *fh, const void *data, size_t len)
+{
+  mpegaudio_file_t *file = (mpegaudio_file_t*)fh;
+  size_t written = 0;
+
+  if (file->aio)
+    return rotter_aio_write_at( file->aio, data, len, file->start_offset );
+
+  if (fflush(file->file))
+    return -1;
+
+  while (written < len) {
+    ssize_t result = pwrite( fileno(file->file), (const char*)data + written, len - written, file->start_offset + written );
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    written += result;
+  }
+
+  return 0;
+}
+
+
+static void free_mpegaudio_file(mpegaudio_file_t *file)
+{
+  if (file->index_fd >= 0 && close( file->index_fd )) {
+    rotter_error( "Failed to close seek index: %s", strerror(errno) );
+  }
+
+  free( file->entries );
+  free( file->filepath );
+  free( file );
+}
+
+
+int close_mpegaudio_file(encoder_funcs_t *enc, void* fh, struct timeval *file_start)
 {
-  FILE *file = (FILE*)fh;
+  mpegaudio_file_t *file = (mpegaudio_file_t*)fh;
+  int result = 0;
 
   if (file==NULL) return -1;
 
   // Write ID3v1 tags
   write_id3v1(file, file_start);
 
+  if (seek_index)
+    flush_mpegaudio_index(file, 0);
+
   rotter_debug("Closing MPEG Audio output file.");
 
-  if (fclose(file)) {
+  if (file->aio) {
+    // Closed in the background, once the rest of the file has been written
+    result = rotter_aio_close( file->aio );
+  } else if (fclose(file->file)) {
     rotter_error( "Failed to close output file: %s", strerror(errno) );
-    return -1;
+    result = -1;
   }
 
-  // Success
-  return 0;
+  free_mpegaudio_file(file);
+
+  return result;
 }
 
 
-void* open_mpegaudio_file( const char* filepath, struct timeval *file_start )
+void* open_mpegaudio_file( encoder_funcs_t *enc, const char* filepath, struct timeval *file_start )
 {
-  FILE* file;
+  mpegaudio_file_t* file = calloc( 1, sizeof(mpegaudio_file_t) );
+  if (file==NULL) {
+    rotter_error( "Failed to allocate memory for output file." );
+    return NULL;
+  }
+
+  file->index_fd = -1;
+  file->filepath = strdup( filepath );
+  if (file->filepath==NULL) {
+    rotter_error( "Failed to allocate memory for output file." );
+    free_mpegaudio_file(file);
+    return NULL;
+  }
 
   rotter_debug("Opening MPEG Audio output file: %s", filepath);
-  file = fopen( filepath, "ab" );
-  if (file==NULL) {
-    rotter_error( "Failed to open output file: %s", strerror(errno) );
+  if (async_output) {
+    file->aio = rotter_aio_open( filepath );
+    if (file->aio)
+      file->start_offset = rotter_aio_tell( file->aio );
+  } else {
+    // Not opened for appending, so that the tag at the start can be filled in later
+    int fd = open( filepath, O_WRONLY | O_CREAT, 0666 );
+    if (fd < 0 || (file->file = fdopen( fd, "wb" ))==NULL) {
+      rotter_error( "Failed to open output file: %s", strerror(errno) );
+      if (fd >= 0) close( fd );
+    } else if (fseeko( file->file, 0, SEEK_END ) || (file->start_offset = ftello( file->file )) < 0) {
+      rotter_error( "Failed to seek to end of output file: %s", strerror(errno) );
+      fclose( file->file );
+      file->file = NULL;
+    }
+  }
+
+  if (file->file==NULL && file->aio==NULL) {
+    free_mpegaudio_file(file);
     return NULL;
   }
 
+  file->offset = file->start_offset;
+  if (seek_index) {
+    file->indexing = 1;
+    file->next_frame = file->start_offset;
+    file->frame_time = file_start->tv_sec + file_start->tv_usec / 1000000.0;
+    file->next_index_time = file_start->tv_sec + (file_start->tv_usec > 0);
+  }
+
   return file;
 }
 
-int sync_mpegaudio_file(void *fh)
+int sync_mpegaudio_file(encoder_funcs_t *enc, void *fh)
+{
+  mpegaudio_file_t *file = (mpegaudio_file_t*)fh;
+
+  if (seek_index)
+    flush_mpegaudio_index( file, 1 );
+
+  if (file->aio)
+    return rotter_aio_sync( file->aio );
+
+  if (fflush(file->file))
+    return -1;
+
+  // The audio is only ever appended, so there is no need to sync the other metadata
+  return fdatasync(fileno(file->file));
+}
+
+int flush_mpegaudio_file(encoder_funcs_t *enc, void *fh)
 {
-  FILE *file = (FILE*)fh;
-  int fd = fileno(file);
-  return fsync(fd);
+  mpegaudio_file_t *file = (mpegaudio_file_t*)fh;
+
+  if (seek_index)
+    flush_mpegaudio_index( file, 0 );
+
+  if (file->aio) {
+    if (rotter_aio_flush( file->aio ))
+      return -1;
+    return rotter_aio_fd( file->aio );
+  }
+
+  if (fflush(file->file))
+    return -1;
+
+  return fileno(file->file);
 }
@@ -0,0 +1,387 @@
+/*
+
+  opus.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "rotter.h"
+
+
+#ifdef HAVE_OPUSENC
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <opusenc.h>
+
+
+/*
+  Ogg Opus encoder, using libopusenc.
+
+  libopusenc takes the floating point samples from the ring buffer as
+  they are, resampling them to 48kHz if need be, and takes care of the
+  Ogg framing: every page carries the granule position of its last
+  sample, and a page is written at least every OPUS_MAX_PAGE_DELAY
+  samples (at 48kHz), so a player seeking within a file only has to
+  bisect on page boundaries and then decode less than a second of audio.
+
+  The Ogg pages are written to the file through our own callback, so that
+  its descriptor can be used for syncing and writeback, and so that they
+  can be queued for asynchronous output with -A. If the file already
+  exists, a new stream is chained on to the end of it.
+*/
+
+
+// ------ Structures ---------
+typedef struct opus_state_s
+{
+  int bitrate;                     // Target bitrate (in bits per second)
+  int vbr;                         // Flag to indicate that VBR is enabled
+} opus_state_t;
+
+typedef struct opus_handle_s
+{
+  int fd;
+  rotter_aio_file_t *aio;          // Asynchronous output (-A)
+  int write_failed;
+  OggOpusEnc *encoder;
+} opus_handle_t;
+
+
+
+static int opus_write_callback(void *user_data, const unsigned char *ptr, opus_int32 len)
+{
+  opus_handle_t *handle = (opus_handle_t*)user_data;
+  opus_int32 written = 0;
+
+  if (handle->aio) {
+    if (rotter_aio_write( handle->aio, ptr, len )) {
+      handle->write_failed = 1;
+      return 1;
+    }
+    return 0;
+  }
+
+  while (written < len) {
+    ssize_t result = write( handle->fd, ptr + written, len - written );
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      rotter_error( "Warning: failed to write encoded audio to disk: %s", strerror(errno) );
+      handle->write_failed = 1;
+      return 1;
+    }
+    written += result;
+  }
+
+  return 0;
+}
+
+static int opus_close_callback(void *user_data)
+{
+  // The file is closed by close_opus(), once the encoder has been drained
+  return 0;
+}
+
+static const OpusEncCallbacks opus_callbacks = {
+  opus_write_callback,
+  opus_close_callback
+};
+
+
+/*
+  Encode and write some audio from the ring buffer to disk
+*/
+static int write_opus(encoder_funcs_t *enc, void *fh, size_t frame_count, const jack_default_audio_sample_t *buffer)
+{
+  opus_handle_t *handle = (opus_handle_t*)fh;
+  int result;
+
+  result = ope_encoder_write_float( handle->encoder, buffer, frame_count );
+  if (result != OPE_OK || handle->write_failed) {
+    rotter_error( "Error: while encoding audio: %s",
+                  handle->write_failed ? "write failed" : ope_strerror( result ) );
+    return -1;
+  }
+
+  // Success
+  return 0;
+}
+
+
+static int sync_opus(encoder_funcs_t *enc, void *fh)
+{
+  opus_handle_t *handle = (opus_handle_t*)fh;
+
+  if (handle->aio)
+    return rotter_aio_sync( handle->aio );
+
+  // Pages are written out as they are completed
+  return fdatasync( handle->fd );
+}
+
+
+static int flush_opus(encoder_funcs_t *enc, void *fh)
+{
+  opus_handle_t *handle = (opus_handle_t*)fh;
+
+  if (handle->aio && rotter_aio_flush( handle->aio ))
+    return -1;
+
+  return handle->fd;
+}
+
+
+// Close the file (in the background with -A, once the rest of it has been written)
+static int close_opus_file(opus_handle_t *handle)
+{
+  if (handle->aio)
+    return rotter_aio_close( handle->aio );
+
+  if (close( handle->fd )) {
+    rotter_error( "Failed to close output file: %s", strerror(errno) );
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static int close_opus(encoder_funcs_t *enc, void *fh, struct timeval *file_start)
+{
+  opus_handle_t *handle = (opus_handle_t*)fh;
+  int result = 0;
+  int err;
+
+  if (handle==NULL) return -1;
+
+  rotter_debug("Closing Opus output file.");
+
+  // Encode the last packet, and write the final page with the end of stream flag
+  err = ope_encoder_drain( handle->encoder );
+  if (err != OPE_OK || handle->write_failed) {
+    rotter_error( "Failed to finish Opus file: %s",
+                  handle->write_failed ? "write failed" : ope_strerror( err ) );
+    result = -1;
+  }
+  ope_encoder_destroy( handle->encoder );
+
+  if (close_opus_file( handle ))
+    result = -1;
+
+  free( handle );
+
+  return result;
+}
+
+
+// Create the Vorbis comment for a new file
+static OggOpusComments* create_opus_comments(struct timeval *file_start)
+{
+  OggOpusComments *comments = ope_comments_create();
+  char str[64];
+  struct tm tm;
+
+  if (comments == NULL)
+    return NULL;
+
+  localtime_r( &file_start->tv_sec, &tm );
+
+  snprintf( str, sizeof(str), "Recorded %4.4d-%2.2d-%2.2d %2.2d:%2.2d",
+            tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min );
+  ope_comments_add( comments, "TITLE", str );
+
+  if (originator)
+    ope_comments_add( comments, "ARTIST", originator );
+
+  snprintf( str, sizeof(str), "%4.4d-%2.2d-%2.2dT%2.2d:%2.2d:%2.2d",
+            tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec );
+  ope_comments_add( comments, "DATE", str );
+
+  snprintf( str, sizeof(str), "Created by %s v%s", PACKAGE_NAME, PACKAGE_VERSION );
+  ope_comments_add( comments, "COMMENT", str );
+
+  return comments;
+}
+
+
+// Apply our settings to a new libopusenc encoder
+static int setup_opus(encoder_funcs_t *enc, OggOpusEnc *encoder)
+{
+  opus_state_t *state = (opus_state_t*)enc->state;
+
+  if (ope_encoder_ctl( encoder, OPUS_SET_BITRATE( state->bitrate ) ) != OPE_OK ||
+      ope_encoder_ctl( encoder, OPUS_SET_VBR( state->vbr ) ) != OPE_OK ||
+      ope_encoder_ctl( encoder, OPE_SET_MUXING_DELAY( OPUS_MAX_PAGE_DELAY ) ) != OPE_OK)
+  {
+    rotter_error( "Opus error: failed to configure encoder." );
+    return -1;
+  }
+
+  // Let the bitrate vary freely, rather than just within each packet
+  if (state->vbr && ope_encoder_ctl( encoder, OPUS_SET_VBR_CONSTRAINT( 0 ) ) != OPE_OK) {
+    rotter_error( "Opus error: failed to turn on unconstrained VBR." );
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static void* open_opus(encoder_funcs_t *enc, const char* filepath, struct timeval *file_start)
+{
+  opus_handle_t *handle = NULL;
+  OggOpusComments *comments = NULL;
+  int family = 0;
+  int err = OPE_OK;
+
+  rotter_debug("Opening Opus output file: %s", filepath);
+
+  handle = calloc( 1, sizeof(opus_handle_t) );
+  if (handle==NULL) {
+    rotter_error( "Failed to allocate memory for output file." );
+    return NULL;
+  }
+
+  if (async_output) {
+    // Written at the offsets it keeps track of, so not opened for appending
+    handle->aio = rotter_aio_open( filepath );
+    if (handle->aio == NULL) {
+      free( handle );
+      return NULL;
+    }
+    handle->fd = rotter_aio_fd( handle->aio );
+  } else {
+    handle->fd = open( filepath, O_WRONLY | O_CREAT | O_APPEND, 0666 );
+    if (handle->fd < 0) {
+      rotter_error( "Failed to open output file: %s", strerror(errno) );
+      free( handle );
+      return NULL;
+    }
+  }
+
+  comments = create_opus_comments( file_start );
+  if (comments == NULL) {
+    rotter_error( "Failed to allocate memory for Opus metadata." );
+    close_opus_file( handle );
+    free( handle );
+    return NULL;
+  }
+
+  // Mono and stereo are coded as they are; otherwise use the Vorbis
+  // channel order, for up to 8 channels, or no particular order beyond that
+  if (enc->channels > 8)
+    family = 255;
+  else if (enc->channels > 2)
+    family = 1;
+
+  handle->encoder = ope_encoder_create_callbacks( &opus_callbacks, handle, comments,
+                      enc->samplerate, enc->channels, family, &err );
+  ope_comments_destroy( comments );
+  if (handle->encoder == NULL) {
+    rotter_error( "Failed to start Opus encoder: %s", ope_strerror( err ) );
+    close_opus_file( handle );
+    free( handle );
+    return NULL;
+  }
+
+  if (setup_opus( enc, handle->encoder )) {
+    ope_encoder_destroy( handle->encoder );
+    close_opus_file( handle );
+    free( handle );
+    return NULL;
+  }
+
+  return (void*)handle;
+}
+
+
+static void deinit_opus(encoder_funcs_t *enc)
+{
+  rotter_debug("Shutting down Opus encoder.");
+  if (enc->state)
+    free(enc->state);
+
+  free(enc);
+}
+
+
+encoder_funcs_t* init_opus( output_format_t* format, int channels, int bitrate )
+{
+  encoder_funcs_t* funcs = NULL;
+  opus_state_t* state = NULL;
+
+  // Allocate memory for callback functions
+  funcs = calloc( 1, sizeof(encoder_funcs_t) );
+  if ( funcs==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder callback functions structure." );
+    return NULL;
+  }
+
+  funcs->file_suffix = "opus";
+  funcs->channels = channels;
+  funcs->samplerate = jack_get_sample_rate( client );
+  funcs->open = open_opus;
+  funcs->close = close_opus;
+  funcs->write = write_opus;
+  funcs->sync = sync_opus;
+  funcs->flush = flush_opus;
+  funcs->deinit = deinit_opus;
+
+  // Allocate memory for encoder state
+  funcs->state = state = calloc( 1, sizeof(opus_state_t) );
+  if ( state==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder state." );
+    deinit_opus(funcs);
+    return NULL;
+  }
+
+  // With VBR, the quality sets the average bitrate, as there is
+  // no separate quality setting in Opus
+  if (vbr_quality < 0) {
+    state->bitrate = bitrate * 1000;
+    state->vbr = 0;
+  } else {
+    state->bitrate = OPUS_VBR_BITRATE( vbr_quality, channels ) * 1000;
+    state->vbr = 1;
+  }
+
+  rotter_debug( "Encoding using %s.", ope_get_version_string() );
+  rotter_debug( "  Input: %d Hz, %d channels", funcs->samplerate, channels );
+  if (state->vbr) {
+    rotter_debug( "  Output: Ogg Opus, VBR averaging %d kbps (q=%d)", state->bitrate / 1000, (int)vbr_quality );
+  } else {
+    rotter_debug( "  Output: Ogg Opus, %d kbps CBR", state->bitrate / 1000 );
+  }
+
+  // The size of VBR files can't be known in advance; allow a little for the Ogg pages
+  if (!state->vbr)
+    funcs->bytes_per_second = bitrate * 1000.0 / 8 * 1.02;
+
+  return funcs;
+}
+
+#endif   // HAVE_OPUSENC
@@ -0,0 +1,736 @@
+/*
+
+  pcmfile.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "rotter.h"
+#include "config.h"
+
+
+/*
+  Native writer for uncompressed WAV, AIFF and AU files.
+
+  The interleaved audio from the ringbuffer is converted to the
+  output sample format in a single pass, straight into a large aligned
+  buffer for each file, which is only written out once it is full and
+  when the file is synced, flushed or closed. With -A the converted
+  audio is queued for asynchronous output instead. The sizes in the
+  header are only patched when the file is synced or closed.
+
+  WAV files start with a 'JUNK' chunk the size of an RF64 'ds64'
+  chunk (EBU Tech 3306), so that a file which grows past 4GB can be
+  turned into an RF64 file in place.
+*/
+
+
+#define PCMFILE_WAV_FORMAT_PCM    (1)
+#define PCMFILE_WAV_FORMAT_FLOAT  (3)
+#define PCMFILE_AU_ENCODING_PCM16 (3)
+#define PCMFILE_AU_ENCODING_FLOAT (6)
+#define PCMFILE_DS64_SIZE         (28)
+#define PCMFILE_BEXT_SIZE         (602)
+#define PCMFILE_MAX_HEADER        (1024)
+
+
+// ------ Structures ---------
+typedef struct pcmfile_state_s
+{
+  int format;                  // RotterPcmFormat
+  int sample_bytes;            // Bytes in each output sample
+  int is_float;                // Output samples are 32-bit floating point
+  int big_endian;              // Output samples are big-endian
+  size_t data_offset;          // Position of the first audio byte in the file
+  void *buffer;                // Converted audio, ready to be written
+  rotter_dither_t dither;
+  size_t buffer_size;
+} pcmfile_state_t;
+
+typedef struct pcmfile_handle_s
+{
+  int fd;
+  rotter_aio_file_t *aio;      // Asynchronous output (-A)
+  unsigned char *buffer;       // Converted audio waiting to be written (without -A)
+  size_t buffer_used;
+  uint64_t data_bytes;         // Bytes of audio in the file
+  uint64_t header_bytes;       // Bytes of audio that the header says are in the file
+  int rf64;                    // The WAV file has been turned into RF64
+} pcmfile_handle_t;
+
+
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+  put_le32(p, v & 0xffffffff);
+  put_le32(p + 4, v >> 32);
+}
+
+static void put_be16(unsigned char *p, uint16_t v)
+{
+  p[0] = (v >> 8) & 0xff;
+  p[1] = v & 0xff;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+  p[0] = (v >> 24) & 0xff;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+
+// Sample rate as an 80-bit IEEE 754 extended float, for the AIFF 'COMM' chunk
+static void put_extended(unsigned char *p, uint32_t value)
+{
+  int exponent = 16383 + 31;
+
+  memset(p, 0, 10);
+  if (value == 0) return;
+
+  while (!(value & 0x80000000)) {
+    value <<= 1;
+    exponent--;
+  }
+
+  put_be16(p, exponent);
+  put_be32(p + 2, value);
+}
+
+
+// Fill in a Broadcast Wave Extension chunk (EBU Tech 3285, version 0)
+static void build_bext(unsigned char *bext, struct timeval *file_start, int samplerate)
+{
+  char tmp_str[32];
+  uint64_t sample_count;
+  time_t midnight;
+  struct tm tm;
+
+  // EBU TECH 3285 doesn't specify the timezone :(
+  localtime_r( &file_start->tv_sec, &tm );
+
+  memset( bext, 0, PCMFILE_BEXT_SIZE );
+
+  // Description and originator
+  strncpy( (char*)bext, "Recording by rotter", 256 );
+  if (originator) {
+    strncpy( (char*)bext + 256, originator, 31 );
+  }
+
+  // Origination date and time
+  snprintf( tmp_str, sizeof(tmp_str), "%4.4d-%2.2d-%2.2d", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
+  memcpy( bext + 320, tmp_str, 10 );
+  snprintf( tmp_str, sizeof(tmp_str), "%2.2d:%2.2d:%2.2d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+  memcpy( bext + 330, tmp_str, 8 );
+
+  // Number of samples since midnight
+  tm.tm_hour = 0;
+  tm.tm_min = 0;
+  tm.tm_sec = 0;
+  midnight = mktime(&tm);
+  sample_count = (file_start->tv_sec - midnight) * samplerate;
+  sample_count += ((float)file_start->tv_usec / 1000000) * samplerate;
+  put_le64( bext + 338, sample_count );
+
+  // Version 0: no UMID, loudness or coding history
+  put_le16( bext + 346, 0 );
+}
+
+
+// Build the header for an empty file; returns its length
+static size_t build_header(encoder_funcs_t *enc, unsigned char *header, struct timeval *file_start)
+{
+  pcmfile_state_t *state = (pcmfile_state_t*)enc->state;
+  int block_align = enc->channels * state->sample_bytes;
+  unsigned char *p = header;
+
+  memset( header, 0, PCMFILE_MAX_HEADER );
+
+  switch (state->format) {
+    case ROTTER_PCM_WAV16:
+    case ROTTER_PCM_WAV32:
+      memcpy( p, "RIFF", 4 );
+      memcpy( p + 8, "WAVE", 4 );
+      p += 12;
+
+      // Space for a 'ds64' chunk, in case the file goes past 4GB
+      memcpy( p, "JUNK", 4 );
+      put_le32( p + 4, PCMFILE_DS64_SIZE );
+      p += 8 + PCMFILE_DS64_SIZE;
+
+      memcpy( p, "bext", 4 );
+      put_le32( p + 4, PCMFILE_BEXT_SIZE );
+      build_bext( p + 8, file_start, enc->samplerate );
+      p += 8 + PCMFILE_BEXT_SIZE;
+
+      memcpy( p, "fmt ", 4 );
+      put_le32( p + 4, state->is_float ? 18 : 16 );
+      put_le16( p + 8, state->is_float ? PCMFILE_WAV_FORMAT_FLOAT : PCMFILE_WAV_FORMAT_PCM );
+      put_le16( p + 10, enc->channels );
+      put_le32( p + 12, enc->samplerate );
+      put_le32( p + 16, enc->samplerate * block_align );
+      put_le16( p + 20, block_align );
+      put_le16( p + 22, state->sample_bytes * 8 );
+      p += state->is_float ? 8 + 18 : 8 + 16;
+
+      // Non-PCM formats need a 'fact' chunk
+      if (state->is_float) {
+        memcpy( p, "fact", 4 );
+        put_le32( p + 4, 4 );
+        p += 8 + 4;
+      }
+
+      memcpy( p, "data", 4 );
+      p += 8;
+      break;
+
+    case ROTTER_PCM_AIFF16:
+      memcpy( p, "FORM", 4 );
+      memcpy( p + 8, "AIFF", 4 );
+      p += 12;
+
+      memcpy( p, "COMM", 4 );
+      put_be32( p + 4, 18 );
+      put_be16( p + 8, enc->channels );
+      put_be16( p + 14, state->sample_bytes * 8 );
+      put_extended( p + 16, enc->samplerate );
+      p += 8 + 18;
+
+      // Followed by the offset and block size, which are both zero
+      memcpy( p, "SSND", 4 );
+      p += 8 + 8;
+      break;
+
+    case ROTTER_PCM_AU16:
+    case ROTTER_PCM_AU32:
+      memcpy( p, ".snd", 4 );
+      put_be32( p + 4, 24 );
+      put_be32( p + 8, 0xffffffff );
+      put_be32( p + 12, state->is_float ? PCMFILE_AU_ENCODING_FLOAT : PCMFILE_AU_ENCODING_PCM16 );
+      put_be32( p + 16, enc->samplerate );
+      put_be32( p + 20, enc->channels );
+      p += 24;
+      break;
+  }
+
+  return p - header;
+}
+
+
+// Overwrite part of the header (asynchronously, once the audio before it has been written)
+static int write_header_at(pcmfile_handle_t *handle, const void *buf, size_t len, off_t offset)
+{
+  if (handle->aio)
+    return rotter_aio_write_at( handle->aio, buf, len, offset );
+
+  return pwrite( handle->fd, buf, len, offset ) == (ssize_t)len ? 0 : -1;
+}
+
+
+// Write the sizes into the header
+static int patch_header(encoder_funcs_t *enc, pcmfile_handle_t *handle)
+{
+  pcmfile_state_t *state = (pcmfile_state_t*)enc->state;
+  uint64_t frames = handle->data_bytes / (enc->channels * state->sample_bytes);
+  uint64_t riff_size = state->data_offset - 8 + handle->data_bytes;
+  unsigned char buf[PCMFILE_DS64_SIZE + 8];
+  int err = 0;
+
+  switch (state->format) {
+    case ROTTER_PCM_WAV16:
+    case ROTTER_PCM_WAV32:
+      if (riff_size > 0xffffffff && !handle->rf64) {
+        rotter_info( "WAV file has grown past 4GB; switching to RF64." );
+        handle->rf64 = 1;
+        if (write_header_at( handle, "RF64", 4, 0 )) err = -1;
+      }
+
+      if (handle->rf64) {
+        // Sizes that don't fit are in the 'ds64' chunk
+        memcpy( buf, "ds64", 4 );
+        put_le32( buf + 4, PCMFILE_DS64_SIZE );
+        put_le64( buf + 8, riff_size );
+        put_le64( buf + 16, handle->data_bytes );
+        put_le64( buf + 24, frames );
+        put_le32( buf + 32, 0 );
+        if (write_header_at( handle, buf, sizeof(buf), 12 )) err = -1;
+        riff_size = 0xffffffff;
+      }
+
+      put_le32( buf, riff_size );
+      if (write_header_at( handle, buf, 4, 4 )) err = -1;
+
+      if (state->is_float) {
+        // 'fact' chunk comes just before the 'data' chunk
+        put_le32( buf, handle->rf64 ? 0xffffffff : frames );
+        if (write_header_at( handle, buf, 4, state->data_offset - 12 )) err = -1;
+      }
+
+      put_le32( buf, handle->rf64 ? 0xffffffff : handle->data_bytes );
+      if (write_header_at( handle, buf, 4, state->data_offset - 4 )) err = -1;
+      break;
+
+    case ROTTER_PCM_AIFF16:
+      if (riff_size > 0xffffffff) {
+        // AIFF can't describe a file this big; leave the header as it was
+        if (state->data_offset - 8 + handle->header_bytes <= 0xffffffff)
+          rotter_error( "AIFF file has grown past 4GB; its header will be wrong." );
+        handle->header_bytes = handle->data_bytes;
+        return 0;
+      }
+
+      put_be32( buf, riff_size );
+      if (write_header_at( handle, buf, 4, 4 )) err = -1;
+      put_be32( buf, frames );
+      if (write_header_at( handle, buf, 4, 22 )) err = -1;
+      put_be32( buf, handle->data_bytes + 8 );
+      if (write_header_at( handle, buf, 4, state->data_offset - 12 )) err = -1;
+      break;
+
+    case ROTTER_PCM_AU16:
+    case ROTTER_PCM_AU32:
+      // AU allows the size to be unknown
+      put_be32( buf, handle->data_bytes < 0xffffffff ? handle->data_bytes : 0xffffffff );
+      if (write_header_at( handle, buf, 4, 8 )) err = -1;
+      break;
+  }
+
+  if (err) {
+    rotter_error( "Failed to update header of output file: %s", strerror(errno) );
+    return -1;
+  }
+
+  handle->header_bytes = handle->data_bytes;
+  return 0;
+}
+
+
+// Only touch the header if the amount of audio has changed
+static int update_header(encoder_funcs_t *enc, pcmfile_handle_t *handle)
+{
+  if (handle->header_bytes == handle->data_bytes)
+    return 0;
+
+  return patch_header(enc, handle);
+}
+
+
+// Convert interleaved floating point samples, in a single pass
+static void convert_samples(pcmfile_state_t *state, void *dest, const jack_default_audio_sample_t *in, size_t count)
+{
+  size_t i;
+
+  if (state->is_float) {
+    uint32_t *out = (uint32_t*)dest;
+    memcpy( out, in, count * sizeof(float) );
+    if (state->big_endian) {
+      for (i=0; i<count; i++)
+        out[i] = __builtin_bswap32( out[i] );
+    }
+  } else {
+    int16_t *out = (int16_t*)dest;
+
+    rotter_float_to_s16( in, out, count, dither_output ? &state->dither : NULL );
+
+    if (state->big_endian) {
+      uint16_t *swap = (uint16_t*)out;
+      for (i=0; i<count; i++)
+        swap[i] = __builtin_bswap16( swap[i] );
+    }
+  }
+}
+
+
+// Write out the audio collected in the file's buffer
+static int flush_buffer(pcmfile_handle_t *handle)
+{
+  size_t written = 0;
+
+  while (written < handle->buffer_used) {
+    ssize_t result = write( handle->fd, handle->buffer + written, handle->buffer_used - written );
+    if (result < 0) {
+      if (errno == EINTR) continue;
+      rotter_error( "Warning: failed to write audio to disk: %s", strerror(errno) );
+
+      // The header only counts the audio that made it into the file
+      handle->data_bytes -= handle->buffer_used - written;
+      handle->buffer_used = 0;
+      return -1;
+    }
+    written += result;
+  }
+
+  handle->buffer_used = 0;
+  return 0;
+}
+
+
+static int write_pcmfile(encoder_funcs_t *enc, void *fh, size_t frame_count, const jack_default_audio_sample_t *buffer)
+{
+  pcmfile_state_t *state = (pcmfile_state_t*)enc->state;
+  pcmfile_handle_t *handle = (pcmfile_handle_t*)fh;
+  size_t samples = frame_count * enc->channels;
+  size_t bytes = samples * state->sample_bytes;
+
+  if (handle->aio) {
+    // Make sure there is enough space for the converted audio
+    if (bytes > state->buffer_size) {
+      void *new_buffer = NULL;
+      if (posix_memalign( &new_buffer, ROTTER_CACHE_LINE, bytes )) {
+        rotter_fatal( "Failed to allocate memory for converted audio." );
+        return -1;
+      }
+      free( state->buffer );
+      state->buffer = new_buffer;
+      state->buffer_size = bytes;
+    }
+
+    convert_samples( state, state->buffer, buffer, samples );
+    if (rotter_aio_write( handle->aio, state->buffer, bytes ))
+      return -1;
+    handle->data_bytes += bytes;
+    return 0;
+  }
+
+  // Convert as much as fits into the file's buffer, and write it out once it is full
+  while (samples > 0) {
+    size_t count = (AIO_BUFFER_SIZE - handle->buffer_used) / state->sample_bytes;
+    if (count > samples)
+      count = samples;
+
+    convert_samples( state, handle->buffer + handle->buffer_used, buffer, count );
+    handle->buffer_used += count * state->sample_bytes;
+    handle->data_bytes += count * state->sample_bytes;
+    buffer += count;
+    samples -= count;
+
+    if (handle->buffer_used == AIO_BUFFER_SIZE && flush_buffer( handle ))
+      return -1;
+  }
+
+  // Success
+  return 0;
+}
+
+
+static int sync_pcmfile(encoder_funcs_t *enc, void *fh)
+{
+  pcmfile_handle_t *handle = (pcmfile_handle_t*)fh;
+
+  if (flush_buffer(handle))
+    return -1;
+
+  // Update the header, so other processes can read the file
+  update_header(enc, handle);
+
+  if (handle->aio)
+    return rotter_aio_sync( handle->aio );
+
+  return fdatasync(handle->fd);
+}
+
+
+static int flush_pcmfile(encoder_funcs_t *enc, void *fh)
+{
+  pcmfile_handle_t *handle = (pcmfile_handle_t*)fh;
+
+  if (flush_buffer(handle))
+    return -1;
+
+  update_header(enc, handle);
+
+  if (handle->aio && rotter_aio_flush( handle->aio ))
+    return -1;
+
+  return handle->fd;
+}
+
+
+static int close_pcmfile(encoder_funcs_t *enc, void *fh, struct timeval *file_start)
+{
+  pcmfile_handle_t *handle = (pcmfile_handle_t*)fh;
+  int result = 0;
+
+  if (handle==NULL) return -1;
+
+  rotter_debug("Closing PCM output file.");
+
+  if (flush_buffer(handle))
+    result = -1;
+
+  if (update_header(enc, handle))
+    result = -1;
+
+  if (handle->aio) {
+    // Closed in the background, once the rest of the file has been written
+    if (rotter_aio_close( handle->aio ))
+      result = -1;
+  } else if (close(handle->fd)) {
+    rotter_error( "Failed to close output file: %s", strerror(errno) );
+    result = -1;
+  }
+
+  free(handle->buffer);
+  free(handle);
+
+  return result;
+}
+
+
+// Clear the parts of a header that change from file to file
+static void blank_header(pcmfile_state_t *state, unsigned char *header)
+{
+  switch (state->format) {
+    case ROTTER_PCM_WAV16:
+    case ROTTER_PCM_WAV32:
+      // RIFF or RF64, the JUNK or ds64 chunk and the bext chunk
+      memset( header, 0, 8 + 4 + 8 + PCMFILE_DS64_SIZE + 8 + PCMFILE_BEXT_SIZE );
+      if (state->is_float)
+        memset( header + state->data_offset - 12, 0, 4 );
+      memset( header + state->data_offset - 4, 0, 4 );
+      break;
+    case ROTTER_PCM_AIFF16:
+      memset( header + 4, 0, 4 );
+      memset( header + 22, 0, 4 );
+      memset( header + state->data_offset - 12, 0, 4 );
+      break;
+    case ROTTER_PCM_AU16:
+    case ROTTER_PCM_AU32:
+      memset( header + 8, 0, 4 );
+      break;
+  }
+}
+
+
+/*
+  Carry on from the end of an existing file, if it has the header that
+  we would have written. Otherwise the file is started again.
+  Returns the number of bytes of audio in the file, or -1 if it doesn't match.
+*/
+static int64_t existing_pcmfile(encoder_funcs_t *enc, int fd, unsigned char *header, int *rf64)
+{
+  pcmfile_state_t *state = (pcmfile_state_t*)enc->state;
+  unsigned char existing[PCMFILE_MAX_HEADER];
+  int block_align = enc->channels * state->sample_bytes;
+  struct stat st;
+
+  if (fstat( fd, &st ) || st.st_size < state->data_offset)
+    return -1;
+
+  if (pread( fd, existing, state->data_offset, 0 ) != state->data_offset)
+    return -1;
+
+  *rf64 = !memcmp( existing, "RF64", 4 );
+  if (memcmp( existing, header, 4 ) && !*rf64)
+    return -1;
+
+  blank_header( state, existing );
+  blank_header( state, header );
+  if (memcmp( existing, header, state->data_offset ))
+    return -1;
+
+  // Ignore any partial frame at the end
+  return ((st.st_size - state->data_offset) / block_align) * block_align;
+}
+
+
+static void* open_pcmfile(encoder_funcs_t *enc, const char* filepath, struct timeval *file_start)
+{
+  pcmfile_state_t *state = (pcmfile_state_t*)enc->state;
+  unsigned char header[PCMFILE_MAX_HEADER];
+  pcmfile_handle_t *handle = NULL;
+  int64_t existing = -1;
+
+  handle = calloc( 1, sizeof(pcmfile_handle_t) );
+  if (handle==NULL) {
+    rotter_error( "Failed to allocate memory for output file." );
+    return NULL;
+  }
+
+  rotter_debug("Opening PCM output file: %s", filepath);
+  handle->fd = open( filepath, O_RDWR | O_CREAT, 0666 );
+  if (handle->fd < 0) {
+    rotter_error( "Failed to open output file: %s", strerror(errno) );
+    free(handle);
+    return NULL;
+  }
+
+  build_header( enc, header, file_start );
+
+  // Carry on from where an earlier run of rotter left off
+  existing = existing_pcmfile( enc, handle->fd, header, &handle->rf64 );
+  if (existing >= 0) {
+    rotter_debug("Appending to existing file with %lld bytes of audio.", (long long)existing);
+    handle->data_bytes = existing;
+    handle->header_bytes = existing;
+    if (ftruncate( handle->fd, state->data_offset + existing ) ||
+        lseek( handle->fd, 0, SEEK_END ) < 0)
+    {
+      rotter_error( "Failed to seek to end of file before writing: %s", strerror(errno) );
+    }
+  } else {
+    build_header( enc, header, file_start );
+    handle->rf64 = 0;
+    if (ftruncate( handle->fd, 0 ) ||
+        pwrite( handle->fd, header, state->data_offset, 0 ) != state->data_offset ||
+        lseek( handle->fd, state->data_offset, SEEK_SET ) < 0)
+    {
+      rotter_error( "Failed to write header to output file: %s", strerror(errno) );
+      close( handle->fd );
+      free( handle );
+      return NULL;
+    }
+
+    // Fill in the sizes for an empty file
+    patch_header( enc, handle );
+  }
+
+  if (async_output) {
+    handle->aio = rotter_aio_fdopen( handle->fd, filepath );
+    if (handle->aio == NULL) {
+      close( handle->fd );
+      free( handle );
+      return NULL;
+    }
+  } else if (posix_memalign( (void**)&handle->buffer, AIO_BUFFER_ALIGN, AIO_BUFFER_SIZE )) {
+    rotter_error( "Failed to allocate memory for output file." );
+    close( handle->fd );
+    free( handle );
+    return NULL;
+  }
+
+  return handle;
+}
+
+
+static void deinit_pcmfile(encoder_funcs_t *enc)
+{
+  pcmfile_state_t *state = (pcmfile_state_t*)enc->state;
+
+  rotter_debug("Shutting down PCM writer.");
+
+  if (state) {
+    if (state->buffer)
+      free(state->buffer);
+    free(state);
+  }
+
+  free(enc);
+}
+
+
+encoder_funcs_t* init_pcmfile( output_format_t* format, int channels, int bitrate )
+{
+  unsigned char header[PCMFILE_MAX_HEADER];
+  struct timeval now = {0, 0};
+  encoder_funcs_t* funcs = NULL;
+  pcmfile_state_t* state = NULL;
+
+  // Allocate memory for callback functions
+  funcs = calloc( 1, sizeof(encoder_funcs_t) );
+  if ( funcs==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder callback functions structure." );
+    return NULL;
+  }
+
+  funcs->channels = channels;
+  funcs->samplerate = jack_get_sample_rate( client );
+  funcs->open = open_pcmfile;
+  funcs->close = close_pcmfile;
+  funcs->write = write_pcmfile;
+  funcs->sync = sync_pcmfile;
+  funcs->flush = flush_pcmfile;
+  funcs->deinit = deinit_pcmfile;
+
+  // Allocate memory for encoder state
+  funcs->state = state = calloc( 1, sizeof(pcmfile_state_t) );
+  if ( state==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder state." );
+    deinit_pcmfile(funcs);
+    return NULL;
+  }
+
+  state->format = format->param;
+  rotter_dither_init( &state->dither );
+  switch (state->format) {
+    case ROTTER_PCM_WAV16:
+      funcs->file_suffix = "wav";
+      state->sample_bytes = 2;
+      break;
+    case ROTTER_PCM_WAV32:
+      funcs->file_suffix = "wav";
+      state->sample_bytes = 4;
+      state->is_float = 1;
+      break;
+    case ROTTER_PCM_AIFF16:
+      funcs->file_suffix = "aiff";
+      state->sample_bytes = 2;
+      state->big_endian = 1;
+      break;
+    case ROTTER_PCM_AU16:
+      funcs->file_suffix = "au";
+      state->sample_bytes = 2;
+      state->big_endian = 1;
+      break;
+    case ROTTER_PCM_AU32:
+      funcs->file_suffix = "au";
+      state->sample_bytes = 4;
+      state->is_float = 1;
+      state->big_endian = 1;
+      break;
+    default:
+      rotter_error( "Unknown PCM format for [%s]", format->name );
+      deinit_pcmfile(funcs);
+      return NULL;
+  }
+
+  funcs->bytes_per_second = (double)state->sample_bytes * channels * funcs->samplerate;
+  state->data_offset = build_header( funcs, header, &now );
+
+  rotter_debug( "Writing %s natively.", format->desc );
+  rotter_debug( "  Input: %d Hz, %d channels", funcs->samplerate, channels );
+
+  return funcs;
+}
@@ -33,6 +33,7 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -47,23 +48,37 @@
 int quiet = 0;          // Only display error messages
 int verbose = 0;        // Increase number of logging messages
 int utc = 0;            // Use UTC rather than local time for filenames
-char* file_layout = DEFAULT_FILE_LAYOUT;  // File layout: Flat files or folder hierarchy ?
-char* archive_name = NULL;      // Archive file name
 char* originator = NULL;        // Originator (aka Artist) field value (default is hostname)
-int channels = DEFAULT_CHANNELS;    // Number of input channels
 double vbr_quality = -1;            // VBR quality value (VBR disabled by default)
 float rb_duration = DEFAULT_RB_LEN;   // Duration of ring buffer
-char *root_directory = NULL;      // Root directory of archives
-int delete_hours = DEFAULT_DELETE_HOURS;  // Delete files after this many hours
-long archive_period_seconds = DEFAULT_ARCHIVE_PERIOD_SECONDS;  // Duration of each archive file
+int sync_period = DEFAULT_SYNC_PERIOD;   // How often to sync to disk (in seconds)
+int writer_threads = DEFAULT_WRITER_THREADS;   // Number of threads writing audio to disk
+int period_slots = DEFAULT_PERIOD_SLOTS;       // Number of period slots (ringbuffers) for each stream
+int batch_size = DEFAULT_BATCH_SIZE;           // Number of encoder frames to encode at a time
+sem_t *writer_wakeups = NULL;     // A semaphore for each writer thread, posted when there is work to do
+int use_jack_clock = 0;           // Use the JACK frame clock, rather than the system clock, for period boundaries
+int lookahead_secs = 0;           // How long before a period starts to open its file (0 to disable)
+
+// Encoding one of the formats of a period slot, on a helper thread
+typedef struct rotter_encode_job_s
+{
+  pthread_t thread;
+  sem_t start;                       // Posted when there is audio to encode (or the file is NULL, to stop)
+  sem_t done;                        // Posted once it has been encoded
+  rotter_stream_t *stream;
+  rotter_ringbuffer_t *ringbuffer;
+  rotter_file_t *file;
+  const rotter_framering_vector_t *vec;
+  int vec_count;
+  int result;
+  int running;                       // Flag to indicate that the helper thread was started
+} rotter_encode_job_t;
 
-RotterRunState rotter_run_state = ROTTER_STATE_RUNNING;
-encoder_funcs_t* encoder = NULL;
+static rotter_encode_job_t **encode_jobs = NULL;   // For each writer, a job for each format after the first
+static int encode_helpers = 0;                     // Number of helper threads for each writer
 
-jack_default_audio_sample_t *tmp_buffer[2] = {NULL,NULL};
-rotter_ringbuffer_t *ringbuffers[2] = {NULL,NULL};
+RotterRunState rotter_run_state = ROTTER_STATE_RUNNING;
 
-output_format_t *output_format = NULL;
 output_format_t format_list [] =
 {
 
@@ -75,27 +90,42 @@ output_format_t format_list [] =
   { "mp2",  "MPEG Audio Layer 2", TWOLAME_SAMPLES_PER_FRAME, 0, init_twolame },
 #endif
 
-#ifdef HAVE_SNDFILE
+#ifdef HAVE_OPUSENC
+  { "opus", "Ogg Opus", OPUS_SAMPLES_PER_FRAME, 0, init_opus },
+#endif
+
+  // Written natively, without libsndfile
   { "aiff", "AIFF (Apple/SGI 16 bit PCM)",
-    SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_AIFF | SF_FORMAT_PCM_16, init_sndfile },
-  { "aiff32", "AIFF (Apple/SGI 32 bit float)",
-    SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_AIFF | SF_FORMAT_FLOAT, init_sndfile },
+    PCMFILE_SAMPLES_PER_FRAME, ROTTER_PCM_AIFF16, init_pcmfile },
   { "au",   "AU (Sun/Next 16 bit PCM)",
-    SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_AU   | SF_FORMAT_PCM_16, init_sndfile },
+    PCMFILE_SAMPLES_PER_FRAME, ROTTER_PCM_AU16, init_pcmfile },
   { "au32", "AU (Sun/Next 32 bit float)",
-    SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_AU   | SF_FORMAT_FLOAT, init_sndfile },
+    PCMFILE_SAMPLES_PER_FRAME, ROTTER_PCM_AU32, init_pcmfile },
+  { "wav",  "WAV (Microsoft 16 bit PCM)",
+    PCMFILE_SAMPLES_PER_FRAME, ROTTER_PCM_WAV16, init_pcmfile },
+  { "wav32",  "WAV (Microsoft 32 bit float)",
+    PCMFILE_SAMPLES_PER_FRAME, ROTTER_PCM_WAV32, init_pcmfile },
+
+#ifdef HAVE_FLAC
+  { "flac", "FLAC 16 bit",
+    FLAC_SAMPLES_PER_FRAME, 16, init_flac },
+  { "flac24", "FLAC 24 bit",
+    FLAC_SAMPLES_PER_FRAME, 24, init_flac },
+#endif
+
+#ifdef HAVE_SNDFILE
+  { "aiff32", "AIFF (Apple/SGI 32 bit float)",
+    SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_AIFF | SF_FORMAT_FLOAT, init_sndfile },
   { "caf",  "CAF (Apple 16 bit PCM)",
     SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_CAF  | SF_FORMAT_PCM_16, init_sndfile },
   { "caf32",  "CAF (Apple 32 bit float)",
     SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_CAF  | SF_FORMAT_FLOAT, init_sndfile },
+#ifndef HAVE_FLAC
   { "flac", "FLAC 16 bit",
     SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_FLAC | SF_FORMAT_PCM_16, init_sndfile },
+#endif
   { "vorbis", "Ogg Vorbis",
     SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_OGG  | SF_FORMAT_VORBIS, init_sndfile },
-  { "wav",  "WAV (Microsoft 16 bit PCM)",
-    SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_WAV  | SF_FORMAT_PCM_16, init_sndfile },
-  { "wav32",  "WAV (Microsoft 32 bit float)",
-    SNDFILE_SAMPLES_PER_FRAME, SF_FORMAT_WAV  | SF_FORMAT_FLOAT, init_sndfile },
 #endif
 
   // End of list
@@ -117,6 +147,27 @@ void rotter_termination_handler (int signum)
 
   // Signal the main thead to stop
   rotter_run_state = ROTTER_STATE_QUITING;
+
+  // Wake up the writers so that they notice
+  if (writer_wakeups) {
+    int i;
+    for (i=0; i<writer_threads; i++) {
+      sem_post(&writer_wakeups[i]);
+    }
+  }
+}
+
+
+/*
+  Wake up the writer thread for a period slot.
+  This is called from the JACK callback: sem_post() never blocks
+  and a wakeup is never lost if the writer is still busy.
+*/
+void rotter_wakeup_writer( rotter_ringbuffer_t *ringbuffer )
+{
+  if (ringbuffer->writer_wakeup) {
+    sem_post(ringbuffer->writer_wakeup);
+  }
 }
 
 
@@ -125,28 +176,33 @@ void rotter_log( RotterLogLevel level, const char* fmt, ... )
 {
   time_t t=time(NULL);
   char time_str[32];
+  const char *level_str;
   va_list args;
 
+  if (level == ROTTER_DEBUG && !verbose) return;
+  if (level == ROTTER_INFO && quiet) return;
 
   // Display the message level
   if (level == ROTTER_DEBUG ) {
-    if (!verbose) return;
-    printf( "[DEBUG]  " );
+    level_str = "[DEBUG]  ";
   } else if (level == ROTTER_INFO ) {
-    if (quiet) return;
-    printf( "[INFO]   " );
+    level_str = "[INFO]   ";
   } else if (level == ROTTER_ERROR ) {
-    printf( "[ERROR]  " );
+    level_str = "[ERROR]  ";
   } else if (level == ROTTER_FATAL ) {
-    printf( "[FATAL]  " );
+    level_str = "[FATAL]  ";
   } else {
-    printf( "[UNKNOWN]" );
+    level_str = "[UNKNOWN]";
   }
 
   // Display timestamp
   ctime_r( &t, time_str );
   time_str[strlen(time_str)-1]=0; // remove \n
-  printf( "%s  ", time_str );
+
+  // Don't let messages from different threads get mixed up
+  flockfile( stdout );
+
+  printf( "%s%s  ", level_str, time_str );
 
   // Display the error message
   va_start( args, fmt );
@@ -154,6 +210,8 @@ void rotter_log( RotterLogLevel level, const char* fmt, ... )
   printf( "\n" );
   va_end( args );
 
+  funlockfile( stdout );
+
   // If fatal then stop
   if (level == ROTTER_FATAL) {
     if (rotter_run_state == ROTTER_STATE_RUNNING) {
@@ -167,397 +225,706 @@ void rotter_log( RotterLogLevel level, const char* fmt, ... )
 
 
 
-static int time_to_filepath_flat( struct tm *tm, const char* suffix, char* filepath )
+static int rotter_open_output(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer, rotter_file_t *file)
 {
-  int n;
+  encoder_funcs_t *encoder = file->encoder;
+  const char *file_layout = file->file_layout;
+  char *filepath = file->filepath;
+  char partpath[MAX_FILEPATH_LEN + sizeof(PREPARED_FILE_SUFFIX)];
+  int err = -1;
+  struct tm tm;
 
-  if (archive_name) {
-    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%s-%4.4d-%2.2d-%2.2d-%2.2d.%s",
-                  root_directory, archive_name, tm->tm_year+1900, tm->tm_mon+1,
-                  tm->tm_mday, tm->tm_hour, suffix );
+  if (utc) {
+    gmtime_r( &ringbuffer->file_start.tv_sec, &tm );
   } else {
-    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d-%2.2d-%2.2d-%2.2d.%s",
-                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_hour, suffix );
+    localtime_r( &ringbuffer->file_start.tv_sec, &tm );
   }
 
-  // Was a non-zero length string printed?
-  return n <= 0;
-}
-
+  err = rotter_time_to_filepath( stream->root_directory, stream->archive_name, file_layout, &tm,
+                                 ringbuffer->file_start.tv_usec, encoder->file_suffix, filepath );
 
-static int time_to_filepath_hierarchy( struct tm *tm, const char* suffix, char* filepath )
-{
-  int n;
+  if (err) {
+    rotter_fatal( "%sFailed to build file path for layout: %s", stream->log_prefix, file_layout );
+    return -1;
+  }
 
-  if (archive_name) {
-    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d/%2.2d/%2.2d/%2.2d/%s.%s",
-                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_hour, archive_name, suffix );
-  } else {
-    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d/%2.2d/%2.2d/%2.2d/%s.%s",
-                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_hour, DEFAULT_ARCHIVE_NAME, suffix );
+  // Make sure the parent directory exists
+  if (rotter_mkdir_for_file(filepath)) {
+    rotter_fatal( "Failed to create parent directories for filepath: %s (%s)",
+                  filepath, strerror(errno) );
+    return -1;
   }
 
-  // Was a non-zero length string printed?
-  return n <= 0;
-}
+  // A file opened ahead of time only gets its real name once it is used
+  if (ringbuffer->prepared) {
+    snprintf( partpath, sizeof(partpath), "%s%s", filepath, PREPARED_FILE_SUFFIX );
+    filepath = partpath;
+  }
 
+  // Open the new file
+  rotter_info( "%sOpening new archive file for ringbuffer %c: %s", stream->log_prefix, ringbuffer->label, filepath );
+  file->handle = encoder->open(encoder, filepath, &ringbuffer->file_start);
+
+  if (file->handle) {
+    // Reserve space for the rest of the period
+    if (preallocate && encoder->bytes_per_second > 0) {
+      time_t period_end = ringbuffer->period_start + stream->archive_period_seconds;
+      if (ringbuffer->prepared)
+        period_end = ringbuffer->prepared_period + stream->archive_period_seconds;
+      rotter_preallocate_file( filepath, encoder->bytes_per_second * (period_end - ringbuffer->file_start.tv_sec) );
+    }
 
-static int time_to_filepath_combo( struct tm *tm, const char* suffix, char* filepath )
-{
-  int n;
+    // Nothing has been handed to the disk yet
+    file->writeback_start = 0;
+    file->writeback_end = 0;
+    file->next_datasync = time(NULL) + DATASYNC_PERIOD;
 
-  if (archive_name) {
-    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d/%2.2d/%2.2d/%2.2d/%s-%4.4d-%2.2d-%2.2d-%2.2d.%s",
-                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_hour, archive_name, tm->tm_year+1900, tm->tm_mon+1,
-                  tm->tm_mday, tm->tm_hour, suffix );
+    // Success
+    return 0;
   } else {
-    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d/%2.2d/%2.2d/%2.2d/%4.4d-%2.2d-%2.2d-%2.2d.%s",
-                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_hour, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_hour, suffix );
+    return 1;
   }
-
-  // Was a non-zero length string printed?
-  return n <= 0;
 }
 
 
-static int time_to_filepath_dailydir( struct tm *tm, const char* suffix, char* filepath )
+// Open the file for each of the formats of a period slot, if not already open
+int rotter_open_file(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer)
 {
-  int n;
+  int result = 0;
+  int f;
 
-  if (archive_name) {
-    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d-%2.2d-%2.2d/%s-%4.4d-%2.2d-%2.2d-%2.2d.%s",
-                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  archive_name, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_hour, suffix );
-  } else {
-    n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d-%2.2d-%2.2d/%4.4d-%2.2d-%2.2d-%2.2d.%s",
-                  root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                  tm->tm_hour, suffix );
+  for (f=0; f<ringbuffer->file_count; f++) {
+    if (ringbuffer->files[f].handle == NULL && rotter_open_output(stream, ringbuffer, &ringbuffer->files[f]))
+      result = -1;
   }
 
-  // Was a non-zero length string printed?
-  return n <= 0;
+  return result;
 }
 
 
-static int time_to_filepath_accurate( struct tm *tm, unsigned int usec, const char* suffix, char* filepath )
+// Close each of the files of a period slot
+int rotter_close_file(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer)
 {
-  int n;
+  int f;
+
+  for (f=0; f<ringbuffer->file_count; f++) {
+    rotter_file_t *file = &ringbuffer->files[f];
+    if (file->handle == NULL)
+      continue;
 
-  // Create the full file path
-  n = snprintf( filepath, MAX_FILEPATH_LEN, "%s/%4.4d-%2.2d-%2.2d/%4.4d-%2.2d-%2.2d-%2.2d-%2.2d-%2.2d-%2.2d.%s",
-                root_directory, tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-                tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour,
-                tm->tm_min, tm->tm_sec, (int)(usec / 10000), suffix );
+    rotter_info( "%sClosing %s file for ringbuffer %c.", stream->log_prefix, file->encoder->file_suffix, ringbuffer->label);
+    file->encoder->close(file->encoder, file->handle, &ringbuffer->file_start);
+    file->handle = NULL;
+
+    // Free the space that was reserved but not used, and add it to the
+    // list of files to be deleted once they expire
+    rotter_file_closed(stream, file);
+  }
 
-  // Was a non-zero length string printed?
-  return n <= 0;
+  return 0;
 }
 
 
-static int time_to_filepath_custom( struct tm *tm, char * file_layout, char* filepath )
+// Close and remove the files that were opened ahead of time but never used
+void rotter_discard_file(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer)
 {
-  size_t len;
+  char partpath[MAX_FILEPATH_LEN + sizeof(PREPARED_FILE_SUFFIX)];
+  int f;
 
-  // Copy root directory path and separator into new filepath
-  if (snprintf( filepath, MAX_FILEPATH_LEN, "%s/", root_directory ) <= 0)
-    return 1;
+  ringbuffer->prepared = 0;
 
-  // Get the length of the root directory
-  len = strlen(filepath);
+  for (f=0; f<ringbuffer->file_count; f++) {
+    rotter_file_t *file = &ringbuffer->files[f];
+    encoder_funcs_t *encoder = file->encoder;
+    if (file->handle == NULL)
+      continue;
 
-  // Append custom filepath to end of the root directory path
-  // Ensure custom filepath is constructed OK by checking number of characters appended
-  // This also catches the possible error that an empty format string has been supplied
-  if(strftime( filepath + len, MAX_FILEPATH_LEN - len, file_layout, tm ) <= 0)
-    return 1;
+    snprintf( partpath, sizeof(partpath), "%s%s", file->filepath, PREPARED_FILE_SUFFIX );
+    rotter_info( "%sDiscarding unused file for ringbuffer %c: %s", stream->log_prefix, ringbuffer->label, partpath);
+    encoder->close(encoder, file->handle, &ringbuffer->file_start);
+    file->handle = NULL;
 
-  // Success
-  return 0;
+    if (unlink(partpath)) {
+      rotter_error( "%sFailed to delete unused file %s: %s", stream->log_prefix, partpath, strerror(errno) );
+    }
+
+    // The encoder may have been flushed by close
+    if (encoder->reset && encoder->reset( encoder )) {
+      rotter_fatal( "%sFailed to reset encoder for ringbuffer %c.", stream->log_prefix, ringbuffer->label );
+    }
+  }
 }
 
 
-static int rotter_open_file(rotter_ringbuffer_t *ringbuffer)
+// Give the files that were opened ahead of time their real names, now that their period has started
+static void rotter_claim_file(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer)
 {
-  char filepath[MAX_FILEPATH_LEN];
-  int err = -1;
-  struct tm tm;
+  char partpath[MAX_FILEPATH_LEN + sizeof(PREPARED_FILE_SUFFIX)];
+  int f;
 
-  if (utc) {
-    gmtime_r( &ringbuffer->file_start.tv_sec, &tm );
-  } else {
-    localtime_r( &ringbuffer->file_start.tv_sec, &tm );
-  }
+  for (f=0; f<ringbuffer->file_count; f++) {
+    rotter_file_t *file = &ringbuffer->files[f];
+    if (file->handle == NULL)
+      continue;
 
-  if (!strcasecmp(file_layout, "hierarchy")) {
-    err = time_to_filepath_hierarchy( &tm, encoder->file_suffix, filepath );
-  } else if (!strcasecmp(file_layout, "flat")) {
-    err = time_to_filepath_flat( &tm, encoder->file_suffix, filepath );
-  } else if (!strcasecmp(file_layout, "combo")) {
-    err = time_to_filepath_combo( &tm, encoder->file_suffix, filepath );
-  } else if (!strcasecmp(file_layout, "dailydir")) {
-    err = time_to_filepath_dailydir( &tm, encoder->file_suffix, filepath );
-  } else if (!strcasecmp(file_layout, "accurate")) {
-    err = time_to_filepath_accurate( &tm, ringbuffer->file_start.tv_usec, encoder->file_suffix, filepath );
-  } else {
-    err = time_to_filepath_custom( &tm, file_layout, filepath );
+    snprintf( partpath, sizeof(partpath), "%s%s", file->filepath, PREPARED_FILE_SUFFIX );
+    if (rename(partpath, file->filepath)) {
+      rotter_error( "%sFailed to rename %s: %s", stream->log_prefix, partpath, strerror(errno) );
+    }
   }
+  ringbuffer->prepared = 0;
+}
 
-  if (err) {
-    rotter_fatal( "Failed to build file path for layout: %s", file_layout );
-    return -1;
-  }
 
-  // Make sure the parent directory exists
-  if (rotter_mkdir_for_file(filepath)) {
-    rotter_fatal( "Failed to create parent directories for filepath: %s (%s)",
-                  filepath, strerror(errno) );
-    return -1;
+/*
+  Encode blocks of interleaved audio into one of the files of a period slot,
+  opening it first if needed. Every block is written, even if an earlier one
+  failed, so that a single error doesn't lose the rest of the read.
+*/
+static int rotter_write_file(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer, rotter_file_t *file,
+                             const rotter_framering_vector_t *vec, int vec_count)
+{
+  encoder_funcs_t *encoder = file->encoder;
+  int result = 0;
+  int v;
+
+  // Open a new file?
+  if (file->handle == NULL) {
+    if (rotter_open_output(stream, ringbuffer, file)) {
+      rotter_error("%sFailed to open file.", stream->log_prefix);
+      return -1;
+    }
   }
 
-  // Open the new file
-  rotter_info( "Opening new archive file for ringbuffer %c: %s", ringbuffer->label, filepath );
-  ringbuffer->file_handle = encoder->open(filepath, &ringbuffer->file_start);
-
-  if (ringbuffer->file_handle) {
-    // Success
-    return 0;
-  } else {
-    return 1;
+  // Write some audio to disk
+  for (v=0; v<vec_count; v++) {
+    if (vec[v].frames == 0)
+      continue;
+    if (encoder->write(encoder, file->handle, vec[v].frames, vec[v].buf)) {
+      rotter_error("%sAn error occured while trying to write audio to disk.", stream->log_prefix);
+      result = -1;
+    }
   }
+
+  return result;
 }
 
 
-static int rotter_close_file(rotter_ringbuffer_t *ringbuffer)
+// Encode the other formats of a slot on helper threads, while the writer does the first
+static void* rotter_encode_thread(void *arg)
 {
-  rotter_info( "Closing file for ringbuffer %c.", ringbuffer->label);
-  encoder->close(ringbuffer->file_handle, &ringbuffer->file_start);
-  ringbuffer->close_file = 0;
-  ringbuffer->file_handle = NULL;
-  return 0;
+  rotter_encode_job_t *job = (rotter_encode_job_t*)arg;
+
+  while (1) {
+    while (sem_wait(&job->start) && errno == EINTR);
+    if (job->file == NULL)
+      break;
+
+    job->result = rotter_write_file(job->stream, job->ringbuffer, job->file, job->vec, job->vec_count);
+    sem_post(&job->done);
+  }
+
+  return NULL;
 }
 
 
-static size_t rotter_read_from_ringbuffer(rotter_ringbuffer_t *ringbuffer, size_t desired_frames)
+// Encode some interleaved audio into every format of a period slot
+static int rotter_write_frames(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer,
+                               const rotter_framering_vector_t *vec, int vec_count)
 {
-  size_t desired_bytes = desired_frames * sizeof(jack_default_audio_sample_t);
-  size_t available_bytes = 0;
-  int c, bytes_read = 0;
-
-  // Is there enough in the ring buffers?
-  for (c=0; c<channels; c++) {
-    available_bytes = jack_ringbuffer_read_space( ringbuffer->buffer[c] );
-    if (available_bytes <= 0) {
-      // Try again later
-      return 0;
+  rotter_encode_job_t *jobs = encode_jobs ? encode_jobs[ringbuffer->writer] : NULL;
+  size_t frames = 0;
+  int result = 0;
+  int f, v;
+
+  for (v=0; v<vec_count; v++)
+    frames += vec[v].frames;
+  if (frames == 0)
+    return 0;
+
+  // Were the files opened ahead of time?
+  if (ringbuffer->prepared) {
+    if (ringbuffer->prepared_period == ringbuffer->period_start) {
+      rotter_claim_file(stream, ringbuffer);
+    } else {
+      rotter_discard_file(stream, ringbuffer);
     }
   }
 
-  if (available_bytes > desired_bytes)
-    available_bytes = desired_bytes;
+  // All of the formats are given the same read of the ring
+  for (f=1; f<ringbuffer->file_count; f++) {
+    rotter_encode_job_t *job = &jobs[f-1];
+    job->stream = stream;
+    job->ringbuffer = ringbuffer;
+    job->file = &ringbuffer->files[f];
+    job->vec = vec;
+    job->vec_count = vec_count;
+    sem_post(&job->start);
+  }
 
-  // Get the audio out of the ring buffer
-  for (c=0; c<channels; c++) {
-    // Copy frames from ring buffer to temporary buffer
-    bytes_read = jack_ringbuffer_read( ringbuffer->buffer[c], (char*)tmp_buffer[c], available_bytes);
-    if (bytes_read != available_bytes) {
-      rotter_fatal( "Failed to read from ringbuffer %c channel %d.", ringbuffer->label, c);
-      return 0;
-    }
+  result = rotter_write_file(stream, ringbuffer, &ringbuffer->files[0], vec, vec_count);
+
+  for (f=1; f<ringbuffer->file_count; f++) {
+    rotter_encode_job_t *job = &jobs[f-1];
+    while (sem_wait(&job->done) && errno == EINTR);
+    if (job->result)
+      result = -1;
   }
 
-  return bytes_read / sizeof(jack_default_audio_sample_t);
+  return result;
 }
 
 
-static int rotter_process_audio()
+/*
+  Pass up to 'desired_frames' frames from a ringbuffer to the encoder.
+  The encoder reads directly from the ring, which is only released
+  once the audio has been encoded.
+  Returns the number of frames read, or -1 on error.
+*/
+static long rotter_write_from_ringbuffer(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer, size_t desired_frames)
 {
-  int total_samples = 0;
+  rotter_framering_t *ring = ringbuffer->ring;
+  rotter_framering_vector_t vec[2];
+  size_t frames;
   int result;
-  int b;
-
-  for(b=0; b<2; b++) {
-    rotter_ringbuffer_t *ringbuffer = ringbuffers[b];
-    int samples = 0;
 
-    // Has there been a ringbuffer overflow?
-    if (ringbuffer->overflow) {
-      rotter_error( "Ringbuffer %c overflowed while writing audio.", ringbuffer->label);
-      ringbuffer->overflow = 0;
+  if (ringbuffer->spool) {
+    // The spill thread may also be taking audio from the ringbuffer,
+    // so audio has to be copied out of it while holding the lock.
+    // Audio that was spilled to disk is older, so must be written first.
+    pthread_mutex_lock( &ringbuffer->consumer_lock );
+    if (rotter_framering_read_space( ringbuffer->spool ) == 0) {
+      frames = rotter_framering_read( ring, ringbuffer->tmp_buffer, desired_frames );
+      pthread_mutex_unlock( &ringbuffer->consumer_lock );
+      vec[0].buf = ringbuffer->tmp_buffer;
+      vec[0].frames = frames;
+      if (rotter_write_frames( stream, ringbuffer, vec, 1 ))
+        return -1;
+      return frames;
     }
+    pthread_mutex_unlock( &ringbuffer->consumer_lock );
 
-    // Has there been a jackd xrun?
-    if (ringbuffer->xrun_usecs) {
-      rotter_error( "jackd experienced a %d microsecond buffer xrun.", ringbuffer->xrun_usecs);
-      ringbuffer->xrun_usecs = 0;
-    }
+    // The writer is the only reader of the spool
+    ring = ringbuffer->spool;
+  }
 
-    // Read some audio from the buffer
-    samples = rotter_read_from_ringbuffer( ringbuffer, output_format->samples_per_frame );
-    if (samples > 0) {
-      total_samples += samples;
+  // Both halves of the read go to every format in one pass, so that a failure
+  // in one format doesn't stop the others from getting all of the audio
+  frames = rotter_framering_get_read_vector( ring, vec, desired_frames );
+  result = rotter_write_frames( stream, ringbuffer, vec, 2 );
+  rotter_framering_read_advance( ring, frames );
 
-      // Open a new file?
-      if (ringbuffer->file_handle == NULL) {
-        result = rotter_open_file(ringbuffer);
-        if (result) {
-          rotter_error("Failed to open file.");
-          break;
-        }
-      }
+  return result ? -1 : (long)frames;
+}
+
+
+// Number of frames waiting to be encoded, in a ringbuffer and its spool
+static size_t rotter_ringbuffer_buffered(rotter_ringbuffer_t *ringbuffer)
+{
+  size_t frames = rotter_framering_read_space( ringbuffer->ring );
+  if (ringbuffer->spool)
+    frames += rotter_framering_read_space( ringbuffer->spool );
+  return frames;
+}
 
-      // Write some audio to disk
-      result = encoder->write(ringbuffer->file_handle, samples, tmp_buffer);
-      if (result) {
-        rotter_error("An error occured while trying to write audio to disk.");
-        break;
-      }
-    }
 
-    // Close the old file
-    if (samples <= 0 && ringbuffer->close_file) {
-      rotter_close_file(ringbuffer);
+// Encode audio from a period slot, and hand it to the I/O stage once drained
+static int rotter_process_audio(rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer)
+{
+  int state = __atomic_load_n( &ringbuffer->state, __ATOMIC_ACQUIRE );
+  long samples = 0;
+
+  // Nothing to do for slots that the JACK callback hasn't filled
+  if (state != ROTTER_SLOT_FILLING && state != ROTTER_SLOT_DRAINING)
+    return 0;
+
+  // Has there been a ringbuffer overflow?
+  if (ringbuffer->overflow) {
+    rotter_error( "%sRingbuffer %c overflowed while writing audio.", stream->log_prefix, ringbuffer->label);
+    ringbuffer->overflow = 0;
+  }
 
-      // Delete files older delete_hours
-      if (delete_hours>0)
-        deletefiles( root_directory, delete_hours );
+  // Has there been a jackd xrun?
+  if (ringbuffer->xrun_usecs) {
+    rotter_error( "%sjackd experienced a %d microsecond buffer xrun.", stream->log_prefix, ringbuffer->xrun_usecs);
+    ringbuffer->xrun_usecs = 0;
+  }
+
+  // Encode a batch of audio from the buffer
+  // (or whatever is left, once the period has ended)
+  if (state == ROTTER_SLOT_DRAINING || rotter_ringbuffer_buffered( ringbuffer ) >= stream->batch_frames) {
+    samples = rotter_write_from_ringbuffer( stream, ringbuffer, stream->batch_frames );
+    if (samples < 0) {
+      return 0;
     }
+  }
 
-  } // for(b=0..2)
+  // The period has ended and all of its audio has been written:
+  // hand the file over to the I/O stage to be closed, while we carry
+  // on with the next period. The I/O stage gives the slot back to
+  // the JACK callback.
+  if (samples == 0 && state == ROTTER_SLOT_DRAINING) {
+    __atomic_store_n( &ringbuffer->state, ROTTER_SLOT_CLOSING, __ATOMIC_RELAXED );
+    rotter_io_close_file( ringbuffer );
+  }
 
-  return total_samples;
+  return samples;
 }
 
-static void rotter_sync_to_disk()
+static void rotter_sync_to_disk(rotter_ringbuffer_t *ringbuffer, time_t now)
 {
-  int b;
+  int state = __atomic_load_n( &ringbuffer->state, __ATOMIC_ACQUIRE );
+  struct timespec start, end;
+  int f;
 
-  for(b=0; b<2; b++) {
-    rotter_ringbuffer_t *ringbuffer = ringbuffers[b];
-    if (ringbuffer && ringbuffer->file_handle) {
-      encoder->sync(ringbuffer->file_handle);
+  // Files in other states belong to the I/O stage
+  if (state != ROTTER_SLOT_FILLING && state != ROTTER_SLOT_DRAINING)
+    return;
+
+  for (f=0; f<ringbuffer->file_count; f++) {
+    rotter_file_t *file = &ringbuffer->files[f];
+    encoder_funcs_t *encoder = file->encoder;
+
+    if (file->handle == NULL)
+      continue;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (incremental_writeback && encoder->flush && now < file->next_datasync) {
+      // Hand the new audio to the disk, without waiting for it
+      int fd = encoder->flush(encoder, file->handle);
+      if (fd >= 0)
+        rotter_writeback_file(file, fd);
+    } else {
+      encoder->sync(encoder, file->handle);
+      file->next_datasync = now + DATASYNC_PERIOD;
     }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    rotter_sync_stats_add((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
   }
 }
 
-static int init_ringbuffers()
+static int init_ringbuffers(rotter_stream_t *stream, int stream_index)
 {
-  size_t ringbuffer_size = 0;
-  int b,c;
+  size_t ringbuffer_frames = 0;
+  int b, f, g;
 
-  ringbuffer_size = jack_get_sample_rate( client ) * rb_duration * sizeof(jack_default_audio_sample_t);
-  rotter_debug("Size of the ring buffers is %2.2f seconds (%d bytes).", rb_duration, (int)ringbuffer_size );
+  ringbuffer_frames = jack_get_sample_rate( client ) * rb_duration;
+  rotter_debug("%sSize of the ring buffers is %2.2f seconds (%d frames), with %d period slots.",
+               stream->log_prefix, rb_duration, (int)ringbuffer_frames, period_slots );
 
-  for(b=0; b<2; b++) {
+  stream->ringbuffers = calloc(period_slots, sizeof(rotter_ringbuffer_t*));
+  if (!stream->ringbuffers) {
+    rotter_fatal("Cannot allocate memory for list of ringbuffers.");
+    return -1;
+  }
+  stream->ringbuffer_count = period_slots;
+
+  for(b=0; b<stream->ringbuffer_count; b++) {
     char label = ('A' + b);
-    ringbuffers[b] = malloc(sizeof(rotter_ringbuffer_t));
-    if (!ringbuffers[b]) {
+    rotter_ringbuffer_t *ringbuffer = calloc(1, sizeof(rotter_ringbuffer_t));
+    if (!ringbuffer) {
       rotter_fatal("Cannot allocate memory for ringbuffer %c structure.", label);
       return -1;
     }
+    stream->ringbuffers[b] = ringbuffer;
 
-    if (mlock(ringbuffers[b], sizeof(rotter_ringbuffer_t))) {
+    if (mlock(ringbuffer, sizeof(rotter_ringbuffer_t))) {
       rotter_error("Failed to lock data structure for ringbuffer %c into physical memory.", label);
     }
 
-    ringbuffers[b]->label = label;
-    ringbuffers[b]->period_start = 0;
-    ringbuffers[b]->file_handle = NULL;
-    ringbuffers[b]->overflow = 0;
-    ringbuffers[b]->xrun_usecs = 0;
-    ringbuffers[b]->close_file = 0;
-    ringbuffers[b]->buffer[0] = NULL;
-    ringbuffers[b]->buffer[1] = NULL;
+    ringbuffer->label = label;
+    ringbuffer->stream = stream;
+    ringbuffer->state = ROTTER_SLOT_FREE;
+    ringbuffer->writer = (stream_index * period_slots + b) % writer_threads;
+    ringbuffer->writer_wakeup = &writer_wakeups[ringbuffer->writer];
+    pthread_mutex_init(&ringbuffer->consumer_lock, NULL);
+    ringbuffer->ring = rotter_framering_create( stream->channels, ringbuffer_frames );
+    if (!ringbuffer->ring) {
+      rotter_fatal("Cannot create ringbuffer %c.", label);
+      return -1;
+    }
+
+    // Lock into physical memory to avoid delays during the realtime callback
+    if (rotter_framering_mlock(ringbuffer->ring)) {
+      rotter_error("Failed to lock ringbuffer %c into physical memory.", label);
+    }
 
-    for(c=0; c<channels; c++) {
-      ringbuffers[b]->buffer[c] = jack_ringbuffer_create( ringbuffer_size );
-      if (!ringbuffers[b]->buffer[c]) {
-        rotter_fatal("Cannot create ringbuffer buffer %c%d.", label, c);
+    // Create a spool on disk, in case the writer falls behind,
+    // and a buffer for copying audio out of the ringbuffer while spilling
+    if (spool_dir) {
+      if (rotter_spool_create(stream, ringbuffer)) {
         return -1;
       }
 
-      // Lock into physical memory to avoid delays during the realtime callback
-      if (jack_ringbuffer_mlock(ringbuffers[b]->buffer[c])) {
-        rotter_error("Failed to lock JACK ringbuffer %c%d into physical memory.", label, c);
+      ringbuffer->tmp_buffer = calloc( stream->batch_frames * stream->channels, sizeof(jack_default_audio_sample_t) );
+      if (!ringbuffer->tmp_buffer) {
+        rotter_fatal("Failed to allocate memory for temporary buffer %c.", label);
+        return -1;
+      }
+    }
+
+    // Each period slot has its own encoders, so that the end of one
+    // period and the start of the next never share encoder state
+    for (f=0; f<stream->output_count; f++) {
+      output_format_t *format = stream->output_formats[f];
+      rotter_file_t *file = &ringbuffer->files[f];
+
+      file->file_layout = stream->file_layouts[f];
+      file->encoder = format->initfunc(format, stream->channels, stream->bitrate);
+      if (file->encoder==NULL) {
+        rotter_debug("%sFailed to initialise %s encoder for ringbuffer %c.", stream->log_prefix, format->name, label);
+        return -1;
+      }
+      file->encoder->period_seconds = stream->archive_period_seconds;
+      ringbuffer->file_count++;
+    }
+  }
+
+  // Different formats mustn't end up writing to the same files
+  for (f=0; f<stream->output_count; f++) {
+    rotter_file_t *file = &stream->ringbuffers[0]->files[f];
+    for (g=0; g<f; g++) {
+      rotter_file_t *other = &stream->ringbuffers[0]->files[g];
+      if (!strcmp(file->file_layout, other->file_layout) &&
+          (!rotter_is_named_layout(file->file_layout) ||
+           !strcmp(file->encoder->file_suffix, other->encoder->file_suffix)))
+      {
+        rotter_fatal("%sFormats [%s] and [%s] would be written to the same files; give each one a file layout with -L.",
+                     stream->log_prefix, stream->output_formats[g]->name, stream->output_formats[f]->name);
+        return -1;
       }
     }
   }
 
+  // The callback starts with the last slot, so the first period goes in slot A
+  stream->active_index = stream->ringbuffer_count - 1;
+
   return 0;
 }
 
-static int deinit_ringbuffers()
+static int deinit_ringbuffers(rotter_stream_t *stream)
 {
-  int b,c;
+  int b, f;
 
-  for(b=0; b<2; b++) {
-    if (ringbuffers[b]) {
-      for(c=0;c<2;c++) {
-        if (ringbuffers[b]->buffer[c]) {
-          jack_ringbuffer_free(ringbuffers[b]->buffer[c]);
-        }
+  if (stream->ringbuffers == NULL)
+    return 0;
+
+  for(b=0; b<stream->ringbuffer_count; b++) {
+    rotter_ringbuffer_t *ringbuffer = stream->ringbuffers[b];
+    if (ringbuffer) {
+      if (ringbuffer->ring) {
+        rotter_framering_free(ringbuffer->ring);
+      }
+
+      if (ringbuffer->spool) {
+        rotter_framering_free(ringbuffer->spool);
+      }
+      pthread_mutex_destroy(&ringbuffer->consumer_lock);
+
+      if (munlock(ringbuffer, sizeof(rotter_ringbuffer_t))) {
+        rotter_error("Failed to unlock ringbuffer %c from physical memory.", ringbuffer->label);
+      }
+
+      if (ringbuffer->prepared) {
+        // Opened ahead of a period that never started
+        rotter_discard_file(stream, ringbuffer);
+      } else {
+        rotter_close_file(stream, ringbuffer);
       }
 
-      if (munlock(ringbuffers[b], sizeof(rotter_ringbuffer_t))) {
-        rotter_error("Failed to unlock ringbuffer %c from physical memory.", ringbuffers[b]->label);
+      // Shut down encoders
+      for (f=0; f<ringbuffer->file_count; f++) {
+        ringbuffer->files[f].encoder->deinit(ringbuffer->files[f].encoder);
       }
 
-      if (ringbuffers[b]->file_handle) {
-        rotter_close_file(ringbuffers[b]);
-        ringbuffers[b]->file_handle = NULL;
+      if (ringbuffer->tmp_buffer) {
+        free(ringbuffer->tmp_buffer);
       }
 
-      free(ringbuffers[b]);
+      free(ringbuffer);
+      stream->ringbuffers[b] = NULL;
     }
   }
 
+  free(stream->ringbuffers);
+  stream->ringbuffers = NULL;
+  stream->ringbuffer_count = 0;
+
   return 0;
 }
 
-static int init_tmpbuffers(int sample_count)
+// Create the ports, buffers and encoder for a stream
+static int init_stream(rotter_stream_t *stream, int stream_index)
 {
-  size_t buffer_size = sample_count * sizeof(jack_default_audio_sample_t);
-  int c;
+  int f;
 
-  for(c=0; c<2; c++) {
-    tmp_buffer[c] = (jack_default_audio_sample_t*)malloc(buffer_size);
-    if (!tmp_buffer[c]) {
-      rotter_fatal( "Failed to allocate memory for temporary buffer %d", c);
-      return -1;
-    }
+  // Encode whole batches of encoder frames (of the format with the largest frames)
+  stream->batch_frames = 0;
+  for (f=0; f<stream->output_count; f++) {
+    if (stream->output_formats[f]->samples_per_frame * batch_size > stream->batch_frames)
+      stream->batch_frames = stream->output_formats[f]->samples_per_frame * batch_size;
+  }
+  if (stream->batch_frames > jack_get_sample_rate( client ) * rb_duration / 2) {
+    rotter_fatal("%sBatch of %d frames is too big for the ring buffer; reduce -B or increase -R.",
+                 stream->log_prefix, (int)stream->batch_frames);
+    return -1;
+  }
+
+  // Create JACK input ports
+  if (register_jack_ports(stream)) {
+    rotter_debug("%sFailed to register JACK ports.", stream->log_prefix);
+    return -1;
+  }
+
+  // Create ring buffers and their encoders
+  if (init_ringbuffers(stream, stream_index)) {
+    rotter_debug("%sFailed to initialise ring buffers.", stream->log_prefix);
+    return -1;
   }
 
   return 0;
 }
 
-static int deinit_tmpbuffers()
+// Close files and free the buffers and encoders for a stream
+static void deinit_stream(rotter_stream_t *stream)
+{
+  deinit_ringbuffers(stream);
+}
+
+// Connect a stream's input ports
+static void connect_stream(rotter_stream_t *stream)
+{
+  if (stream->autoconnect) autoconnect_jack_ports( client, stream );
+  if (stream->connect_left) connect_jack_port( stream->connect_left, stream->inport[0] );
+  if (stream->connect_right && stream->channels >= 2) connect_jack_port( stream->connect_right, stream->inport[1] );
+}
+
+/*
+  Write audio to disk for a share of the period slots.
+  Writer 'index' looks after every slot that was given that index in
+  init_ringbuffers(). Consecutive slots of a stream go to different
+  writers, so the end of one period and the start of the next can be
+  encoded at the same time.
+*/
+static void rotter_writer_loop(long index)
+{
+  while( rotter_run_state == ROTTER_STATE_RUNNING ) {
+    time_t now = time(NULL);
+    int samples_processed = 0;
+    int s, b;
+
+    for (s=0; s<stream_count; s++) {
+      rotter_stream_t *stream = streams[s];
+
+      for (b=0; b<stream->ringbuffer_count; b++) {
+        rotter_ringbuffer_t *ringbuffer = stream->ringbuffers[b];
+        if (ringbuffer->writer != index)
+          continue;
+
+        samples_processed += rotter_process_audio(stream, ringbuffer);
+
+        // Is it time to sync the encoded audio to disk?
+        if (ringbuffer->next_sync < now) {
+          rotter_sync_to_disk(ringbuffer, now);
+          ringbuffer->next_sync = now + sync_period;
+        }
+      }
+    }
+
+    // Sleep until the JACK callback has some work for us
+    // (or it is time to sync)
+    if (samples_processed <= 0) {
+      struct timespec timeout;
+      clock_gettime(CLOCK_REALTIME, &timeout);
+      timeout.tv_sec += MAX_WRITER_SLEEP;
+      while (sem_timedwait(&writer_wakeups[index], &timeout) && errno == EINTR);
+    }
+  }
+}
+
+static void* rotter_writer_thread(void *arg)
 {
-  int c;
+  rotter_writer_loop((long)arg);
+  return NULL;
+}
 
-  for(c=0; c<2; c++) {
-    if (tmp_buffer[c])
-      free(tmp_buffer[c]);
+/*
+  Start a helper thread for each writer and each extra format, so that
+  a stream recorded in several formats is encoded in all of them at once
+*/
+static int start_encode_helpers()
+{
+  int max_outputs = 1;
+  int s, w, h;
+
+  for (s=0; s<stream_count; s++) {
+    if (streams[s]->output_count > max_outputs)
+      max_outputs = streams[s]->output_count;
+  }
+
+  encode_helpers = max_outputs - 1;
+  if (encode_helpers == 0)
+    return 0;
+
+  encode_jobs = calloc( writer_threads, sizeof(rotter_encode_job_t*) );
+  if (encode_jobs == NULL) {
+    rotter_fatal("Failed to allocate memory for encoder threads.");
+    return -1;
   }
 
+  for (w=0; w<writer_threads; w++) {
+    encode_jobs[w] = calloc( encode_helpers, sizeof(rotter_encode_job_t) );
+    if (encode_jobs[w] == NULL) {
+      rotter_fatal("Failed to allocate memory for encoder threads.");
+      return -1;
+    }
+
+    for (h=0; h<encode_helpers; h++) {
+      rotter_encode_job_t *job = &encode_jobs[w][h];
+      sem_init(&job->start, 0, 0);
+      sem_init(&job->done, 0, 0);
+      if (pthread_create(&job->thread, NULL, rotter_encode_thread, job)) {
+        rotter_fatal("Failed to start encoder thread.");
+        return -1;
+      }
+      job->running = 1;
+    }
+  }
+
+  rotter_debug("Started %d encoder threads for each writer.", encode_helpers);
+
   return 0;
 }
 
-static char* rotter_str_tolower( char* str )
+// Stop the encoder helper threads, once the writers have stopped
+static void stop_encode_helpers()
 {
-  int i=0;
+  int w, h;
 
-  for(i=0; i< strlen( str ); i++) {
-    str[i] = tolower( str[i] );
+  if (encode_jobs == NULL)
+    return;
+
+  for (w=0; w<writer_threads; w++) {
+    if (encode_jobs[w] == NULL)
+      continue;
+
+    for (h=0; h<encode_helpers; h++) {
+      rotter_encode_job_t *job = &encode_jobs[w][h];
+      if (job->running) {
+        job->file = NULL;
+        sem_post(&job->start);
+        pthread_join(job->thread, NULL);
+      }
+      sem_destroy(&job->start);
+      sem_destroy(&job->done);
+    }
+    free(encode_jobs[w]);
   }
 
-  return str;
+  free(encode_jobs);
+  encode_jobs = NULL;
 }
 
 // Display how to use this program
@@ -567,21 +934,39 @@ static void usage()
 
   printf("%s version %s\n\n", PACKAGE_NAME, PACKAGE_VERSION);
   printf("Usage: %s [options] <root_directory>\n", PACKAGE_NAME);
+  printf("       %s [options] -S <stations_file>\n", PACKAGE_NAME);
   printf("   -a            Automatically connect JACK ports\n");
   printf("   -l <port>     Connect the left input to this port\n");
   printf("   -r <port>     Connect the right input to this port\n");
-  printf("   -f <format>   Format of recording (see list below)\n");
+  printf("   -f <format>   Format of recording (see list below); several may be given, separated by commas\n");
   printf("   -b <bitrate>  Bitrate of recording (bitstream formats only)\n");
   printf("   -V <quality>  VBR quality, for formats that support it (0 lowest, 10 highest)\n");
   printf("   -c <channels> Number of channels\n");
+  printf("   -C <level>    FLAC compression level (0 fastest, %d smallest, default %d)\n", MAX_FLAC_COMPRESSION, DEFAULT_FLAC_COMPRESSION);
+  printf("   -T <threads>  Number of threads to encode each FLAC file with (default 1)\n");
+  printf("   -D            Dither audio when reducing it to 16 bits\n");
   printf("   -n <name>     Name for this JACK client (default '%s')\n", DEFAULT_CLIENT_NAME);
   printf("   -N <filename> Name for archive files (default '%s')\n", DEFAULT_ARCHIVE_NAME);
   printf("   -O <name>     Originator (artist) name for metadata (default is hostname)\n");
   printf("   -p <secs>     Period of each archive file (in seconds, default %d)\n", DEFAULT_ARCHIVE_PERIOD_SECONDS);
   printf("   -d <hours>    Delete files in directory older than this\n");
+  printf("   -m <high>[:<low>] Delete the oldest files when the filesystem is fuller than this (percent)\n");
+  printf("   -z <high>[:<low>] Delete the oldest files when the archive is bigger than this (e.g. 500G)\n");
   printf("   -R <secs>     Length of the ring buffer (in seconds, default %2.2f)\n", DEFAULT_RB_LEN);
-  printf("   -L <layout>   File layout (default '%s')\n", DEFAULT_FILE_LAYOUT);
+  printf("   -X <dir>      Spill audio to disk in this directory, if writing falls behind\n");
+  printf("   -x <secs>     Length of each spool on disk (in seconds, default %2.0f)\n", DEFAULT_SPOOL_LEN);
+  printf("   -B <frames>   Number of encoder frames to encode at a time (default %d)\n", DEFAULT_BATCH_SIZE);
+  printf("   -P <secs>     Open each archive file this long before its period starts (default off)\n");
+  printf("   -K <slots>    Number of ring buffers for consecutive periods (default %d)\n", DEFAULT_PERIOD_SLOTS);
+  printf("   -L <layout>   File layout (default '%s'); may be given once for each format\n", DEFAULT_FILE_LAYOUT);
   printf("   -s <secs>     How often to sync to disk (in seconds, default %d)\n", DEFAULT_SYNC_PERIOD);
+  printf("   -t <clock>    Clock for archive period boundaries: system or jack (default system)\n");
+  printf("   -S <file>     Record several stations, listed in this file\n");
+  printf("   -w <threads>  Number of threads writing audio to disk (default %d)\n", DEFAULT_WRITER_THREADS);
+  printf("   -W            Write audio out to disk as it arrives, rather than syncing every -s seconds\n");
+  printf("   -F            Preallocate disk space for each archive file\n");
+  printf("   -A            Write archive files asynchronously, without waiting for the disk\n");
+  printf("   -I            Write a seek index next to each MPEG Audio file\n");
   printf("   -j            Don't automatically start jackd\n");
   printf("   -u            Use UTC rather than local time in filenames\n");
   printf("   -v            Enable verbose mode\n");
@@ -596,6 +981,10 @@ static void usage()
   printf("\n");
   printf("A custom file layout may be specified using a strftime-style format string,\n");
   printf("for example: -L \"%%Y-%%m-%%d/studio-1/%%H%%M.flac\"\n");
+  printf("\n");
+  printf("Each line of a stations file has a station name, followed by any of the\n");
+  printf("options -a -l -r -f -b -c -N -L -p -d -m -z and then the root directory:\n");
+  printf("   studio1 -c 2 -f mp3 -l system:capture_1 -r system:capture_2 /srv/archive/studio1\n");
 
   // Display the available audio output formats
   printf("\nSupported audio output formats:\n");
@@ -613,44 +1002,55 @@ static void usage()
 
 int main(int argc, char *argv[])
 {
-  int autoconnect = 0;
   jack_options_t jack_opt = JackNullOption;
   char *client_name = DEFAULT_CLIENT_NAME;
-  char *connect_left = NULL;
-  char *connect_right = NULL;
-  const char *format_name = NULL;
-  int bitrate = DEFAULT_BITRATE;
-  int sync_period = DEFAULT_SYNC_PERIOD;
-  float sleep_time = 0;
-  time_t next_sync = 0;
+  const char *clock_name = NULL;
+  const char *stations_file = NULL;
+  rotter_stream_t *defaults = NULL;
+  pthread_t *threads = NULL;
+  int threads_started = 0;
   int i,opt;
 
   // Make STDOUT unbuffered
   setbuf(stdout, NULL);
 
+  // The options for a single stream, or the defaults for each station
+  defaults = rotter_stream_new(NULL);
+  if (defaults == NULL) {
+    return EXIT_FAILURE;
+  }
+
   // Parse Switches
-  while ((opt = getopt(argc, argv, "al:r:n:N:O:p:jf:b:Q:d:c:R:L:s:uvqh")) != -1) {
+  while ((opt = getopt(argc, argv, "ADFIWal:r:n:N:O:p:jf:b:Q:d:m:z:c:C:T:R:K:B:X:x:P:L:s:t:S:w:uvqh")) != -1) {
     switch (opt) {
-      case 'a':  autoconnect = 1; break;
-      case 'l':  connect_left = optarg; break;
-      case 'r':  connect_right = optarg; break;
       case 'n':  client_name = optarg; break;
-      case 'N':  archive_name = optarg; break;
       case 'O':  originator = strdup(optarg); break;
-      case 'p':  archive_period_seconds = atol(optarg); break;
       case 'j':  jack_opt |= JackNoStartServer; break;
-      case 'f':  format_name = rotter_str_tolower(optarg); break;
-      case 'b':  bitrate = atoi(optarg); break;
+      case 'A':  async_output = 1; break;
+      case 'I':  seek_index = 1; break;
+      case 'D':  dither_output = 1; break;
+      case 'F':  preallocate = 1; break;
+      case 'W':  incremental_writeback = 1; break;
       case 'Q':  vbr_quality = atof(optarg); break;
-      case 'd':  delete_hours = atoi(optarg); break;
-      case 'c':  channels = atoi(optarg); break;
+      case 'C':  flac_compression = atoi(optarg); break;
+      case 'T':  flac_threads = atoi(optarg); break;
       case 'R':  rb_duration = atof(optarg); break;
-      case 'L':  file_layout = optarg; break;
+      case 'K':  period_slots = atoi(optarg); break;
+      case 'B':  batch_size = atoi(optarg); break;
+      case 'X':  spool_dir = optarg; break;
+      case 'x':  spool_duration = atof(optarg); break;
+      case 'P':  lookahead_secs = atoi(optarg); break;
       case 's':  sync_period = atoi(optarg); break;
+      case 't':  clock_name = optarg; break;
+      case 'S':  stations_file = optarg; break;
+      case 'w':  writer_threads = atoi(optarg); break;
       case 'u':  utc = 1; break;
       case 'v':  verbose = 1; break;
       case 'q':  quiet = 1; break;
-      default:  usage(); break;
+      default:
+        if (rotter_stream_option(defaults, opt, optarg))
+          usage();
+        break;
     }
   }
 
@@ -660,47 +1060,91 @@ int main(int argc, char *argv[])
     usage();
   }
 
-  // Check the number of channels
-  if (channels!=1 && channels!=2) {
-    rotter_error("Number of channels should be either 1 or 2.");
+  // Check the clock used for period boundaries
+  if (clock_name) {
+    if (!strcasecmp(clock_name, "jack")) {
+      use_jack_clock = 1;
+    } else if (strcasecmp(clock_name, "system")) {
+      rotter_error("Unknown clock '%s': should be either system or jack.", clock_name);
+      usage();
+    }
+  }
+
+  // Check the number of period slots
+  if (period_slots < 2 || period_slots > MAX_PERIOD_SLOTS) {
+    rotter_error("Number of period slots should be between 2 and %d.", MAX_PERIOD_SLOTS);
     usage();
   }
 
-  // Check remaining arguments
-    argc -= optind;
-    argv += optind;
-    if (argc!=1) {
-      rotter_error("%s requires a root directory argument.", PACKAGE_NAME);
-      usage();
-  } else {
-    root_directory = argv[0];
-    if (root_directory[strlen(root_directory)-1] == '/')
-      root_directory[strlen(root_directory)-1] = 0;
+  // Check the batch size
+  if (batch_size < 1 || batch_size > MAX_BATCH_SIZE) {
+    rotter_error("Batch size should be between 1 and %d encoder frames.", MAX_BATCH_SIZE);
+    usage();
+  }
 
-    if (rotter_directory_exists(root_directory)) {
-      rotter_debug("Root directory: %s", root_directory);
-    } else {
-      rotter_fatal("Root directory does not exist: %s", root_directory);
-      goto cleanup;
-    }
+  // Check the FLAC settings
+  if (flac_compression < 0 || flac_compression > MAX_FLAC_COMPRESSION) {
+    rotter_error("FLAC compression level should be between 0 and %d.", MAX_FLAC_COMPRESSION);
+    usage();
+  }
+  if (flac_threads < 1) {
+    rotter_error("Number of FLAC encoding threads should be at least 1.");
+    usage();
   }
 
-  // Search for the selected output format
-  if (format_name) {
-    for(i=0; format_list[i].name; i++) {
-      if (strcmp( format_list[i].name, format_name ) == 0) {
-        // Found desired format
-        output_format = &format_list[i];
-        rotter_debug("User selected [%s] '%s'.",  output_format->name,  output_format->desc);
-        break;
-      }
+  // Check the look-ahead
+  if (lookahead_secs < 0) {
+    rotter_error("Look-ahead should not be negative.");
+    usage();
+  }
+
+  // Check the spool directory
+  if (spool_dir) {
+    if (!rotter_directory_exists(spool_dir)) {
+      rotter_error("Spool directory does not exist: %s", spool_dir);
+      usage();
+    }
+    if (spool_duration <= rb_duration) {
+      rotter_error("Spool should be longer than the ring buffer.");
+      usage();
     }
-    if (output_format==NULL) {
-      rotter_fatal("Failed to find format [%s], please check the supported format list.", format_name);
+  }
+
+  // Check the number of writer threads
+  if (writer_threads < 1) {
+    rotter_error("Number of writer threads should be at least 1.");
+    usage();
+  }
+
+  // Check remaining arguments
+  argc -= optind;
+  argv += optind;
+  if (argc==1) {
+    defaults->root_directory = argv[0];
+  } else if (argc!=0 || stations_file==NULL) {
+    rotter_error("%s requires a root directory argument.", PACKAGE_NAME);
+    usage();
+  }
+
+  // Pick the sample conversion to use, before creating the encoders
+  rotter_convert_init();
+
+  if (stations_file) {
+    // Create a stream for each station
+    if (rotter_read_stations(stations_file, defaults)) {
+      rotter_fatal("Failed to read stations file: %s", stations_file);
       goto cleanup;
     }
+    rotter_info("Recording %d stations.", stream_count);
   } else {
-    output_format = &format_list[0];
+    // Record a single stream, using the command line options
+    if (rotter_stream_validate(defaults)) {
+      usage();
+    }
+    if (rotter_stream_add(defaults)) {
+      goto cleanup;
+    }
+    defaults = NULL;
   }
 
   // No originator defined?
@@ -714,23 +1158,25 @@ int main(int argc, char *argv[])
     goto cleanup;
   }
 
-  // Create ring buffers
-  if (init_ringbuffers()) {
-    rotter_debug("Failed to initialise ring buffers.");
-    goto cleanup;
-  }
+  // There is no point having more writer threads than period slots
+  if (writer_threads > stream_count * period_slots)
+    writer_threads = stream_count * period_slots;
 
-  // Create temporary buffer for reading samples into
-  if (init_tmpbuffers(output_format->samples_per_frame)) {
-    rotter_debug("Failed to initialise temporary buffers.");
+  // Create a semaphore for each writer
+  writer_wakeups = calloc( writer_threads, sizeof(sem_t) );
+  if (writer_wakeups == NULL) {
+    rotter_fatal("Failed to allocate memory for writer semaphores.");
     goto cleanup;
   }
+  for (i=0; i<writer_threads; i++) {
+    sem_init(&writer_wakeups[i], 0, 0);
+  }
 
-  // Initialise encoder
-  encoder = output_format->initfunc(output_format, channels, bitrate);
-  if (encoder==NULL) {
-    rotter_debug("Failed to initialise encoder.");
-    goto cleanup;
+  // Create the ports, buffers and encoders for each stream
+  for (i=0; i<stream_count; i++) {
+    if (init_stream(streams[i], i)) {
+      goto cleanup;
+    }
   }
 
   // Activate JACK
@@ -744,44 +1190,89 @@ int main(int argc, char *argv[])
   signal(SIGINT, rotter_termination_handler);
   signal(SIGHUP, rotter_termination_handler);
 
-  // Auto-connect our input ports ?
-  if (autoconnect) autoconnect_jack_ports( client );
-  if (connect_left) connect_jack_port( connect_left, inport[0] );
-  if (connect_right && channels == 2) connect_jack_port( connect_right, inport[1] );
+  // Connect our input ports
+  for (i=0; i<stream_count; i++) {
+    connect_stream(streams[i]);
+  }
 
-  // Calculate period to wait when there is no audio to process
-  sleep_time = (2.0f * output_format->samples_per_frame / jack_get_sample_rate( client ));
-  rotter_debug("Sleep period is %dms.", (int)(sleep_time * 1000));
+  // Start the threads that write to disk in the background
+  if (async_output && rotter_aio_start()) {
+    goto cleanup;
+  }
 
-  while( rotter_run_state == ROTTER_STATE_RUNNING ) {
-    time_t now = time(NULL);
-    int samples_processed = rotter_process_audio();
-    if (samples_processed <= 0) {
-      usleep(sleep_time * 1000000);
-    }
+  // Start the thread that closes finished files
+  if (rotter_io_start()) {
+    goto cleanup;
+  }
+
+  // Start moving audio to disk when the writers fall behind
+  if (spool_dir && rotter_spool_start()) {
+    goto cleanup;
+  }
+
+  // Start the threads that encode the extra formats of each stream
+  if (start_encode_helpers()) {
+    goto cleanup;
+  }
 
-    // Is it time to sync the encoded audio to disk?
-    if (next_sync < now) {
-      rotter_sync_to_disk();
-      next_sync = now + sync_period;
+  // Start the extra writer threads; this thread is the first writer
+  threads = calloc( writer_threads, sizeof(pthread_t) );
+  if (threads == NULL) {
+    rotter_fatal("Failed to allocate memory for writer threads.");
+    goto cleanup;
+  }
+
+  for (threads_started=1; threads_started<writer_threads; threads_started++) {
+    if (pthread_create(&threads[threads_started], NULL, rotter_writer_thread, (void*)(long)threads_started)) {
+      rotter_fatal("Failed to start writer thread %d.", threads_started);
+      break;
     }
+  }
+
+  rotter_writer_loop(0);
 
-    deletefiles_cleanup_child();
+  // Wait for the other writer threads to finish
+  for (i=1; i<threads_started; i++) {
+    pthread_join(threads[i], NULL);
   }
 
 
 cleanup:
 
+  stop_encode_helpers();
+
+  rotter_spool_stop();
+
+  // Finish closing any files from earlier periods
+  rotter_io_stop();
+
   // Clean up JACK
   deinit_jack();
 
-  // Free buffers and close files
-  deinit_tmpbuffers();
-  deinit_ringbuffers();
+  // Free buffers, close files and shut down encoders
+  for (i=0; i<stream_count; i++) {
+    deinit_stream(streams[i]);
+    rotter_stream_free(streams[i]);
+  }
+  if (streams)
+    free(streams);
+
+  // Wait for the last of the asynchronous output
+  rotter_aio_stop();
 
-  // Shut down encoder
-  if (encoder)
-    encoder->deinit();
+  if (defaults)
+    rotter_stream_free(defaults);
+
+  if (threads)
+    free(threads);
+
+  if (writer_wakeups) {
+    for (i=0; i<writer_threads; i++) {
+      sem_destroy(&writer_wakeups[i]);
+    }
+    free(writer_wakeups);
+    writer_wakeups = NULL;
+  }
 
   // Free the originator string
   if (originator)
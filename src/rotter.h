@@ -24,8 +24,13 @@
 
 #include "config.h"
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
 #include <jack/jack.h>
-#include <jack/ringbuffer.h>
 
 #ifdef HAVE_SNDFILE
 #include <sndfile.h>
@@ -46,7 +51,6 @@
 
 // ------- Constants -------
 #define DEFAULT_RB_LEN        (2.0)
-#define WRITE_BUFFER_SIZE     (2048)
 #define MAX_FILEPATH_LEN      (1024)
 #define DEFAULT_DIR_MODE      (0755)
 #define DEFAULT_CLIENT_NAME   "rotter"
@@ -54,9 +58,43 @@
 #define DEFAULT_FILE_LAYOUT   "hierarchy"
 #define DEFAULT_BITRATE       (160)
 #define DEFAULT_CHANNELS      (2)
+#define MAX_CHANNELS          (64)
+#define MAX_PORT_SUFFIX_LEN   (5)         // Longest JACK port name suffix: 'right' or 'in_64'
+#define ROTTER_CACHE_LINE     (64)
+#define ROTTER_DITHER_LANES   (8)
 #define DEFAULT_DELETE_HOURS  (0)
+#define DEFAULT_USAGE_MARGIN  (5.0)         // Low filesystem usage mark, below the high one (percent)
+#define DEFAULT_QUOTA_LOW_FRACTION (0.9)    // Low archive size mark, as a fraction of the high one
 #define DEFAULT_SYNC_PERIOD   (10)
 #define DEFAULT_ARCHIVE_PERIOD_SECONDS (3600)
+#define DEFAULT_WRITER_THREADS (1)
+#define DEFAULT_PERIOD_SLOTS  (3)
+#define MAX_PERIOD_SLOTS      (26)
+#define MAX_OUTPUTS           (4)
+#define DEFAULT_SPOOL_LEN     (300.0)
+#define SPILL_POLL_USECS      (20000)
+#define MAX_WRITER_SLEEP      (1)
+#define DELETE_DELAY          (10)        // Seconds to wait before deleting old files
+#define DEFAULT_BATCH_SIZE    (1)
+#define MAX_BATCH_SIZE        (64)
+#define MAX_STATIONS_LINE_LEN (4096)
+#define PREPARED_FILE_SUFFIX  ".part"
+#define SEEK_INDEX_SUFFIX     ".idx"
+#define SEEK_INDEX_MAGIC      "RIDX"
+#define SEEK_INDEX_VERSION    (1)
+#define SEEK_INDEX_HEADER_LEN (8)
+#define SEEK_INDEX_ENTRY_LEN  (16)
+#define MANIFEST_FILENAME     ".rotter-manifest"
+#define MANIFEST_MAGIC        "ROTTER-MANIFEST 2"
+#define MANIFEST_HEADER_LEN   (60)          // Magic, 20 digit offset and 20 digit total size
+#define MANIFEST_COMPACT_SIZE (1024*1024)   // Rewrite the manifest once this much has expired
+#define DATASYNC_PERIOD       (300)
+#define SYNC_STATS_PERIOD     (600)
+#define AIO_BUFFER_SIZE       (65536)
+#define AIO_BUFFER_ALIGN      (4096)
+#define AIO_QUEUE_DEPTH       (64)
+#define AIO_POOL_THREADS      (2)
+#define AIO_MAX_PENDING       (256)         // Requests (mostly AIO_BUFFER_SIZE writes) that may be queued
 
 
 #ifndef LAME_SAMPLES_PER_FRAME
@@ -67,10 +105,35 @@
 #define TWOLAME_SAMPLES_PER_FRAME (1152)
 #endif
 
+// Worst case size of the MPEG Audio encoded from a number of frames (from the LAME API docs)
+#define MPEG_BUFFER_SIZE(frames) ((size_t)(1.25 * (frames)) + 7200)
+
 #ifndef SNDFILE_SAMPLES_PER_FRAME
 #define SNDFILE_SAMPLES_PER_FRAME (512)
 #endif
 
+#ifndef FLAC_SAMPLES_PER_FRAME
+#define FLAC_SAMPLES_PER_FRAME (4096)
+#endif
+
+#define DEFAULT_FLAC_COMPRESSION (5)
+#define MAX_FLAC_COMPRESSION  (8)
+#define FLAC_SEEKPOINT_SECONDS (10)
+
+#ifndef OPUS_SAMPLES_PER_FRAME
+#define OPUS_SAMPLES_PER_FRAME (960)
+#endif
+
+// Longest gap between Ogg pages in an Opus file (in samples at 48kHz)
+#define OPUS_MAX_PAGE_DELAY   (48000)
+
+// Average bitrate (in kbps) for a VBR quality, when encoding Opus
+#define OPUS_VBR_BITRATE(quality, channels) ((int)((12 + 6 * (quality)) * (channels)))
+
+#ifndef PCMFILE_SAMPLES_PER_FRAME
+#define PCMFILE_SAMPLES_PER_FRAME (512)
+#endif
+
 /* Some systems do not define EXIT_*, even with STDC_HEADERS.  */
 #ifndef EXIT_SUCCESS
 #define EXIT_SUCCESS (0)
@@ -111,39 +174,136 @@ typedef enum {
   ROTTER_STATE_ERROR         // Quiting due to an error
 } RotterRunState;
 
+// The life of a period slot:
+//   the JACK callback takes a FREE slot and starts FILLING it,
+//   then hands it over for DRAINING when the next period starts.
+//   The writer empties it, and is CLOSING the file before it is FREE again.
+//   With a look-ahead, the I/O stage may first take a FREE slot and
+//   open the next period's file (PREPARING), leaving it READY for the callback.
+typedef enum {
+  ROTTER_SLOT_FREE=0,        // Unused, available to the JACK callback
+  ROTTER_SLOT_FILLING,       // Being written to by the JACK callback
+  ROTTER_SLOT_DRAINING,      // Period has ended, writer is emptying it
+  ROTTER_SLOT_CLOSING,       // Writer is closing the file
+  ROTTER_SLOT_PREPARING,     // I/O stage is opening the file for the next period
+  ROTTER_SLOT_READY          // File for the next period is open, waiting for the callback
+} RotterSlotState;
+
+// The thread deleting old files for a stream:
+//   it is started RUNNING, and is FINISHED until the I/O stage joins it
+typedef enum {
+  ROTTER_DELETE_IDLE=0,      // No deletion thread
+  ROTTER_DELETE_RUNNING,     // Deleting files
+  ROTTER_DELETE_FINISHED     // Done, waiting to be joined
+} RotterDeleteState;
+
+// Lock-free ring of interleaved frames (one producer, one consumer)
+typedef struct rotter_framering_s
+{
+    size_t write_pos __attribute__((aligned(ROTTER_CACHE_LINE)));   // Frames written (producer only)
+    size_t read_pos __attribute__((aligned(ROTTER_CACHE_LINE)));    // Frames read (consumer only)
+    jack_default_audio_sample_t *buf __attribute__((aligned(ROTTER_CACHE_LINE)));
+    size_t size;                     // Capacity in frames (a power of two)
+    size_t mask;                     // size - 1
+    unsigned int channels;           // Number of samples in each frame
+    int mlocked;                     // Flag to indicate that the ring is locked into memory
+    int mapped;                      // Flag to indicate that the buffer is a mapped file
+} rotter_framering_t;
+
+// A contiguous block of frames in a rotter_framering_t
+typedef struct rotter_framering_vector_s
+{
+    jack_default_audio_sample_t *buf;
+    size_t frames;
+} rotter_framering_vector_t;
+
+// Random number generators for dithering, one per vector lane
+typedef struct rotter_dither_s
+{
+    uint32_t lanes[ROTTER_DITHER_LANES];
+} rotter_dither_t;
+
+// An archive file written from a period slot, in one of its stream's formats
+typedef struct rotter_file_s
+{
+    struct encoder_funcs_s *encoder; // Encoder for this format (one per period slot)
+    void* handle;                    // Handle of the open file (NULL if not open)
+    const char *file_layout;         // File layout for this format
+    char filepath[MAX_FILEPATH_LEN]; // Path of the archive file that is open
+    time_t next_datasync;            // Time of the next full sync, with incremental writeback
+    off_t writeback_start;           // Start of the range handed to the disk at the last sync
+    off_t writeback_end;             // End of that range
+} rotter_file_t;
+
 typedef struct rotter_ringbuffer_s
 {
     char label;                      // The name/label of the ringbuffer (for debugging)
+    int state;                       // RotterSlotState, changed with atomic stores
     time_t period_start;             // The time (in seconds) that the archive period started at
     struct timeval file_start;       // The time that the file started at (with micro-second accuracy)
-    void* file_handle;
-    jack_ringbuffer_t *buffer[2];
-    int close_file;                  // Flag to indicate that file should be closed
+    rotter_file_t files[MAX_OUTPUTS];   // The file for each output format
+    int file_count;                  // Number of output formats
+    time_t prepared_period;          // Period that the files were opened ahead of time for
+    int prepared;                    // Flag to indicate that the files were opened ahead of time
+    rotter_framering_t *ring;        // Interleaved audio for all the channels
     int overflow;                    // Flag to indicate that ringbuffer overflowed
     int xrun_usecs;                  // Delay in microseconds due to buffer over/underruns (0 if no xrun)
+    rotter_framering_t *spool;       // Disk-backed overflow for the ring (NULL if not spooling)
+    pthread_mutex_t consumer_lock;   // Taken by the writer and spill thread when reading from the ring
+    int spilling;                    // Flag to indicate that audio is being spilled to the spool
+    int spool_full;                  // Flag to indicate that the spool has filled up
+    struct rotter_stream_s *stream;  // The stream that this ringbuffer belongs to
+    jack_default_audio_sample_t *tmp_buffer;   // Interleaved audio copied out of the ringbuffer while spilling
+    int writer;                      // Index of the writer thread that looks after this ringbuffer
+    sem_t *writer_wakeup;            // Posted to wake up that writer thread
+    time_t next_sync;                // Time that the files should next be synced to disk
+    struct rotter_ringbuffer_s *io_next;   // Next ringbuffer in the I/O stage queue
 } rotter_ringbuffer_t;
 
 typedef struct encoder_funcs_s
 {
   const char* file_suffix;                    // Suffix for archive files
+  int channels;                               // Number of channels being encoded
+  int samplerate;                             // Sample rate of the audio being encoded
+  double bytes_per_second;                    // Expected size of the encoded audio (0 if not known)
+  long period_seconds;                        // Length of each archive period (set after init)
+  void* state;                                // Encoder specific state
 
   // Result: pointer to file handle
-  void* (*open)(const char * filepath, struct timeval *file_start);
+  void* (*open)(struct encoder_funcs_s *enc, const char * filepath, struct timeval *file_start);
 
   // Result: 0=success
-  int (*close)(void *fh, struct timeval *file_start);
+  int (*close)(struct encoder_funcs_s *enc, void *fh, struct timeval *file_start);
 
   // Result: 0=success
-  int (*sync)(void *fh);
+  int (*sync)(struct encoder_funcs_s *enc, void *fh);
 
+  // Hand everything written so far to the kernel, without waiting for the disk
+  // Result: file descriptor of the file (-1 on failure)
+  int (*flush)(struct encoder_funcs_s *enc, void *fh);
+
+  // Buffer contains 'frame_count' frames of interleaved samples
+  // Result: 0=success
+  int (*write)(struct encoder_funcs_s *enc, void *fh, size_t frame_count, const jack_default_audio_sample_t *buffer);
+
+  // Prepare the encoder for a new file, after closing the last one (may be NULL)
   // Result: 0=success
-  int (*write)(void *fh, size_t sample_count, jack_default_audio_sample_t *buffer[]);
+  int (*reset)(struct encoder_funcs_s *enc);
 
-  void (*deinit)();
+  void (*deinit)(struct encoder_funcs_s *enc);
 
 } encoder_funcs_t;
 
 
+// Formats written natively by pcmfile.c (the 'param' of an output_format_t)
+typedef enum {
+  ROTTER_PCM_WAV16=1,        // WAV (or RF64), 16-bit PCM
+  ROTTER_PCM_WAV32,          // WAV (or RF64), 32-bit float
+  ROTTER_PCM_AIFF16,         // AIFF, 16-bit PCM
+  ROTTER_PCM_AU16,           // AU, 16-bit PCM
+  ROTTER_PCM_AU32            // AU, 32-bit float
+} RotterPcmFormat;
+
 typedef struct output_format_s
 {
   const char  *name ;
@@ -155,17 +315,69 @@ typedef struct output_format_s
 } output_format_t;
 
 
+// A single archive: a group of JACK ports recorded to one set of files
+typedef struct rotter_stream_s
+{
+  char *name;                        // Name of the stream (NULL when not using a stations file)
+  char *log_prefix;                  // Prefix for log messages about this stream
+  char *config_line;                 // Line of the stations file that the options point into
+
+  // Options
+  int channels;                      // Number of input channels
+  int bitrate;                       // Bitrate of recording
+  int autoconnect;                   // Automatically connect the input ports?
+  char *connect_left;                // Port to connect the left input to
+  char *connect_right;               // Port to connect the right input to
+  char *format_name;                 // Names of the output formats, separated by commas
+  char *file_layouts[MAX_OUTPUTS];   // File layout for each format: Flat files or folder hierarchy ?
+  int layout_count;                  // Number of file layouts given
+  int layouts_inherited;             // Flag to indicate that the file layouts came from the defaults
+  char *archive_name;                // Archive file name
+  char *root_directory;              // Root directory of archives
+  long archive_period_seconds;       // Duration of each archive file
+  int delete_hours;                  // Delete files after this many hours
+  double delete_usage_high;          // Delete the oldest files when the filesystem is fuller than this (percent)
+  double delete_usage_low;           // ...until it is this full
+  double delete_quota_high;          // Delete the oldest files when the archive is bigger than this (bytes)
+  double delete_quota_low;           // ...until it is this big
+
+  // State
+  jack_port_t **inport;              // JACK input ports
+  jack_default_audio_sample_t **port_buffers;   // Port buffers during a JACK cycle
+  rotter_ringbuffer_t **ringbuffers;            // Pool of period slots
+  int ringbuffer_count;              // Number of period slots
+  rotter_ringbuffer_t *active_ringbuffer;       // Ringbuffer being written to by the JACK callback
+  int active_index;                  // Index of the active ringbuffer
+  int slot_starved;                  // Flag to indicate that no period slot was free
+  output_format_t *output_formats[MAX_OUTPUTS];   // Formats that the stream is recorded in
+  int output_count;                  // Number of output formats
+  size_t batch_frames;               // Number of frames to encode at a time
+  pthread_t delete_thread;           // Thread deleting old files
+  int delete_state;                  // RotterDeleteState of the deletion thread
+} rotter_stream_t;
+
+
 
 
 // ------- Globals ---------
-extern jack_port_t *inport[2];
 extern jack_client_t *client;
-extern int channels;
 extern char *originator;
 extern double vbr_quality;
 extern RotterRunState rotter_run_state;
-extern rotter_ringbuffer_t *ringbuffers[2];
-extern long archive_period_seconds;
+extern rotter_stream_t **streams;
+extern int stream_count;
+extern int use_jack_clock;
+extern output_format_t format_list[];
+extern char *spool_dir;
+extern float spool_duration;
+extern int lookahead_secs;
+extern int async_output;
+extern int preallocate;
+extern int incremental_writeback;
+extern int seek_index;
+extern int dither_output;
+extern int flac_compression;
+extern int flac_threads;
 
 
 
@@ -173,6 +385,64 @@ extern long archive_period_seconds;
 
 // In rotter.c
 void rotter_log( RotterLogLevel level, const char* fmt, ... );
+void rotter_wakeup_writer( rotter_ringbuffer_t *ringbuffer );
+int rotter_open_file( rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer );
+int rotter_close_file( rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer );
+void rotter_discard_file( rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer );
+
+// In iostage.c
+void rotter_io_close_file( rotter_ringbuffer_t *ringbuffer );
+int rotter_io_start();
+void rotter_io_stop();
+
+// In aio.c
+typedef struct rotter_aio_file_s rotter_aio_file_t;
+rotter_aio_file_t* rotter_aio_open( const char *filepath );
+rotter_aio_file_t* rotter_aio_fdopen( int fd, const char *filepath );
+int rotter_aio_write( rotter_aio_file_t *file, const void *data, size_t len );
+int rotter_aio_sync( rotter_aio_file_t *file );
+int rotter_aio_flush( rotter_aio_file_t *file );
+int rotter_aio_write_at( rotter_aio_file_t *file, const void *data, size_t len, off_t offset );
+off_t rotter_aio_tell( rotter_aio_file_t *file );
+int rotter_aio_fd( rotter_aio_file_t *file );
+int rotter_aio_close( rotter_aio_file_t *file );
+int rotter_aio_after( void (*callback)(void *arg), void *arg );
+int rotter_aio_start();
+void rotter_aio_stop();
+
+// In fileio.c
+void rotter_preallocate_file( const char *filepath, off_t bytes );
+void rotter_trim_file( const char *filepath );
+void rotter_file_closed( rotter_stream_t *stream, rotter_file_t *file );
+void rotter_writeback_file( rotter_file_t *file, int fd );
+void rotter_sync_stats_add( double seconds );
+void rotter_sync_stats_report();
+
+// In convert.c
+void rotter_convert_init();
+void rotter_dither_init( rotter_dither_t *dither );
+void rotter_float_to_s16( const jack_default_audio_sample_t *in, int16_t *out,
+                          size_t count, rotter_dither_t *dither );
+void rotter_interleave( jack_default_audio_sample_t *dest,
+                        jack_default_audio_sample_t **src,
+                        size_t offset, size_t nframes,
+                        unsigned int channels );
+
+// In stream.c
+rotter_stream_t* rotter_stream_new( const rotter_stream_t *defaults );
+int rotter_stream_option( rotter_stream_t *stream, int opt, char *arg );
+int rotter_stream_validate( rotter_stream_t *stream );
+int rotter_stream_add( rotter_stream_t *stream );
+void rotter_stream_free( rotter_stream_t *stream );
+int rotter_read_stations( const char* filepath, const rotter_stream_t *defaults );
+
+// In archive.c
+int rotter_is_named_layout( const char *file_layout );
+int rotter_time_to_filepath( const char *root_directory, const char *archive_name, const char *file_layout,
+                             struct tm *tm, unsigned int usec, const char *suffix, char *filepath );
+int rotter_parse_mpeg_header( const unsigned char *header, int *frame_len, int *samples, int *samplerate );
+void rotter_put_seek_entry( unsigned char *entry, time_t when, off_t offset );
+void rotter_get_seek_entry( const unsigned char *entry, time_t *when, off_t *offset );
 
 // In dir.c
 int rotter_directory_exists(const char * filepath);
@@ -182,10 +452,30 @@ int rotter_mkdir_for_file( const char* filepath );
 // In hostname.c
 char* rotter_get_hostname();
 
+// In framering.c
+rotter_framering_t* rotter_framering_create( unsigned int channels, size_t frames );
+rotter_framering_t* rotter_framering_map( int fd, unsigned int channels, size_t frames );
+void rotter_framering_free( rotter_framering_t *ring );
+int rotter_framering_mlock( rotter_framering_t *ring );
+size_t rotter_framering_write_space( rotter_framering_t *ring );
+size_t rotter_framering_read_space( rotter_framering_t *ring );
+void rotter_framering_write( rotter_framering_t *ring, jack_default_audio_sample_t **src, size_t offset, size_t nframes );
+size_t rotter_framering_get_read_vector( rotter_framering_t *ring, rotter_framering_vector_t vec[2], size_t nframes );
+void rotter_framering_read_advance( rotter_framering_t *ring, size_t nframes );
+size_t rotter_framering_read( rotter_framering_t *ring, jack_default_audio_sample_t *dest, size_t nframes );
+size_t rotter_framering_transfer( rotter_framering_t *src, rotter_framering_t *dest, size_t nframes );
+
+// In spool.c
+int rotter_spool_create( rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer );
+int rotter_spool_start();
+void rotter_spool_stop();
+
 // In jack.c
 int init_jack( const char* client_name, jack_options_t jack_opt );
+int register_jack_ports( rotter_stream_t *stream );
+size_t max_station_name_len();
 int connect_jack_port( const char* out, jack_port_t *port );
-int autoconnect_jack_ports( jack_client_t* client );
+int autoconnect_jack_ports( jack_client_t* client, rotter_stream_t *stream );
 int deinit_jack();
 
 // In twolame.c
@@ -194,17 +484,31 @@ encoder_funcs_t* init_twolame( output_format_t* format, int channels, int bitrat
 // In lame.c
 encoder_funcs_t* init_lame( output_format_t* format, int channels, int bitrate );
 
+// In flac.c
+encoder_funcs_t* init_flac( output_format_t* format, int channels, int bitrate );
+
+// In opus.c
+encoder_funcs_t* init_opus( output_format_t* format, int channels, int bitrate );
+
 // In sndfile.c
 encoder_funcs_t* init_sndfile( output_format_t* format, int channels, int bitrate );
 
+// In pcmfile.c
+encoder_funcs_t* init_pcmfile( output_format_t* format, int channels, int bitrate );
+
 // In mpegaudiofile.c
-void* open_mpegaudio_file(const char* filepath, struct timeval *file_start);
-int close_mpegaudio_file(void* fh, struct timeval *file_start);
-int sync_mpegaudio_file(void *fh);
+void* open_mpegaudio_file(encoder_funcs_t *enc, const char* filepath, struct timeval *file_start);
+int close_mpegaudio_file(encoder_funcs_t *enc, void* fh, struct timeval *file_start);
+int sync_mpegaudio_file(encoder_funcs_t *enc, void *fh);
+int flush_mpegaudio_file(encoder_funcs_t *enc, void *fh);
+int write_mpegaudio_file(void *fh, const void *data, size_t len);
+int write_mpegaudio_tag(void *fh, const void *data, size_t len);
 
 // In deletefiles.c
-int deletefiles( const char* dir, int hours );
-void deletefiles_cleanup_child();
+int deletefiles( rotter_stream_t *stream );
+void deletefiles_cleanup_thread( rotter_stream_t *stream );
+void deletefiles_stop( rotter_stream_t *stream );
+void deletefiles_record( const char* dir, const char* filepath );
 
 
 #endif
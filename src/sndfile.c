@@ -38,39 +38,38 @@
 #include <limits.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <fcntl.h>
 
 #include <sndfile.h>
 
 
 
-// ------ Globals ---------
-static jack_default_audio_sample_t *interleaved_buffer = NULL;
-static SF_INFO sfinfo;
+// ------ Structures ---------
+typedef struct sndfile_state_s
+{
+  SF_INFO sfinfo;
+} sndfile_state_t;
+
+// We open the file ourselves, so that its descriptor can be used for writeback
+typedef struct sndfile_handle_s
+{
+  SNDFILE *sndfile;
+  int fd;
+} sndfile_handle_t;
 
 
 
 /*
   Write some audio from the ring buffer to disk
 */
-static int write_sndfile(void *fh, size_t sample_count, jack_default_audio_sample_t *buffer[])
+static int write_sndfile(encoder_funcs_t *enc, void *fh, size_t frame_count, const jack_default_audio_sample_t *buffer)
 {
-  SNDFILE *sndfile = (SNDFILE *)fh;
+  SNDFILE *sndfile = ((sndfile_handle_t *)fh)->sndfile;
   sf_count_t frames_written = 0;
-  int i,c;
-
-  // Interleave the audio into another buffer
-  interleaved_buffer = (jack_default_audio_sample_t*)realloc(interleaved_buffer, sample_count * channels * sizeof(jack_default_audio_sample_t));
-  if (!interleaved_buffer) rotter_fatal( "realloc on interleaved_buffer failed" );
-  for (c=0; c<channels; c++)
-  {
-    for(i=0;i<sample_count;i++) {
-      interleaved_buffer[(i*channels)+c] = buffer[c][i];
-    }
-  }
 
-  // Write it to disk
-  frames_written = sf_writef_float(sndfile, interleaved_buffer, sample_count);
-  if (frames_written != sample_count) {
+  // The audio is already interleaved, so can be written directly
+  frames_written = sf_writef_float(sndfile, buffer, frame_count);
+  if (frames_written != frame_count) {
     rotter_error( "Warning: failed to write audio to disk: %s", sf_strerror( sndfile ));
     return -1;
   }
@@ -80,9 +79,9 @@ static int write_sndfile(void *fh, size_t sample_count, jack_default_audio_sampl
 }
 
 
-static int sync_sndfile(void *fh)
+static int sync_sndfile(encoder_funcs_t *enc, void *fh)
 {
-  SNDFILE *sndfile = (SNDFILE *)fh;
+  SNDFILE *sndfile = ((sndfile_handle_t *)fh)->sndfile;
 
   // Write the header to file, so other processes can read it
   sf_command(sndfile, SFC_UPDATE_HEADER_NOW, NULL, 0);
@@ -94,36 +93,58 @@ static int sync_sndfile(void *fh)
 }
 
 
-static void deinit_sndfile()
+static int flush_sndfile(encoder_funcs_t *enc, void *fh)
+{
+  sndfile_handle_t *handle = (sndfile_handle_t *)fh;
+
+  // libsndfile doesn't buffer the audio, only the header
+  sf_command(handle->sndfile, SFC_UPDATE_HEADER_NOW, NULL, 0);
+
+  return handle->fd;
+}
+
+
+static void deinit_sndfile(encoder_funcs_t *enc)
 {
+  sndfile_state_t *state = (sndfile_state_t*)enc->state;
+
   rotter_debug("Shutting down sndfile encoder.");
 
-  if (interleaved_buffer) {
-    free(interleaved_buffer);
-    interleaved_buffer=NULL;
+  if (state) {
+    free(state);
   }
+
+  free(enc);
 }
 
 
-static int close_sndfile(void *fh, struct timeval *file_start)
+static int close_sndfile(encoder_funcs_t *enc, void *fh, struct timeval *file_start)
 {
-  SNDFILE *sndfile = (SNDFILE *)fh;
-  if (sndfile==NULL) return -1;
+  sndfile_handle_t *handle = (sndfile_handle_t *)fh;
+  int result = 0;
+
+  if (handle==NULL) return -1;
 
   rotter_debug("Closing libsndfile output file.");
 
-  if (sf_close(sndfile)) {
-    rotter_error( "Failed to close output file: %s", sf_strerror(sndfile) );
-    return -1;
+  if (sf_close(handle->sndfile)) {
+    rotter_error( "Failed to close output file: %s", sf_strerror(handle->sndfile) );
+    result = -1;
   }
 
-  // Success
-  return 0;
+  if (close(handle->fd)) {
+    rotter_error( "Failed to close output file: %s", strerror(errno) );
+    result = -1;
+  }
+
+  free(handle);
+
+  return result;
 }
 
 
 // Write an Broadcast Wave Extension chuck to the file
-static void write_bext(SNDFILE* sndfile, struct timeval *file_start)
+static void write_bext(SNDFILE* sndfile, struct timeval *file_start, int samplerate)
 {
   SF_BROADCAST_INFO bext;
   char tmp_str[12];
@@ -163,8 +184,8 @@ static void write_bext(SNDFILE* sndfile, struct timeval *file_start)
   midnight = mktime(&tm);
 
   // Calculate the number of samples since midnight
-  sample_count = (file_start->tv_sec - midnight) * sfinfo.samplerate;
-  sample_count += ((float)file_start->tv_usec / 1000000) * sfinfo.samplerate;
+  sample_count = (file_start->tv_sec - midnight) * samplerate;
+  sample_count += ((float)file_start->tv_usec / 1000000) * samplerate;
   bext.time_reference_high = (sample_count >> 32) & 0xffffffff;
   bext.time_reference_low = sample_count & 0xffffffff;
 
@@ -180,14 +201,45 @@ static void write_bext(SNDFILE* sndfile, struct timeval *file_start)
   }
 }
 
-static void* open_sndfile(const char* filepath, struct timeval *file_start)
+// Open a file with the same flags that sf_open() would use
+static SNDFILE* open_sndfile_fd(const char* filepath, int mode, SF_INFO *sfinfo, int *fd)
 {
+  SNDFILE *sndfile = NULL;
+  int flags = O_RDWR | O_CREAT;
+
+  if (mode == SFM_WRITE)
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+  *fd = open( filepath, flags, 0666 );
+  if (*fd < 0) {
+    rotter_error( "Failed to open output file: %s", strerror(errno) );
+    return NULL;
+  }
+
+  sndfile = sf_open_fd( *fd, mode, sfinfo, SF_FALSE );
+  if (sndfile == NULL) {
+    close( *fd );
+    *fd = -1;
+  }
+
+  return sndfile;
+}
+
+static void* open_sndfile(encoder_funcs_t *enc, const char* filepath, struct timeval *file_start)
+{
+  sndfile_state_t *state = (sndfile_state_t*)enc->state;
+  sndfile_handle_t *handle = NULL;
   SNDFILE *sndfile = NULL;
   int read_write_mode = 1;
   int result = 0;
+  int fd = -1;
+  SF_INFO sfinfo;
+
+  // sf_open() overwrites the SF_INFO structure, when opening an existing file
+  sfinfo = state->sfinfo;
 
   rotter_debug("Opening libsndfile output file: %s", filepath);
-  sndfile = sf_open( filepath, SFM_RDWR, &sfinfo );
+  sndfile = open_sndfile_fd( filepath, SFM_RDWR, &sfinfo, &fd );
 
   // Some output formats, like flac and vorbis, do not support read/write mode
   // There is no stable way to trap this specific error in the libsndfile public API
@@ -202,7 +254,8 @@ static void* open_sndfile(const char* filepath, struct timeval *file_start)
   if (sndfile==NULL) {
     rotter_debug( "Failed to open output file in read/write mode, so trying write-only" );
     read_write_mode = 0;
-    sndfile = sf_open( filepath, SFM_WRITE, &sfinfo );
+    sfinfo = state->sfinfo;
+    sndfile = open_sndfile_fd( filepath, SFM_WRITE, &sfinfo, &fd );
   }
 
   if (sndfile==NULL) {
@@ -210,14 +263,24 @@ static void* open_sndfile(const char* filepath, struct timeval *file_start)
     return NULL;
   }
 
+  handle = calloc( 1, sizeof(sndfile_handle_t) );
+  if (handle==NULL) {
+    rotter_error( "Failed to allocate memory for output file." );
+    sf_close(sndfile);
+    close(fd);
+    return NULL;
+  }
+  handle->sndfile = sndfile;
+  handle->fd = fd;
+
   // Set the metadata (for Broadcast Wave Format)
-  write_bext(sndfile, file_start);
+  write_bext(sndfile, file_start, enc->samplerate);
 
   // Is VBR mode enabled?
   if (vbr_quality >= 0) {
     if (!sf_command(sndfile, SFC_SET_VBR_ENCODING_QUALITY, &vbr_quality, sizeof(vbr_quality))) {
       rotter_error( "Failed to set VBR quality." );
-      sf_close(sndfile);
+      close_sndfile(enc, handle, file_start);
       return NULL;
     }
   }
@@ -232,26 +295,54 @@ static void* open_sndfile(const char* filepath, struct timeval *file_start)
     }
   }
 
-  return (void*)sndfile;
+  return (void*)handle;
 }
 
 
 encoder_funcs_t* init_sndfile( output_format_t* format, int channels, int bitrate )
 {
   encoder_funcs_t* funcs = NULL;
+  sndfile_state_t* state = NULL;
   SF_FORMAT_INFO format_info;
   SF_FORMAT_INFO subformat_info;
+  SF_INFO *sfinfo = NULL;
   char sndlibver[128];
 
+  // Allocate memory for callback functions
+  funcs = calloc( 1, sizeof(encoder_funcs_t) );
+  if ( funcs==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder callback functions structure." );
+    return NULL;
+  }
+
+  // Fill in the encoder callback functions
+  funcs->channels = channels;
+  funcs->samplerate = jack_get_sample_rate( client );
+  funcs->open = open_sndfile;
+  funcs->close = close_sndfile;
+  funcs->write = write_sndfile;
+  funcs->sync = sync_sndfile;
+  funcs->flush = flush_sndfile;
+  funcs->deinit = deinit_sndfile;
+
+  // Allocate memory for encoder state
+  funcs->state = state = calloc( 1, sizeof(sndfile_state_t) );
+  if ( state==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder state." );
+    deinit_sndfile(funcs);
+    return NULL;
+  }
+  sfinfo = &state->sfinfo;
+
   // Zero the SF_INFO structures
-  bzero( &sfinfo, sizeof( SF_INFO ) );
   bzero( &format_info, sizeof( SF_FORMAT_INFO ) );
   bzero( &subformat_info, sizeof( SF_FORMAT_INFO ) );
 
   // Check the format parameter flags
-  sfinfo.format = format->param;
-  if (sfinfo.format == 0x00) {
+  sfinfo->format = format->param;
+  if (sfinfo->format == 0x00) {
     rotter_error( "No libsndfile format flags defined for [%s]", format->name );
+    deinit_sndfile(funcs);
     return NULL;
   }
 
@@ -263,52 +354,52 @@ encoder_funcs_t* init_sndfile( output_format_t* format, int channels, int bitrat
   }
 
   // Lookup inforamtion about the format and subtype
-  format_info.format = sfinfo.format & SF_FORMAT_TYPEMASK;
+  format_info.format = sfinfo->format & SF_FORMAT_TYPEMASK;
   if (sf_command(NULL, SFC_GET_FORMAT_INFO, &format_info, sizeof(format_info))) {
     rotter_fatal( "Failed to get format information for: %s", format->name);
     rotter_info( "=> Is support for it compiled into libsndfile?");
+    deinit_sndfile(funcs);
     return NULL;
   }
 
-  subformat_info.format = sfinfo.format & SF_FORMAT_SUBMASK;
+  subformat_info.format = sfinfo->format & SF_FORMAT_SUBMASK;
   if (sf_command (NULL, SFC_GET_FORMAT_INFO, &subformat_info, sizeof(subformat_info))) {
     rotter_fatal( "Failed to get sub-format information for: %s", format->name);
     rotter_info( "=> Is support for it compiled into libsndfile?");
+    deinit_sndfile(funcs);
     return NULL;
   }
 
   // Fill in the rest of the SF_INFO data structure
-  sfinfo.samplerate = jack_get_sample_rate( client );
-  sfinfo.channels = channels;
+  sfinfo->samplerate = funcs->samplerate;
+  sfinfo->channels = channels;
 
   // Display info about input/output
-  rotter_debug( "  Input: %d Hz, %d channels", sfinfo.samplerate, sfinfo.channels );
+  rotter_debug( "  Input: %d Hz, %d channels", sfinfo->samplerate, sfinfo->channels );
   rotter_debug( "  Output: %s, %s.", format_info.name, subformat_info.name );
   if (vbr_quality >= 0) {
     rotter_debug( "  VBR Quality: %2.2d", vbr_quality );
   }
 
   // Check that the format is valid
-  if (!sf_format_check(&sfinfo)) {
+  if (!sf_format_check(sfinfo)) {
     rotter_error( "Output format is not valid." );
+    deinit_sndfile(funcs);
     return NULL;
   }
 
-  // Allocate memory for callback functions
-  funcs = calloc( 1, sizeof(encoder_funcs_t) );
-  if ( funcs==NULL ) {
-    rotter_error( "Failed to allocate memory for encoder callback functions structure." );
-    return NULL;
-  }
-
-
-  // Fill in the encoder callback functions
   funcs->file_suffix = format_info.extension;
-  funcs->open = open_sndfile;
-  funcs->close = close_sndfile;
-  funcs->write = write_sndfile;
-  funcs->sync = sync_sndfile;
-  funcs->deinit = deinit_sndfile;
+
+  // Uncompressed formats grow at a fixed rate
+  switch (sfinfo->format & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_16:  funcs->bytes_per_second = 2; break;
+    case SF_FORMAT_PCM_24:  funcs->bytes_per_second = 3; break;
+    case SF_FORMAT_PCM_32:
+    case SF_FORMAT_FLOAT:   funcs->bytes_per_second = 4; break;
+    case SF_FORMAT_DOUBLE:  funcs->bytes_per_second = 8; break;
+    default:                funcs->bytes_per_second = 0; break;
+  }
+  funcs->bytes_per_second *= channels * funcs->samplerate;
 
   return funcs;
 }
@@ -0,0 +1,179 @@
+/*
+
+  spool.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "rotter.h"
+#include "config.h"
+
+
+/*
+  When the writer stalls (slow storage, a long sync), the in-memory
+  ringbuffers fill up and the JACK callback has to drop audio.
+
+  The spill thread watches each ringbuffer and, once it is more than
+  half full, moves the oldest audio out into a spool: a ring of the
+  same layout whose buffer is a preallocated, memory-mapped file.
+  The writer always empties the spool before the ringbuffer, so the
+  audio is still written out in order once it catches up.
+*/
+
+
+// ------- Globals -------
+char *spool_dir = NULL;                    // Directory for spool files (NULL to disable)
+float spool_duration = DEFAULT_SPOOL_LEN;  // Duration of each spool (in seconds)
+
+static pthread_t spill_thread;
+static int spill_thread_running = 0;
+
+// Number of frames moved to a spool while holding the consumer lock
+#define SPILL_CHUNK_FRAMES  (8192)
+
+
+// Create the disk-backed spool for a ringbuffer
+int rotter_spool_create( rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer )
+{
+  size_t spool_frames = jack_get_sample_rate( client ) * spool_duration;
+  char filepath[MAX_FILEPATH_LEN];
+  int fd;
+
+  snprintf( filepath, sizeof(filepath), "%s/%s%s%c-XXXXXX.spool", spool_dir,
+            stream->name ? stream->name : "", stream->name ? "-" : "", ringbuffer->label );
+
+  fd = mkstemps( filepath, strlen(".spool") );
+  if (fd < 0) {
+    rotter_fatal( "%sFailed to create spool file %s: %s", stream->log_prefix, filepath, strerror(errno) );
+    return -1;
+  }
+
+  // The spool only needs to exist for as long as it is mapped
+  unlink( filepath );
+
+  ringbuffer->spool = rotter_framering_map( fd, stream->channels, spool_frames );
+  close( fd );
+
+  if (ringbuffer->spool == NULL) {
+    rotter_fatal( "%sFailed to allocate spool for ringbuffer %c: %s",
+                  stream->log_prefix, ringbuffer->label, strerror(errno) );
+    return -1;
+  }
+
+  rotter_debug( "%sSpool for ringbuffer %c is %2.2f seconds (%d frames).",
+                stream->log_prefix, ringbuffer->label, spool_duration, (int)ringbuffer->spool->size );
+
+  return 0;
+}
+
+
+// Move audio from a ringbuffer to its spool, if the ringbuffer is filling up
+static void rotter_spill_ringbuffer( rotter_stream_t *stream, rotter_ringbuffer_t *ringbuffer )
+{
+  rotter_framering_t *ring = ringbuffer->ring;
+  size_t high_watermark = ring->size / 2;
+  size_t low_watermark = ring->size / 4;
+
+  while (rotter_framering_read_space( ring ) > (ringbuffer->spilling ? low_watermark : high_watermark)) {
+    size_t frames = rotter_framering_read_space( ring ) - low_watermark;
+    size_t moved;
+
+    if (frames > SPILL_CHUNK_FRAMES)
+      frames = SPILL_CHUNK_FRAMES;
+
+    if (!ringbuffer->spilling) {
+      rotter_info( "%sWriter is falling behind; spilling ringbuffer %c to disk.",
+                   stream->log_prefix, ringbuffer->label );
+      ringbuffer->spilling = 1;
+    }
+
+    pthread_mutex_lock( &ringbuffer->consumer_lock );
+    moved = rotter_framering_transfer( ring, ringbuffer->spool, frames );
+    pthread_mutex_unlock( &ringbuffer->consumer_lock );
+
+    if (moved == 0) {
+      // The ringbuffer will overflow if the writer doesn't catch up
+      if (!ringbuffer->spool_full) {
+        rotter_error( "%sSpool for ringbuffer %c is full.", stream->log_prefix, ringbuffer->label );
+        ringbuffer->spool_full = 1;
+      }
+      break;
+    }
+  }
+
+  // Has the writer caught up?
+  if (ringbuffer->spilling && rotter_framering_read_space( ringbuffer->spool ) == 0) {
+    rotter_info( "%sWriter has caught up with ringbuffer %c.", stream->log_prefix, ringbuffer->label );
+    ringbuffer->spilling = 0;
+    ringbuffer->spool_full = 0;
+  }
+}
+
+
+static void* rotter_spill_thread_func( void *arg )
+{
+  while (rotter_run_state == ROTTER_STATE_RUNNING) {
+    int s, b;
+
+    for (s=0; s<stream_count; s++) {
+      rotter_stream_t *stream = streams[s];
+
+      for (b=0; b<stream->ringbuffer_count; b++) {
+        rotter_ringbuffer_t *ringbuffer = stream->ringbuffers[b];
+        if (ringbuffer->spool && __atomic_load_n( &ringbuffer->state, __ATOMIC_ACQUIRE ) != ROTTER_SLOT_FREE) {
+          rotter_spill_ringbuffer( stream, ringbuffer );
+        }
+      }
+    }
+
+    usleep( SPILL_POLL_USECS );
+  }
+
+  return NULL;
+}
+
+
+// Start the thread that spills ringbuffers to disk
+int rotter_spool_start()
+{
+  if (pthread_create( &spill_thread, NULL, rotter_spill_thread_func, NULL )) {
+    rotter_fatal( "Failed to start spill thread." );
+    return -1;
+  }
+
+  spill_thread_running = 1;
+  return 0;
+}
+
+
+// Wait for the spill thread to finish
+void rotter_spool_stop()
+{
+  if (spill_thread_running) {
+    pthread_join( spill_thread, NULL );
+    spill_thread_running = 0;
+  }
+}
@@ -0,0 +1,476 @@
+/*
+
+  stream.c
+
+  rotter: Recording of Transmission / Audio Logger
+  Copyright (C) 2006-2015  Nicholas J. Humfrey
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "rotter.h"
+#include "config.h"
+
+
+// Options that can be set for each stream in a stations file
+#define STREAM_OPTIONS "al:r:f:b:c:N:L:p:d:m:z:"
+
+
+// ------- Globals -------
+rotter_stream_t **streams = NULL;   // All the streams being recorded
+int stream_count = 0;              // Number of streams being recorded
+
+
+static char* rotter_str_tolower( char* str )
+{
+  int i=0;
+
+  for(i=0; i< strlen( str ); i++) {
+    str[i] = tolower( str[i] );
+  }
+
+  return str;
+}
+
+
+// Parse a high mark, optionally followed by ':' and a low mark
+// Sizes may be followed by K, M, G or T
+static int rotter_parse_marks( const char *arg, int is_size, double *high, double *low )
+{
+  double *marks[2] = { high, low };
+  char *end = (char*)arg;
+  int m;
+
+  *low = -1;
+  for (m=0; m<2; m++) {
+    *marks[m] = strtod( end, &end );
+    if (is_size) {
+      switch (toupper(*end)) {
+        case 'T':  *marks[m] *= 1024;
+        case 'G':  *marks[m] *= 1024;
+        case 'M':  *marks[m] *= 1024;
+        case 'K':  *marks[m] *= 1024; end++; break;
+      }
+    }
+
+    if (*end == '\0')
+      break;
+    if (*end != ':' || m == 1)
+      return -1;
+    end++;
+  }
+
+  // Leave a little room below the high mark, by default
+  if (*low < 0) {
+    if (is_size) {
+      *low = *high * DEFAULT_QUOTA_LOW_FRACTION;
+    } else {
+      *low = *high - DEFAULT_USAGE_MARGIN;
+    }
+  }
+
+  return 0;
+}
+
+
+// Create a new stream, copying the options from 'defaults' (if not NULL)
+rotter_stream_t* rotter_stream_new( const rotter_stream_t *defaults )
+{
+  rotter_stream_t *stream = calloc( 1, sizeof(rotter_stream_t) );
+  if (stream == NULL) {
+    rotter_fatal( "Failed to allocate memory for stream." );
+    return NULL;
+  }
+
+  if (defaults) {
+    // Only copy the options, not the state
+    stream->channels = defaults->channels;
+    stream->bitrate = defaults->bitrate;
+    stream->autoconnect = defaults->autoconnect;
+    stream->connect_left = defaults->connect_left;
+    stream->connect_right = defaults->connect_right;
+    stream->format_name = defaults->format_name;
+    memcpy( stream->file_layouts, defaults->file_layouts, sizeof(stream->file_layouts) );
+    stream->layout_count = defaults->layout_count;
+    stream->layouts_inherited = 1;
+    stream->archive_name = defaults->archive_name;
+    stream->root_directory = defaults->root_directory;
+    stream->archive_period_seconds = defaults->archive_period_seconds;
+    stream->delete_hours = defaults->delete_hours;
+    stream->delete_usage_high = defaults->delete_usage_high;
+    stream->delete_usage_low = defaults->delete_usage_low;
+    stream->delete_quota_high = defaults->delete_quota_high;
+    stream->delete_quota_low = defaults->delete_quota_low;
+  } else {
+    stream->channels = DEFAULT_CHANNELS;
+    stream->bitrate = DEFAULT_BITRATE;
+    stream->archive_period_seconds = DEFAULT_ARCHIVE_PERIOD_SECONDS;
+    stream->delete_hours = DEFAULT_DELETE_HOURS;
+  }
+
+  stream->log_prefix = "";
+
+  return stream;
+}
+
+
+// Set a per-stream option
+// Returns 0 if the option was recognised
+int rotter_stream_option( rotter_stream_t *stream, int opt, char *arg )
+{
+  switch (opt) {
+    case 'a':  stream->autoconnect = 1; break;
+    case 'l':  stream->connect_left = arg; break;
+    case 'r':  stream->connect_right = arg; break;
+    case 'f':  stream->format_name = rotter_str_tolower(arg); break;
+    case 'b':  stream->bitrate = atoi(arg); break;
+    case 'c':  stream->channels = atoi(arg); break;
+    case 'N':  stream->archive_name = arg; break;
+    case 'L':
+      // Layouts given for a station replace the default ones
+      if (stream->layouts_inherited) {
+        stream->layout_count = 0;
+        stream->layouts_inherited = 0;
+      }
+      if (stream->layout_count >= MAX_OUTPUTS) {
+        rotter_error( "%sToo many file layouts; there can be at most %d.", stream->log_prefix, MAX_OUTPUTS );
+        return -1;
+      }
+      stream->file_layouts[stream->layout_count++] = arg;
+      break;
+    case 'p':  stream->archive_period_seconds = atol(arg); break;
+    case 'd':  stream->delete_hours = atoi(arg); break;
+    case 'm':
+      if (rotter_parse_marks( arg, 0, &stream->delete_usage_high, &stream->delete_usage_low )) {
+        rotter_error( "%sInvalid filesystem usage marks: %s", stream->log_prefix, arg );
+        return -1;
+      }
+      break;
+    case 'z':
+      if (rotter_parse_marks( arg, 1, &stream->delete_quota_high, &stream->delete_quota_low )) {
+        rotter_error( "%sInvalid archive size marks: %s", stream->log_prefix, arg );
+        return -1;
+      }
+      break;
+    default:   return -1;
+  }
+
+  return 0;
+}
+
+
+// Check the options for a stream and look up its output format
+int rotter_stream_validate( rotter_stream_t *stream )
+{
+  size_t len;
+  int i;
+
+  // Check the number of channels
+  if (stream->channels<1 || stream->channels>MAX_CHANNELS) {
+    rotter_error("%sNumber of channels should be between 1 and %d.", stream->log_prefix, MAX_CHANNELS);
+    return -1;
+  }
+
+  // Check the archive period
+  if (stream->archive_period_seconds <= 0) {
+    rotter_error("%sArchive period should be at least 1 second.", stream->log_prefix);
+    return -1;
+  }
+
+  // Check the retention marks
+  if (stream->delete_usage_high > 0 &&
+      (stream->delete_usage_high > 100 || stream->delete_usage_low < 0 ||
+       stream->delete_usage_low > stream->delete_usage_high))
+  {
+    rotter_error("%sFilesystem usage marks should be percentages, with the low mark below the high one.", stream->log_prefix);
+    return -1;
+  }
+  if (stream->delete_quota_high > 0 &&
+      (stream->delete_quota_low < 0 || stream->delete_quota_low > stream->delete_quota_high))
+  {
+    rotter_error("%sThe low archive size mark should be below the high one.", stream->log_prefix);
+    return -1;
+  }
+
+  // Check the root directory
+  if (stream->root_directory == NULL) {
+    rotter_error("%s%s requires a root directory argument.", stream->log_prefix, PACKAGE_NAME);
+    return -1;
+  }
+
+  len = strlen(stream->root_directory);
+  if (len > 1 && stream->root_directory[len-1] == '/')
+    stream->root_directory[len-1] = 0;
+
+  if (rotter_directory_exists(stream->root_directory)) {
+    rotter_debug("%sRoot directory: %s", stream->log_prefix, stream->root_directory);
+  } else {
+    rotter_error("%sRoot directory does not exist: %s", stream->log_prefix, stream->root_directory);
+    return -1;
+  }
+
+  // Search for the selected output formats
+  stream->output_count = 0;
+  if (stream->format_name) {
+    const char *name = stream->format_name;
+    while (*name) {
+      size_t name_len = strcspn( name, "," );
+      output_format_t *format = NULL;
+
+      for(i=0; format_list[i].name; i++) {
+        if (strlen( format_list[i].name ) == name_len &&
+            strncmp( format_list[i].name, name, name_len ) == 0) {
+          // Found desired format
+          format = &format_list[i];
+          rotter_debug("%sUser selected [%s] '%s'.", stream->log_prefix, format->name, format->desc);
+          break;
+        }
+      }
+      if (format==NULL) {
+        rotter_error("%sFailed to find format [%.*s], please check the supported format list.",
+                     stream->log_prefix, (int)name_len, name);
+        return -1;
+      }
+
+      for(i=0; i<stream->output_count; i++) {
+        if (stream->output_formats[i] == format) {
+          rotter_error("%sFormat [%s] is listed more than once.", stream->log_prefix, format->name);
+          return -1;
+        }
+      }
+      if (stream->output_count >= MAX_OUTPUTS) {
+        rotter_error("%sToo many formats; there can be at most %d.", stream->log_prefix, MAX_OUTPUTS);
+        return -1;
+      }
+      stream->output_formats[stream->output_count++] = format;
+
+      name += name_len;
+      if (*name == ',') name++;
+    }
+    if (stream->output_count == 0) {
+      rotter_error("%sNo output format was given.", stream->log_prefix);
+      return -1;
+    }
+  } else {
+    stream->output_formats[stream->output_count++] = &format_list[0];
+  }
+
+  // Either one layout for every format, or one for each of them
+  if (stream->layout_count == 0) {
+    stream->file_layouts[stream->layout_count++] = DEFAULT_FILE_LAYOUT;
+  }
+  if (stream->layout_count == 1) {
+    for(i=1; i<stream->output_count; i++)
+      stream->file_layouts[i] = stream->file_layouts[0];
+  } else if (stream->layout_count != stream->output_count) {
+    rotter_error("%sGive either a single file layout, or one for each format (%d).",
+                 stream->log_prefix, stream->output_count);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Add a stream to the list of streams being recorded
+int rotter_stream_add( rotter_stream_t *stream )
+{
+  rotter_stream_t **new_streams;
+
+  new_streams = realloc( streams, sizeof(rotter_stream_t*) * (stream_count+1) );
+  if (new_streams == NULL) {
+    rotter_fatal( "Failed to allocate memory for list of streams." );
+    return -1;
+  }
+
+  streams = new_streams;
+  streams[stream_count++] = stream;
+
+  return 0;
+}
+
+
+void rotter_stream_free( rotter_stream_t *stream )
+{
+  if (stream == NULL) return;
+
+  if (stream->name) {
+    free(stream->name);
+    free(stream->log_prefix);
+  }
+
+  if (stream->config_line)
+    free(stream->config_line);
+
+  if (stream->inport)
+    free(stream->inport);
+
+  if (stream->port_buffers)
+    free(stream->port_buffers);
+
+  free(stream);
+}
+
+
+/*
+  Parse a single line of a stations file:
+    <name> [options] <root_directory>
+*/
+static rotter_stream_t* rotter_parse_station( char *line, int line_num, const rotter_stream_t *defaults )
+{
+  rotter_stream_t *stream = NULL;
+  char *argv[MAX_STATIONS_LINE_LEN/2 + 1];
+  char *saveptr = NULL;
+  char *token;
+  int argc = 0;
+  int opt;
+
+  stream = rotter_stream_new( defaults );
+  if (stream == NULL)
+    return NULL;
+
+  // The options point into this copy of the line
+  stream->config_line = strdup( line );
+  if (stream->config_line == NULL) {
+    rotter_stream_free( stream );
+    return NULL;
+  }
+
+  // Split the line into words (leaving room for the NULL at the end)
+  for (token = strtok_r(stream->config_line, " \t\r\n", &saveptr);
+       token && argc < MAX_STATIONS_LINE_LEN/2;
+       token = strtok_r(NULL, " \t\r\n", &saveptr))
+  {
+    argv[argc++] = token;
+  }
+  argv[argc] = NULL;
+
+  // The first word is the name of the station, which its JACK port names start with
+  if (strlen( argv[0] ) > max_station_name_len()) {
+    rotter_error( "Station name on line %d of stations file is too long (maximum %d characters).",
+                  line_num, (int)max_station_name_len() );
+    rotter_stream_free( stream );
+    return NULL;
+  }
+  stream->name = strdup( argv[0] );
+  stream->log_prefix = malloc( strlen(argv[0]) + 3 );
+  if (stream->name == NULL || stream->log_prefix == NULL) {
+    rotter_stream_free( stream );
+    return NULL;
+  }
+  sprintf( stream->log_prefix, "%s: ", argv[0] );
+
+  // Re-initialise getopt and parse the options for this station
+  optind = 0;
+  while ((opt = getopt(argc, argv, STREAM_OPTIONS)) != -1) {
+    if (rotter_stream_option( stream, opt, optarg )) {
+      rotter_error( "Invalid option on line %d of stations file.", line_num );
+      rotter_stream_free( stream );
+      return NULL;
+    }
+  }
+
+  // The last word is the root directory
+  if (optind == argc-1) {
+    stream->root_directory = argv[optind];
+  } else if (optind < argc) {
+    rotter_error( "Unexpected arguments on line %d of stations file.", line_num );
+    rotter_stream_free( stream );
+    return NULL;
+  }
+
+  return stream;
+}
+
+
+/*
+  Read a stations file, adding a stream for each station.
+  Options that aren't given for a station are taken from 'defaults'.
+*/
+int rotter_read_stations( const char* filepath, const rotter_stream_t *defaults )
+{
+  char line[MAX_STATIONS_LINE_LEN];
+  FILE *file = NULL;
+  int line_num = 0;
+  int result = 0;
+
+  file = fopen( filepath, "r" );
+  if (file == NULL) {
+    rotter_error( "Failed to open stations file: %s (%s)", filepath, strerror(errno) );
+    return -1;
+  }
+
+  while (fgets( line, sizeof(line), file )) {
+    rotter_stream_t *stream = NULL;
+    char *start = line;
+    int i;
+
+    line_num++;
+
+    // A line without a newline didn't fit, unless it is the last line of the file
+    if (strchr( line, '\n' ) == NULL && getc( file ) != EOF) {
+      rotter_error( "Line %d of stations file is too long (maximum %d characters).",
+                    line_num, MAX_STATIONS_LINE_LEN - 2 );
+      result = -1;
+      break;
+    }
+
+    // Skip blank lines and comments
+    while (isspace(*start)) start++;
+    if (*start == '\0' || *start == '#')
+      continue;
+
+    stream = rotter_parse_station( start, line_num, defaults );
+    if (stream == NULL || rotter_stream_validate( stream )) {
+      result = -1;
+      rotter_stream_free( stream );
+      break;
+    }
+
+    // Station names are used for JACK port names, so must be unique
+    for (i=0; i<stream_count; i++) {
+      if (streams[i]->name && !strcmp(streams[i]->name, stream->name)) {
+        rotter_error( "Duplicate station name '%s' on line %d of stations file.", stream->name, line_num );
+        result = -1;
+        break;
+      }
+    }
+
+    if (result || rotter_stream_add( stream )) {
+      result = -1;
+      rotter_stream_free( stream );
+      break;
+    }
+  }
+
+  fclose( file );
+
+  if (result == 0 && stream_count == 0) {
+    rotter_error( "No stations were found in stations file: %s", filepath );
+    result = -1;
+  }
+
+  return result;
+}
@@ -42,9 +42,14 @@
 
 
 
-// ------ Globals ---------
-static twolame_options *twolame_opts = NULL;
-static unsigned char *mpeg_buffer = NULL;
+// ------ Structures ---------
+typedef struct twolame_state_s
+{
+  twolame_options *twolame_opts;
+  unsigned char *mpeg_buffer;
+  size_t mpeg_buffer_size;
+  int bitrate;
+} twolame_state_t;
 
 
 
@@ -52,15 +57,26 @@ static unsigned char *mpeg_buffer = NULL;
 /*
   Encode and write some audio from the ring buffer to disk
 */
-static int write_twolame(void *fh, size_t sample_count, jack_default_audio_sample_t *buffer[])
+static int write_twolame(encoder_funcs_t *enc, void *fh, size_t frame_count, const jack_default_audio_sample_t *buffer)
 {
-  int bytes_encoded=0, bytes_written=0;
-  FILE *file = (FILE*)fh;
+  twolame_state_t *state = (twolame_state_t*)enc->state;
+  int bytes_encoded=0;
+
+  // Make sure there is enough space for the encoded audio
+  if (MPEG_BUFFER_SIZE(frame_count) > state->mpeg_buffer_size) {
+    unsigned char *mpeg_buffer = realloc( state->mpeg_buffer, MPEG_BUFFER_SIZE(frame_count) );
+    if (!mpeg_buffer) {
+      rotter_fatal( "realloc on mpeg_buffer failed" );
+      return -1;
+    }
+    state->mpeg_buffer = mpeg_buffer;
+    state->mpeg_buffer_size = MPEG_BUFFER_SIZE(frame_count);
+  }
 
   // Encode it
-  bytes_encoded = twolame_encode_buffer_float32(
-            twolame_opts, buffer[0], buffer[1],
-            sample_count, mpeg_buffer, WRITE_BUFFER_SIZE
+  bytes_encoded = twolame_encode_buffer_float32_interleaved(
+            state->twolame_opts, buffer, frame_count,
+            state->mpeg_buffer, state->mpeg_buffer_size
   );
 
   if (bytes_encoded<0) {
@@ -68,8 +84,7 @@ static int write_twolame(void *fh, size_t sample_count, jack_default_audio_sampl
     return -1;
   } else if (bytes_encoded>0) {
     // Write it to disk
-    bytes_written = fwrite(mpeg_buffer, 1, bytes_encoded, file);
-    if (bytes_written != bytes_encoded) {
+    if (write_mpegaudio_file(fh, state->mpeg_buffer, bytes_encoded)) {
       rotter_error( "Warning: failed to write encoded audio to disk.");
       return -1;
     }
@@ -79,76 +94,120 @@ static int write_twolame(void *fh, size_t sample_count, jack_default_audio_sampl
   return 0;
 }
 
-static void deinit_twolame()
+static void deinit_twolame(encoder_funcs_t *enc)
 {
+  twolame_state_t *state = (twolame_state_t*)enc->state;
+
   rotter_debug("Shutting down TwoLAME encoder.");
-  if (twolame_opts) {
-    twolame_close( &twolame_opts );
-    twolame_opts=NULL;
-  }
+  if (state) {
+    if (state->twolame_opts) {
+      twolame_close( &state->twolame_opts );
+      state->twolame_opts=NULL;
+    }
+
+    if (state->mpeg_buffer) {
+      free(state->mpeg_buffer);
+      state->mpeg_buffer=NULL;
+    }
 
-  if (mpeg_buffer) {
-    free(mpeg_buffer);
-    mpeg_buffer=NULL;
+    free(state);
   }
+
+  free(enc);
 }
 
 
-encoder_funcs_t* init_twolame( output_format_t* format, int channels, int bitrate )
+// Create and configure a TwoLAME encoder, ready to encode a new file
+static twolame_options* setup_twolame( encoder_funcs_t *enc, int bitrate )
 {
-  encoder_funcs_t* funcs = NULL;
-
-  twolame_opts = twolame_init();
+  twolame_options *twolame_opts = twolame_init();
   if (twolame_opts==NULL) {
     rotter_error("TwoLAME error: failed to initialise.");
     return NULL;
   }
 
-  if ( 0 > twolame_set_num_channels( twolame_opts, channels ) ) {
+  if ( 0 > twolame_set_num_channels( twolame_opts, enc->channels ) ) {
     rotter_error("TwoLAME error: failed to set number of channels.");
-    deinit_twolame();
+    twolame_close( &twolame_opts );
     return NULL;
   }
 
-  if ( 0 > twolame_set_in_samplerate( twolame_opts, jack_get_sample_rate( client ) )) {
+  if ( 0 > twolame_set_in_samplerate( twolame_opts, enc->samplerate )) {
     rotter_error("TwoLAME error: failed to set input samplerate.");
-    deinit_twolame();
+    twolame_close( &twolame_opts );
     return NULL;
   }
 
-  if ( 0 > twolame_set_out_samplerate( twolame_opts, jack_get_sample_rate( client ) )) {
+  if ( 0 > twolame_set_out_samplerate( twolame_opts, enc->samplerate )) {
     rotter_error("TwoLAME error: failed to set output samplerate.");
-    deinit_twolame();
+    twolame_close( &twolame_opts );
     return NULL;
   }
 
   if ( 0 > twolame_set_brate( twolame_opts, bitrate) ) {
     rotter_error("TwoLAME error: failed to set bitrate.");
-    deinit_twolame();
+    twolame_close( &twolame_opts );
     return NULL;
   }
 
   if ( 0 > twolame_init_params( twolame_opts ) ) {
     rotter_error("TwoLAME error: failed to initialize parameters.");
-    deinit_twolame();
+    twolame_close( &twolame_opts );
     return NULL;
   }
 
+  return twolame_opts;
+}
+
 
-  rotter_debug( "Encoding using libtwolame version %s.", get_twolame_version() );
-  rotter_debug( "  Input: %d Hz, %d channels",
-            twolame_get_in_samplerate(twolame_opts),
-            twolame_get_num_channels(twolame_opts));
-  rotter_debug( "  Output: %s Layer 2, %d kbps, %s",
-            twolame_get_version_name(twolame_opts),
-            twolame_get_bitrate(twolame_opts),
-            twolame_get_mode_name(twolame_opts));
+/*
+  Flush the audio still inside the encoder into the file, then close it
+*/
+static int close_twolame(encoder_funcs_t *enc, void *fh, struct timeval *file_start)
+{
+  twolame_state_t *state = (twolame_state_t*)enc->state;
+  int bytes_encoded=0;
 
-  // Allocate memory for encoded audio
-  mpeg_buffer = malloc( 1.25*TWOLAME_SAMPLES_PER_FRAME + 7200 );
-  if ( mpeg_buffer==NULL ) {
-    rotter_error( "Failed to allocate memory for encoded audio." );
-    deinit_twolame();
+  if (fh==NULL) return -1;
+
+  bytes_encoded = twolame_encode_flush( state->twolame_opts, state->mpeg_buffer, state->mpeg_buffer_size );
+  if (bytes_encoded<0) {
+    rotter_error( "Error: while flushing encoded audio.");
+  } else if (bytes_encoded>0) {
+    if (write_mpegaudio_file(fh, state->mpeg_buffer, bytes_encoded)) {
+      rotter_error( "Warning: failed to write encoded audio to disk.");
+    }
+  }
+
+  return close_mpegaudio_file(enc, fh, file_start);
+}
+
+
+// Replace the flushed encoder with a new one for the next file
+static int reset_twolame(encoder_funcs_t *enc)
+{
+  twolame_state_t *state = (twolame_state_t*)enc->state;
+
+  if (state->twolame_opts)
+    twolame_close( &state->twolame_opts );
+
+  state->twolame_opts = setup_twolame(enc, state->bitrate);
+  if (state->twolame_opts==NULL)
+    return -1;
+
+  return 0;
+}
+
+
+encoder_funcs_t* init_twolame( output_format_t* format, int channels, int bitrate )
+{
+  encoder_funcs_t* funcs = NULL;
+  twolame_state_t* state = NULL;
+  twolame_options *twolame_opts = NULL;
+
+  // MPEG Audio only supports mono and stereo
+  if (channels > 2) {
+    rotter_error("TwoLAME error: only 1 or 2 channels are supported.");
     return NULL;
   }
 
@@ -156,17 +215,55 @@ encoder_funcs_t* init_twolame( output_format_t* format, int channels, int bitrat
   funcs = calloc( 1, sizeof(encoder_funcs_t) );
   if ( funcs==NULL ) {
     rotter_error( "Failed to allocate memory for encoder callback functions structure." );
-    deinit_twolame();
     return NULL;
   }
 
   funcs->file_suffix = "mp2";
+  funcs->channels = channels;
+  funcs->samplerate = jack_get_sample_rate( client );
   funcs->open = open_mpegaudio_file;
-  funcs->close = close_mpegaudio_file;
+  funcs->close = close_twolame;
   funcs->write = write_twolame;
   funcs->sync = sync_mpegaudio_file;
+  funcs->flush = flush_mpegaudio_file;
+  funcs->reset = reset_twolame;
   funcs->deinit = deinit_twolame;
 
+  // Allocate memory for encoder state
+  funcs->state = state = calloc( 1, sizeof(twolame_state_t) );
+  if ( state==NULL ) {
+    rotter_error( "Failed to allocate memory for encoder state." );
+    deinit_twolame(funcs);
+    return NULL;
+  }
+
+  funcs->bytes_per_second = bitrate * 1000.0 / 8;
+
+  state->bitrate = bitrate;
+  state->twolame_opts = twolame_opts = setup_twolame( funcs, bitrate );
+  if (twolame_opts==NULL) {
+    deinit_twolame(funcs);
+    return NULL;
+  }
+
+  rotter_debug( "Encoding using libtwolame version %s.", get_twolame_version() );
+  rotter_debug( "  Input: %d Hz, %d channels",
+            twolame_get_in_samplerate(twolame_opts),
+            twolame_get_num_channels(twolame_opts));
+  rotter_debug( "  Output: %s Layer 2, %d kbps, %s",
+            twolame_get_version_name(twolame_opts),
+            twolame_get_bitrate(twolame_opts),
+            twolame_get_mode_name(twolame_opts));
+
+  // Allocate memory for encoded audio
+  state->mpeg_buffer_size = MPEG_BUFFER_SIZE( TWOLAME_SAMPLES_PER_FRAME );
+  state->mpeg_buffer = malloc( state->mpeg_buffer_size );
+  if ( state->mpeg_buffer==NULL ) {
+    rotter_error( "Failed to allocate memory for encoded audio." );
+    deinit_twolame(funcs);
+    return NULL;
+  }
+
   return funcs;
 }
 